@@ -13,15 +13,19 @@ vmcall hget -x -o /fuzz dvkm.ko
 cd /fuzz
 
 echo "Downloading fuzz_dvkm" | vmcall hcat
-vmcall hget -x -o /fuzz fuzz_dvkm
+vmcall hget -x -o /fuzz fuzz_dvkm kmsg_check.so
 
 echo "Inserting dvkm.ko" | vmcall hcat
 insmod dvkm.ko
 
+echo "Tracing dvkm.ko" | vmcall hcat
+vmcall hrange --module dvkm
+
 echo "Uploading maps" | vmcall hcat
 vmcall hpush -o "modules" /proc/modules
 
 echo "Fuzz dvkm.ko" | vmcall hcat
-fuzz_dvkm
+# KASAN/UBSAN reports do not panic by default, check kernel log after each ioctl
+LD_PRELOAD=/fuzz/kmsg_check.so fuzz_dvkm
 
 # return to loader.sh, which will upload agent.log
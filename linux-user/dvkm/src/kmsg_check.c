@@ -0,0 +1,79 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * kmsg_check.c - report KASAN/UBSAN findings of the dvkm harness
+ *
+ * KASAN and UBSAN only log their reports, so a buggy ioctl() returns to the
+ * harness as if nothing happened. A background kmsg watcher does not help
+ * either, since the snapshot restore on RELEASE drops any report it has not
+ * shipped yet. fuzz_dvkm lives in the DVKM submodule, so check the kernel
+ * log from an LD_PRELOAD ioctl() wrapper instead: the report is logged
+ * before the ioctl returns, and shipped with PANIC_EXTENDED before the
+ * harness gets to RELEASE. Same as the loop in fs_fuzzer.c.
+ *
+ * Usage: LD_PRELOAD=/fuzz/kmsg_check.so fuzz_dvkm
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+static int (*real_ioctl)(int fd, unsigned long request, void *arg);
+static bool kmsg;
+
+__attribute__((constructor)) static void kmsg_check_init(void)
+{
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	if (!real_ioctl) {
+		fprintf(stderr, "[kmsg_check] Failed to resolve ioctl(): %s\n", dlerror());
+		return;
+	}
+
+	// hypercall() used by kmsg_ship() depends on detected Nyx CPU
+	nyx_cpu_type = get_nyx_cpu_type();
+
+	// only report what the harness triggers, not boot and insmod noise
+	kmsg = (kmsg_open(false) == 0);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static char crash[256];
+	va_list ap;
+	void *arg;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	ret = real_ioctl(fd, request, arg);
+
+	if (kmsg && kmsg_poll(0) > 0 && kmsg_crash_line()) {
+		snprintf(crash, sizeof(crash), "%s", kmsg_crash_line());
+		kmsg_ship();
+		kAFL_hypercall(HYPERCALL_KAFL_PANIC_EXTENDED, (uintptr_t)crash);
+	}
+	return ret;
+}
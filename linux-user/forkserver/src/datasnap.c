@@ -0,0 +1,254 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * datasnap.c - in-process snapshot of writable data for persistent loops
+ *
+ * Captures the target's writable segments (.data/.bss) at the start of the
+ * first persistent iteration and restores them after every iteration, so
+ * that global state does not carry over. Only pages marked soft-dirty in
+ * /proc/self/pagemap are copied back; kernels without CONFIG_MEM_SOFT_DIRTY
+ * fall back to copying all pages.
+ *
+ * Modes:
+ *
+ *   data - writable segments of the target binary
+ *   heap - additionally the [heap] region, the program break and the
+ *          writable segments of libc, which holds the malloc state that
+ *          describes the heap. Kernel state such as file descriptors is
+ *          not restored.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define DATASNAP_MAX_MAPS 512
+#define DATASNAP_MAX_RANGES 16
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+	uint8_t *copy;
+	bool is_heap;
+} snap_range_t;
+
+static int snap_mode;
+static snap_range_t snap_ranges[DATASNAP_MAX_RANGES];
+static int snap_num_ranges;
+static uintptr_t snap_brk;
+
+static int pagemap_fd = -1;
+static int clear_refs_fd = -1;
+static uint64_t *pagemap_buf;
+
+static struct {
+	uint64_t restores;
+	uint64_t pages_copied;
+	uint64_t pages_total;
+} snap_stats;
+
+/**
+ * Select snapshot mode, "data" or "heap". Call once in the forkserver.
+ */
+int datasnap_init(const char *mode)
+{
+	if (0 == strcmp(mode, "data") || 0 == strcmp(mode, "1")) {
+		snap_mode = DATASNAP_DATA;
+	} else if (0 == strcmp(mode, "heap")) {
+		snap_mode = DATASNAP_HEAP;
+	} else {
+		hprintf("[datasnap] Unknown mode: %s\n", mode);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void snap_add(uintptr_t start, uintptr_t end, bool is_heap)
+{
+	if (snap_num_ranges >= DATASNAP_MAX_RANGES) {
+		hprintf("[datasnap] Too many ranges, ignoring %lx-%lx\n", start, end);
+		return;
+	}
+	snap_ranges[snap_num_ranges].start = start;
+	snap_ranges[snap_num_ranges].end = end;
+	snap_ranges[snap_num_ranges].is_heap = is_heap;
+	snap_num_ranges++;
+}
+
+static bool snap_match(const nyx_map_t *map)
+{
+	const char *base = strrchr(map->path, '/');
+
+	base = base ? base + 1 : map->path;
+	if (0 == strcmp(base, target_name))
+		return true;
+
+	/* libc.so.6, libc-2.31.so */
+	return snap_mode == DATASNAP_HEAP &&
+	       (0 == strncmp(base, "libc.so", 7) || 0 == strncmp(base, "libc-", 5));
+}
+
+static void snap_find_ranges(void)
+{
+	static nyx_map_t maps[DATASNAP_MAX_MAPS];
+	int num_maps;
+	bool prev_match = false;
+
+	num_maps = maps_read("/proc/self/maps", NULL, maps, ARRAY_SIZE(maps));
+	ERRNO_FAIL_ON(num_maps < 0, "datasnap: maps_read");
+
+	for (int i = 0; i < num_maps; i++) {
+		nyx_map_t *map = &maps[i];
+		bool writable = map->perms[1] == 'w' && map->perms[3] == 'p';
+
+		if (snap_mode == DATASNAP_HEAP && 0 == strcmp(map->path, "[heap]")) {
+			snap_add(map->start, map->end, true);
+			prev_match = false;
+		} else if (writable && snap_match(map)) {
+			snap_add(map->start, map->end, false);
+			prev_match = true;
+		} else if (writable && prev_match && !map->path[0] && map->start == maps[i - 1].end) {
+			/* anonymous .bss following the file-backed .data */
+			snap_add(map->start, map->end, false);
+			prev_match = false;
+		} else {
+			prev_match = false;
+		}
+	}
+}
+
+static void snap_clear_refs(void)
+{
+	/* "4" clears soft-dirty bits of all pages */
+	if (clear_refs_fd >= 0 && write(clear_refs_fd, "4", 1) != 1) {
+		close(clear_refs_fd);
+		clear_refs_fd = -1;
+	}
+}
+
+/**
+ * Capture snapshot of the current state. Call in child before the first iteration.
+ */
+void datasnap_capture(void)
+{
+	size_t max_pages = 0;
+
+	if (!snap_mode)
+		return;
+
+	snap_find_ranges();
+	if (!snap_num_ranges) {
+		hprintf("[datasnap] No writable mappings found for %s\n", target_name);
+		return;
+	}
+
+	snap_brk = (uintptr_t)sbrk(0);
+
+	for (int i = 0; i < snap_num_ranges; i++) {
+		snap_range_t *range = &snap_ranges[i];
+		size_t len = range->end - range->start;
+
+		range->copy = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		ERRNO_FAIL_ON(range->copy == MAP_FAILED, "datasnap: mmap");
+		memcpy(range->copy, (void *)range->start, len);
+
+		if (len / PAGE_SIZE > max_pages)
+			max_pages = len / PAGE_SIZE;
+	}
+
+	pagemap_buf = mmap(NULL, max_pages * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ERRNO_FAIL_ON(pagemap_buf == MAP_FAILED, "datasnap: mmap");
+
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	snap_clear_refs();
+
+	/* clear_refs accepts "4" even without CONFIG_MEM_SOFT_DIRTY, so probe */
+	if (clear_refs_fd >= 0) {
+		uint64_t entry = 0;
+
+		pagemap_buf[0] = 1;
+		if (pagemap_fd < 0 ||
+		    pread(pagemap_fd, &entry, sizeof(entry),
+		          (uintptr_t)pagemap_buf / PAGE_SIZE * sizeof(entry)) != sizeof(entry) ||
+		    !(entry & PM_SOFT_DIRTY)) {
+			hprintf("[datasnap] Soft-dirty tracking unavailable, copying all pages\n");
+			close(clear_refs_fd);
+			clear_refs_fd = -1;
+		}
+	}
+}
+
+static void snap_restore_range(snap_range_t *range, bool copy_all)
+{
+	size_t pages = (range->end - range->start) / PAGE_SIZE;
+	off_t offset = range->start / PAGE_SIZE * sizeof(uint64_t);
+	ssize_t len = pages * sizeof(uint64_t);
+
+	snap_stats.pages_total += pages;
+
+	if (copy_all || clear_refs_fd < 0 || pagemap_fd < 0 ||
+	    pread(pagemap_fd, pagemap_buf, len, offset) != len) {
+		memcpy((void *)range->start, range->copy, range->end - range->start);
+		snap_stats.pages_copied += pages;
+		return;
+	}
+
+	for (size_t i = 0; i < pages; i++) {
+		if (pagemap_buf[i] & PM_SOFT_DIRTY) {
+			memcpy((uint8_t *)range->start + i * PAGE_SIZE, range->copy + i * PAGE_SIZE,
+			       PAGE_SIZE);
+			snap_stats.pages_copied++;
+		}
+	}
+}
+
+/**
+ * Restore snapshot. Call in child after each iteration.
+ */
+void datasnap_restore(void)
+{
+	bool brk_moved = false;
+
+	if (!snap_num_ranges)
+		return;
+
+	if (snap_mode == DATASNAP_HEAP && (uintptr_t)sbrk(0) != snap_brk) {
+		/* pages beyond a shrunk break come back clean, copy all */
+		brk_moved = true;
+		ERRNO_FAIL_ON(brk((void *)snap_brk) != 0, "datasnap: brk");
+	}
+
+	for (int i = 0; i < snap_num_ranges; i++) {
+		snap_restore_range(&snap_ranges[i], brk_moved && snap_ranges[i].is_heap);
+	}
+
+	snap_stats.restores++;
+	snap_clear_refs();
+}
+
+void datasnap_report(void)
+{
+	if (!snap_stats.restores)
+		return;
+
+	hprintf("[datasnap] %lu restores, %lu/%lu pages copied\n",
+	        snap_stats.restores, snap_stats.pages_copied, snap_stats.pages_total);
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * desock.c - serve network daemons from the payload buffer
+ *
+ * Interposes the socket API of a listening TCP server. bind() of TCP
+ * sockets succeeds without touching the guest network stack, other sockets
+ * are bound as usual. The first listen() replaces the socket with a local
+ * socketpair that always polls readable, and the first accept() on it
+ * returns a connection whose receive queue holds the payload, followed by
+ * EOF. Writes to the connection are discarded. The next accept() ends the
+ * exec with exit(0), so the server is fuzzed one connection per exec. This
+ * does not combine with the persistent loop of NYX_PERSISTENT.
+ *
+ * In framed mode, the payload is a sequence of [u16 length][data] packets
+ * and each read() or recv() on the connection returns at most one packet.
+ * Since real file descriptors are used, poll(), select() and epoll work as
+ * usual.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define DESOCK_MAX_FRAMES 1024
+#define DESOCK_PORT 8080
+
+static bool desock_framed;
+
+static const uint8_t *desock_data;
+static size_t desock_len;
+
+static int desock_listen_fd = -1;
+static int desock_listen_peer = -1;
+static int desock_conn_fd = -1;
+static int desock_conn_peer = -1;
+static unsigned desock_accepts;
+
+/* frame boundaries as offsets into the connection stream */
+static size_t desock_frames[DESOCK_MAX_FRAMES];
+static unsigned desock_num_frames;
+static unsigned desock_frame;
+static size_t desock_pos;
+
+static int (*real_bind)(int, const struct sockaddr *, socklen_t);
+static int (*real_listen)(int, int);
+static int (*real_accept)(int, struct sockaddr *, socklen_t *);
+static int (*real_accept4)(int, struct sockaddr *, socklen_t *, int);
+static int (*real_setsockopt)(int, int, int, const void *, socklen_t);
+static int (*real_getsockname)(int, struct sockaddr *, socklen_t *);
+static int (*real_getpeername)(int, struct sockaddr *, socklen_t *);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_recv)(int, void *, size_t, int);
+static ssize_t (*real_recvfrom)(int, void *, size_t, int, struct sockaddr *, socklen_t *);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_writev)(int, const struct iovec *, int);
+static ssize_t (*real_send)(int, const void *, size_t, int);
+static ssize_t (*real_sendto)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+static ssize_t (*real_sendmsg)(int, const struct msghdr *, int);
+static int (*real_close)(int);
+
+/**
+ * Enable socket emulation. Call once before the snapshot is taken.
+ */
+void desock_init(bool framed)
+{
+	desock_framed = framed;
+	hprintf("[desock] Serving connections from payload (%s)\n", framed ? "framed" : "stream");
+}
+
+/**
+ * Set payload of the connection returned by accept(). Call in child before main().
+ */
+void desock_exec_begin(const uint8_t *data, size_t len)
+{
+	desock_data = data;
+	desock_len = len;
+	desock_accepts = 0;
+}
+
+static bool desock_is_conn(int fd)
+{
+	return fd >= 0 && fd == desock_conn_fd;
+}
+
+static bool desock_is_sock(int fd)
+{
+	return desock_data && fd >= 0 && (fd == desock_listen_fd || fd == desock_conn_fd);
+}
+
+static void desock_fake_addr(struct sockaddr *addr, socklen_t *addrlen, uint16_t port)
+{
+	struct sockaddr_in sin;
+
+	if (!addr || !addrlen)
+		return;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	memcpy(addr, &sin, *addrlen < sizeof(sin) ? *addrlen : sizeof(sin));
+	*addrlen = sizeof(sin);
+}
+
+/*
+ * Split framed payload into the connection stream and record frame ends.
+ * The stream is the payload with length headers stripped.
+ */
+static size_t desock_unframe(uint8_t *stream)
+{
+	size_t in = 0;
+	size_t out = 0;
+
+	desock_num_frames = 0;
+	while (in + sizeof(uint16_t) <= desock_len && desock_num_frames < DESOCK_MAX_FRAMES) {
+		uint16_t len;
+
+		memcpy(&len, desock_data + in, sizeof(len));
+		in += sizeof(len);
+		if (len > desock_len - in)
+			len = desock_len - in;
+
+		memcpy(stream + out, desock_data + in, len);
+		in += len;
+		out += len;
+		desock_frames[desock_num_frames++] = out;
+	}
+
+	/* excess frames are delivered as one */
+	if (in < desock_len) {
+		memcpy(stream + out, desock_data + in, desock_len - in);
+		out += desock_len - in;
+		desock_frames[desock_num_frames++] = out;
+	}
+	return out;
+}
+
+static int desock_connect(void)
+{
+	int sv[2];
+	int ret;
+	size_t len = desock_len;
+	const uint8_t *stream = desock_data;
+	uint8_t *buf = NULL;
+	int sndbuf = desock_len + PAGE_SIZE;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	ERRNO_FAIL_ON(ret == -1, "desock: socketpair");
+
+	if (desock_framed) {
+		buf = malloc(desock_len + 1);
+		ERRNO_FAIL_ON(!buf, "desock: malloc");
+		len = desock_unframe(buf);
+		stream = buf;
+	}
+
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	for (size_t done = 0; done < len;) {
+		ret = NEXT(write)(sv[1], stream + done, len - done);
+		ERRNO_FAIL_ON(ret <= 0, "desock: write");
+		done += ret;
+	}
+	free(buf);
+
+	/* EOF after payload, but let server writes succeed */
+	shutdown(sv[1], SHUT_WR);
+
+	desock_conn_fd = sv[0];
+	desock_conn_peer = sv[1];
+	desock_frame = 0;
+	desock_pos = 0;
+	return sv[0];
+}
+
+/* limit reads to the current frame */
+static size_t desock_read_len(size_t len)
+{
+	if (!desock_framed || desock_frame >= desock_num_frames)
+		return len;
+
+	if (len > desock_frames[desock_frame] - desock_pos)
+		len = desock_frames[desock_frame] - desock_pos;
+	return len;
+}
+
+static void desock_read_done(ssize_t ret)
+{
+	if (!desock_framed || ret <= 0)
+		return;
+
+	desock_pos += ret;
+	while (desock_frame < desock_num_frames && desock_pos >= desock_frames[desock_frame])
+		desock_frame++;
+}
+
+static bool desock_is_tcp(int fd, const struct sockaddr *addr)
+{
+	socklen_t len = sizeof(int);
+	int type;
+
+	if (!addr || (addr->sa_family != AF_INET && addr->sa_family != AF_INET6))
+		return false;
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+/*
+ * Listening socket
+ */
+EXPORT int bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	/* no network required for the server socket, UDP and AF_UNIX are real */
+	if (desock_data && desock_is_tcp(fd, addr))
+		return 0;
+	CALL_NEXT(bind, -1, fd, addr, addrlen);
+}
+
+EXPORT int listen(int fd, int backlog)
+{
+	int sv[2];
+	int ret;
+
+	/* only the first listener is served, others never see a connection */
+	if (!desock_data || desock_listen_fd >= 0)
+		CALL_NEXT(listen, -1, fd, backlog);
+
+	/* replace with a socket that always polls readable */
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	ERRNO_FAIL_ON(ret == -1, "desock: socketpair");
+	ret = NEXT(write)(sv[1], "", 1);
+	ERRNO_FAIL_ON(ret != 1, "desock: write");
+
+	ret = dup2(sv[0], fd);
+	ERRNO_FAIL_ON(ret == -1, "desock: dup2");
+	NEXT(close)(sv[0]);
+
+	desock_listen_fd = fd;
+	desock_listen_peer = sv[1];
+	return 0;
+}
+
+EXPORT int accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+	int conn;
+
+	if (!desock_data || fd != desock_listen_fd)
+		CALL_NEXT(accept4, -1, fd, addr, addrlen, flags);
+
+	/* server is done with the connection: end of exec */
+	if (desock_accepts++)
+		exit(0);
+
+	conn = desock_connect();
+	if (flags & SOCK_NONBLOCK)
+		fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+	if (flags & SOCK_CLOEXEC)
+		fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+	desock_fake_addr(addr, addrlen, DESOCK_PORT + 1);
+	return conn;
+}
+
+EXPORT int accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	if (!desock_data || fd != desock_listen_fd)
+		CALL_NEXT(accept, -1, fd, addr, addrlen);
+
+	return accept4(fd, addr, addrlen, 0);
+}
+
+EXPORT int setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen)
+{
+	/* TCP options are not supported on the local socketpair */
+	if (desock_is_sock(fd))
+		return 0;
+	CALL_NEXT(setsockopt, -1, fd, level, optname, optval, optlen);
+}
+
+EXPORT int getsockname(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	if (desock_is_sock(fd)) {
+		desock_fake_addr(addr, addrlen, DESOCK_PORT);
+		return 0;
+	}
+	CALL_NEXT(getsockname, -1, fd, addr, addrlen);
+}
+
+EXPORT int getpeername(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	if (desock_is_sock(fd)) {
+		desock_fake_addr(addr, addrlen, DESOCK_PORT + 1);
+		return 0;
+	}
+	CALL_NEXT(getpeername, -1, fd, addr, addrlen);
+}
+
+EXPORT int close(int fd)
+{
+	if (desock_is_conn(fd)) {
+		NEXT(close)(desock_conn_peer);
+		desock_conn_fd = desock_conn_peer = -1;
+	} else if (desock_data && fd >= 0 && fd == desock_listen_fd) {
+		NEXT(close)(desock_listen_peer);
+		desock_listen_fd = desock_listen_peer = -1;
+	}
+	CALL_NEXT(close, -1, fd);
+}
+
+/*
+ * Connection input
+ */
+EXPORT ssize_t read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+
+	if (!desock_is_conn(fd))
+		CALL_NEXT(read, -1, fd, buf, count);
+
+	ret = NEXT(read)(fd, buf, desock_read_len(count));
+	desock_read_done(ret);
+	return ret;
+}
+
+EXPORT ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+	ssize_t ret;
+
+	if (!desock_is_conn(fd))
+		CALL_NEXT(recv, -1, fd, buf, len, flags);
+
+	ret = NEXT(recv)(fd, buf, desock_read_len(len), flags);
+	if (!(flags & MSG_PEEK))
+		desock_read_done(ret);
+	return ret;
+}
+
+EXPORT ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr,
+                 socklen_t *addrlen)
+{
+	if (!desock_is_conn(fd))
+		CALL_NEXT(recvfrom, -1, fd, buf, len, flags, addr, addrlen);
+
+	desock_fake_addr(addr, addrlen, DESOCK_PORT + 1);
+	return recv(fd, buf, len, flags);
+}
+
+/*
+ * Connection output is discarded
+ */
+EXPORT ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (desock_is_conn(fd))
+		return count;
+	CALL_NEXT(write, -1, fd, buf, count);
+}
+
+EXPORT ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	if (desock_is_conn(fd)) {
+		ssize_t len = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			len += iov[i].iov_len;
+		}
+		return len;
+	}
+	CALL_NEXT(writev, -1, fd, iov, iovcnt);
+}
+
+EXPORT ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+	if (desock_is_conn(fd))
+		return len;
+	CALL_NEXT(send, -1, fd, buf, len, flags);
+}
+
+EXPORT ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr,
+               socklen_t addrlen)
+{
+	if (desock_is_conn(fd))
+		return len;
+	CALL_NEXT(sendto, -1, fd, buf, len, flags, addr, addrlen);
+}
+
+EXPORT ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	if (desock_is_conn(fd))
+		return writev(fd, msg->msg_iov, msg->msg_iovlen);
+	CALL_NEXT(sendmsg, -1, fd, msg, flags);
+}
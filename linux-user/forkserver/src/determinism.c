@@ -0,0 +1,455 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * determinism.c - virtualize sources of nondeterminism in the target
+ *
+ * Interposes the libc entry points for time, randomness and process IDs and
+ * answers them with fixed, payload-independent values. Time is a virtual
+ * clock advancing by a fixed step per query, so that timeout loops in the
+ * target still terminate. Since every exec is forked from the same parent
+ * state, the virtual sources start from identical state in every exec.
+ *
+ * Sources are selected with a comma-separated list. Without NYX_DETERMINISM,
+ * only rand is virtualized, as the former rand()/random() stubs did, and
+ * "none" disables all:
+ *
+ *   rand      - rand(), random(), srand(), srandom()
+ *   time      - time(), gettimeofday(), clock_gettime()
+ *   urandom   - open()/fopen() of /dev/urandom and /dev/random read /dev/zero
+ *   getrandom - getrandom(), getentropy(), arc4random()
+ *   pid       - getpid() returns a fixed value (breaks kill(getpid(), ..))
+ *
+ * dtm_check() re-runs the current input in forked replicas and reports
+ * inputs whose exit status or output differs between runs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define DTM_EPOCH 1640995200ULL /* 2022-01-01 00:00:00 UTC */
+#define DTM_CLOCK_STEP_NS 1000 /* virtual time per clock query */
+#define DTM_SEED 0x6e79782d64746dULL
+#define DTM_FIXED_PID 4242
+#define DTM_RANDOM_DEV "/dev/zero"
+
+static unsigned dtm_flags = DTM_RAND;
+static uint64_t dtm_clock_ns;
+static uint64_t dtm_rand_state = DTM_SEED;
+
+bool dtm_replica = false;
+
+static int (*real_rand)(void);
+static long (*real_random)(void);
+static void (*real_srand)(unsigned);
+static void (*real_srandom)(unsigned);
+static time_t (*real_time)(time_t *);
+static int (*real_gettimeofday)(struct timeval *, void *);
+static int (*real_clock_gettime)(clockid_t, struct timespec *);
+static ssize_t (*real_getrandom)(void *, size_t, unsigned);
+static int (*real_getentropy)(void *, size_t);
+static pid_t (*real_getpid)(void);
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_openat64)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static FILE *(*real_fopen64)(const char *, const char *);
+
+static const struct {
+	const char *name;
+	unsigned flag;
+} dtm_sources[] = {
+	{ "rand", DTM_RAND },
+	{ "time", DTM_TIME },
+	{ "urandom", DTM_URANDOM },
+	{ "getrandom", DTM_GETRANDOM },
+	{ "pid", DTM_PID },
+};
+
+/**
+ * Select virtualized sources from comma-separated spec, "none" disables all
+ */
+int dtm_init(const char *spec)
+{
+	char buf[256];
+	char *tok, *saveptr;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	dtm_flags = 0;
+	for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		unsigned i;
+
+		if (0 == strcmp(tok, "none"))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(dtm_sources); i++) {
+			if (0 == strcmp(tok, dtm_sources[i].name)) {
+				dtm_flags |= dtm_sources[i].flag;
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(dtm_sources)) {
+			hprintf("[dtm] Unknown determinism source: %s\n", tok);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	hprintf("[dtm] Determinism layer: %s (0x%x)\n", spec, dtm_flags);
+	return 0;
+}
+
+/**
+ * Reset virtual clock and PRNG. Call at the start of each execution.
+ */
+void dtm_exec_begin(void)
+{
+	dtm_clock_ns = 0;
+	dtm_rand_state = DTM_SEED;
+}
+
+static uint64_t dtm_next(void)
+{
+	/* splitmix64 */
+	uint64_t z = (dtm_rand_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void dtm_fill(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		uint64_t r = dtm_next();
+		size_t n = len < sizeof(r) ? len : sizeof(r);
+		memcpy(p, &r, n);
+		p += n;
+		len -= n;
+	}
+}
+
+static uint64_t dtm_clock(void)
+{
+	dtm_clock_ns += DTM_CLOCK_STEP_NS;
+	return dtm_clock_ns;
+}
+
+static const char *dtm_path(const char *path)
+{
+	if ((dtm_flags & DTM_URANDOM) && path &&
+	    (0 == strcmp(path, "/dev/urandom") || 0 == strcmp(path, "/dev/random")))
+		return DTM_RANDOM_DEV;
+	return path;
+}
+
+/*
+ * rand
+ */
+EXPORT int rand(void)
+{
+	if (dtm_flags & DTM_RAND)
+		return dtm_next() & RAND_MAX;
+	CALL_NEXT(rand, 0);
+}
+
+EXPORT long random(void)
+{
+	if (dtm_flags & DTM_RAND)
+		return dtm_next() & RAND_MAX;
+	CALL_NEXT(random, 0);
+}
+
+EXPORT void srand(unsigned seed)
+{
+	/* seeds tend to come from time() or getpid(), so ignore them */
+	if (dtm_flags & DTM_RAND) {
+		dtm_rand_state = DTM_SEED;
+		return;
+	}
+	if (NEXT(srand))
+		real_srand(seed);
+}
+
+EXPORT void srandom(unsigned seed)
+{
+	if (dtm_flags & DTM_RAND) {
+		dtm_rand_state = DTM_SEED;
+		return;
+	}
+	if (NEXT(srandom))
+		real_srandom(seed);
+}
+
+/*
+ * time
+ */
+EXPORT time_t time(time_t *tloc)
+{
+	if (dtm_flags & DTM_TIME) {
+		time_t t = DTM_EPOCH + dtm_clock() / 1000000000ULL;
+		if (tloc)
+			*tloc = t;
+		return t;
+	}
+	CALL_NEXT(time, -1, tloc);
+}
+
+EXPORT int gettimeofday(struct timeval *tv, void *tz)
+{
+	if (dtm_flags & DTM_TIME) {
+		uint64_t ns = dtm_clock();
+		tv->tv_sec = DTM_EPOCH + ns / 1000000000ULL;
+		tv->tv_usec = (ns % 1000000000ULL) / 1000;
+		return 0;
+	}
+	CALL_NEXT(gettimeofday, -1, tv, tz);
+}
+
+EXPORT int clock_gettime(clockid_t clk, struct timespec *tp)
+{
+	if (dtm_flags & DTM_TIME) {
+		uint64_t ns = dtm_clock();
+		uint64_t base = (clk == CLOCK_REALTIME || clk == CLOCK_REALTIME_COARSE) ? DTM_EPOCH : 0;
+		tp->tv_sec = base + ns / 1000000000ULL;
+		tp->tv_nsec = ns % 1000000000ULL;
+		return 0;
+	}
+	CALL_NEXT(clock_gettime, -1, clk, tp);
+}
+
+/*
+ * getrandom
+ */
+EXPORT ssize_t getrandom(void *buf, size_t buflen, unsigned flags)
+{
+	if (dtm_flags & DTM_GETRANDOM) {
+		dtm_fill(buf, buflen);
+		return buflen;
+	}
+	CALL_NEXT(getrandom, -1, buf, buflen, flags);
+}
+
+EXPORT int getentropy(void *buf, size_t buflen)
+{
+	if (dtm_flags & DTM_GETRANDOM) {
+		if (buflen > 256) {
+			errno = EIO;
+			return -1;
+		}
+		dtm_fill(buf, buflen);
+		return 0;
+	}
+	CALL_NEXT(getentropy, -1, buf, buflen);
+}
+
+/* glibc >= 2.36 draws these from the getrandom syscall directly */
+EXPORT uint32_t arc4random(void)
+{
+	uint32_t r;
+
+	if (dtm_flags & DTM_GETRANDOM)
+		return dtm_next();
+
+	if (getrandom(&r, sizeof(r), 0) != sizeof(r))
+		habort("arc4random: getrandom() failed");
+	return r;
+}
+
+EXPORT void arc4random_buf(void *buf, size_t n)
+{
+	if (dtm_flags & DTM_GETRANDOM) {
+		dtm_fill(buf, n);
+		return;
+	}
+
+	for (size_t done = 0; done < n;) {
+		ssize_t ret = getrandom((uint8_t *)buf + done, n - done, 0);
+		if (ret < 0)
+			habort("arc4random_buf: getrandom() failed");
+		done += ret;
+	}
+}
+
+EXPORT uint32_t arc4random_uniform(uint32_t upper_bound)
+{
+	uint32_t r, min;
+
+	if (upper_bound < 2)
+		return 0;
+
+	/* reject values below 2^32 % upper_bound to avoid modulo bias */
+	min = -upper_bound % upper_bound;
+	do {
+		r = arc4random();
+	} while (r < min);
+
+	return r % upper_bound;
+}
+
+/*
+ * pid
+ */
+EXPORT pid_t getpid(void)
+{
+	if (dtm_flags & DTM_PID)
+		return DTM_FIXED_PID;
+	CALL_NEXT(getpid, -1);
+}
+
+/*
+ * urandom
+ */
+static mode_t dtm_open_mode(int flags, va_list ap)
+{
+	/* O_TMPFILE includes O_DIRECTORY, same test as glibc */
+	if ((flags & O_CREAT) || (flags & __O_TMPFILE) == __O_TMPFILE)
+		return va_arg(ap, int);
+	return 0;
+}
+
+EXPORT int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start(ap, flags);
+	mode = dtm_open_mode(flags, ap);
+	va_end(ap);
+
+	CALL_NEXT(open, -1, dtm_path(path), flags, mode);
+}
+
+EXPORT int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start(ap, flags);
+	mode = dtm_open_mode(flags, ap);
+	va_end(ap);
+
+	CALL_NEXT(open64, -1, dtm_path(path), flags, mode);
+}
+
+EXPORT int openat(int dirfd, const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start(ap, flags);
+	mode = dtm_open_mode(flags, ap);
+	va_end(ap);
+
+	CALL_NEXT(openat, -1, dirfd, dtm_path(path), flags, mode);
+}
+
+EXPORT int openat64(int dirfd, const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start(ap, flags);
+	mode = dtm_open_mode(flags, ap);
+	va_end(ap);
+
+	CALL_NEXT(openat64, -1, dirfd, dtm_path(path), flags, mode);
+}
+
+EXPORT FILE *fopen(const char *path, const char *mode)
+{
+	CALL_NEXT(fopen, NULL, dtm_path(path), mode);
+}
+
+EXPORT FILE *fopen64(const char *path, const char *mode)
+{
+	CALL_NEXT(fopen64, NULL, dtm_path(path), mode);
+}
+
+/*
+ * Stability check
+ */
+static uint32_t dtm_hash_fd(int fd)
+{
+	uint32_t hash = 0x811c9dc5;
+	uint8_t buf[4096];
+	ssize_t len;
+
+	lseek(fd, 0, SEEK_SET);
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < len; i++) {
+			hash = (hash ^ buf[i]) * 0x01000193;
+		}
+	}
+	return hash;
+}
+
+/**
+ * Run the current input runs times in forked replicas and compare exit status
+ * and stdout/stderr output. Call in the exec child, after payload delivery.
+ */
+void dtm_check(int (*main_fn)(int, char **, char **), int argc, char **argv, char **envp,
+               unsigned runs, const struct itimerval *timer)
+{
+	int first_status = 0;
+	uint32_t first_hash = 0;
+
+	for (unsigned i = 0; i < runs; i++) {
+		int status = 0;
+		uint32_t hash;
+		pid_t pid;
+		int fd;
+
+		fd = memfd_create("dtm_output", 0);
+		ERRNO_FAIL_ON(fd == -1, "memfd_create");
+
+		pid = fork();
+		ERRNO_FAIL_ON(pid == -1, "fork");
+
+		if (!pid) {
+			dtm_replica = true;
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			setitimer(ITIMER_VIRTUAL, timer, NULL);
+			exit(main_fn(argc, argv, envp));
+		}
+
+		waitpid(pid, &status, 0);
+		hash = dtm_hash_fd(fd);
+		close(fd);
+
+		if (i == 0) {
+			first_status = status;
+			first_hash = hash;
+		} else if (status != first_status || hash != first_hash) {
+			hprintf("[dtm] Unstable input: run %u status 0x%x output 0x%08x, "
+			        "run 0 status 0x%x output 0x%08x\n",
+			        i, status, hash, first_status, first_hash);
+			return;
+		}
+	}
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * dict.c - harvest dictionary tokens from the target's string comparisons
+ *
+ * Interposes strcmp() and friends. During the first warmup execs, and on
+ * every sample-th exec later on, constant operands located in read-only
+ * segments of the target are collected into a deduplicated token table.
+ * The table lives in shared memory excluded from snapshot restore, and is
+ * pushed to the host as an AFL-style dictionary once warmup is complete
+ * and whenever later samples add new tokens.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define DICT_MIN_TOKEN 2
+#define DICT_MAX_TOKEN 32
+#define DICT_MAX_TOKENS 1024
+#define DICT_HASH_SLOTS (4 * DICT_MAX_TOKENS)
+#define DICT_MAX_RANGES 16
+#define DICT_TMP_FILE "/tmp/forkserver.dict"
+
+typedef struct {
+	uint8_t len;
+	uint8_t data[DICT_MAX_TOKEN];
+} dict_token_t;
+
+typedef struct {
+	uint64_t execs;
+	uint32_t num_tokens;
+	uint32_t dirty;
+	uint16_t slots[DICT_HASH_SLOTS]; /* token index + 1 */
+	dict_token_t tokens[DICT_MAX_TOKENS];
+} dict_state_t;
+
+static dict_state_t *dict;
+static size_t dict_pages;
+static unsigned dict_warmup;
+static unsigned dict_sample;
+static bool dict_active;
+
+static struct {
+	uintptr_t start;
+	uintptr_t end;
+} dict_ranges[DICT_MAX_RANGES];
+static int dict_num_ranges;
+
+static int simple_memcmp(const void *s1, const void *s2, size_t n);
+
+static bool dict_is_const(const void *ptr)
+{
+	for (int i = 0; i < dict_num_ranges; i++) {
+		if ((uintptr_t)ptr >= dict_ranges[i].start && (uintptr_t)ptr < dict_ranges[i].end)
+			return true;
+	}
+	return false;
+}
+
+static void dict_add(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	if (len < DICT_MIN_TOKEN || len > DICT_MAX_TOKEN)
+		return;
+
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ data[i]) * 0x01000193;
+	}
+
+	for (unsigned i = 0; i < DICT_HASH_SLOTS; i++) {
+		uint16_t *slot = &dict->slots[(hash + i) % DICT_HASH_SLOTS];
+
+		if (*slot == 0) {
+			if (dict->num_tokens >= DICT_MAX_TOKENS)
+				return;
+
+			dict_token_t *token = &dict->tokens[dict->num_tokens++];
+			token->len = len;
+			memcpy(token->data, data, len);
+			*slot = dict->num_tokens;
+			dict->dirty = 1;
+			return;
+		}
+
+		dict_token_t *token = &dict->tokens[*slot - 1];
+		if (token->len == len && 0 == simple_memcmp(token->data, data, len))
+			return;
+	}
+}
+
+static void dict_collect(const void *s1, const void *s2, size_t len, bool is_str)
+{
+	const void *ops[2] = { s1, s2 };
+
+	for (int i = 0; i < 2; i++) {
+		if (dict_is_const(ops[i])) {
+			size_t n = len;
+			if (is_str && (n = strnlen(ops[i], DICT_MAX_TOKEN + 1)) > len)
+				n = len;
+			dict_add(ops[i], n);
+		}
+	}
+}
+
+static void dict_write(void)
+{
+	FILE *f = fopen(DICT_TMP_FILE, "w");
+	if (!f) {
+		hprintf("[dict] Failed to open %s: %s\n", DICT_TMP_FILE, strerror(errno));
+		return;
+	}
+
+	for (uint32_t i = 0; i < dict->num_tokens; i++) {
+		dict_token_t *token = &dict->tokens[i];
+
+		fprintf(f, "token_%u=\"", i);
+		for (int j = 0; j < token->len; j++) {
+			uint8_t c = token->data[j];
+			if (isprint(c) && c != '"' && c != '\\')
+				fputc(c, f);
+			else
+				fprintf(f, "\\x%02x", c);
+		}
+		fputs("\"\n", f);
+	}
+	fclose(f);
+
+	hprintf("[dict] Pushing %u tokens after %lu execs\n", dict->num_tokens, dict->execs);
+	hpush_file(DICT_TMP_FILE, "forkserver.dict", 0);
+}
+
+/**
+ * Allocate persistent token table and locate target's read-only segments
+ *
+ * warmup - collect tokens in the first warmup execs
+ * sample - afterwards, collect on every sample-th exec (0 = never)
+ */
+int dict_init(unsigned warmup, unsigned sample)
+{
+	nyx_map_t maps[64];
+	int num_maps;
+
+	num_maps = maps_read("/proc/self/maps", target_name, maps, ARRAY_SIZE(maps));
+	for (int i = 0; i < num_maps && dict_num_ranges < DICT_MAX_RANGES; i++) {
+		if (maps[i].perms[0] == 'r' && maps[i].perms[1] == '-') {
+			dict_ranges[dict_num_ranges].start = maps[i].start;
+			dict_ranges[dict_num_ranges].end = maps[i].end;
+			dict_num_ranges++;
+		}
+	}
+	if (dict_num_ranges == 0) {
+		hprintf("[dict] No read-only mappings found for %s\n", target_name);
+		return -ENOENT;
+	}
+
+	dict_pages = (sizeof(dict_state_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+	dict = malloc_shared_pages(dict_pages);
+	if (!dict)
+		return -ENOMEM;
+
+	memset(dict, 0, dict_pages * PAGE_SIZE);
+	persist_pages(dict, dict_pages);
+
+	dict_warmup = warmup;
+	dict_sample = sample;
+	return 0;
+}
+
+/**
+ * Decide if this exec collects tokens. Call in child before main().
+ */
+void dict_exec_begin(void)
+{
+	if (!dict)
+		return;
+
+	dict->execs++;
+
+	if (dict->execs > dict_warmup && dict->dirty) {
+		dict->dirty = 0;
+		dict_write();
+	}
+
+	dict_active = dict->execs <= dict_warmup ||
+	              (dict_sample && (dict->execs % dict_sample) == 0);
+}
+
+/*
+ * Interposed comparison functions. Until the real implementations are
+ * resolved, e.g. in constructors of other libraries, we use plain C loops.
+ */
+static int simple_memcmp(const void *s1, const void *s2, size_t n)
+{
+	const uint8_t *a = s1;
+	const uint8_t *b = s2;
+
+	for (size_t i = 0; i < n; i++) {
+		if (a[i] != b[i])
+			return a[i] - b[i];
+	}
+	return 0;
+}
+
+static int simple_strncmp(const char *s1, const char *s2, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (s1[i] != s2[i] || !s1[i])
+			return (uint8_t)s1[i] - (uint8_t)s2[i];
+	}
+	return 0;
+}
+
+static int simple_strcmp(const char *s1, const char *s2)
+{
+	return simple_strncmp(s1, s2, SIZE_MAX);
+}
+
+static int simple_strncasecmp(const char *s1, const char *s2, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		int c1 = tolower((uint8_t)s1[i]);
+		int c2 = tolower((uint8_t)s2[i]);
+		if (c1 != c2 || !c1)
+			return c1 - c2;
+	}
+	return 0;
+}
+
+static int simple_strcasecmp(const char *s1, const char *s2)
+{
+	return simple_strncasecmp(s1, s2, SIZE_MAX);
+}
+
+#define simple_bcmp simple_memcmp
+
+/* real implementations, resolved when forkserver.so is loaded */
+static int (*real_strcmp)(const char *, const char *) = simple_strcmp;
+static int (*real_strncmp)(const char *, const char *, size_t) = simple_strncmp;
+static int (*real_strcasecmp)(const char *, const char *) = simple_strcasecmp;
+static int (*real_strncasecmp)(const char *, const char *, size_t) = simple_strncasecmp;
+static int (*real_memcmp)(const void *, const void *, size_t) = simple_memcmp;
+static int (*real_bcmp)(const void *, const void *, size_t) = simple_bcmp;
+
+#define RESOLVE(func)                                \
+	do {                                             \
+		void *sym = resolve_next(#func);             \
+		if (sym)                                     \
+			real_##func = sym;                       \
+	} while (0)
+
+__attribute__((constructor)) static void dict_resolve(void)
+{
+	RESOLVE(strcmp);
+	RESOLVE(strncmp);
+	RESOLVE(strcasecmp);
+	RESOLVE(strncasecmp);
+	RESOLVE(memcmp);
+	RESOLVE(bcmp);
+}
+
+/* fast path is a single flag test and a tail call into libc */
+EXPORT int strcmp(const char *s1, const char *s2)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, SIZE_MAX, true);
+	return real_strcmp(s1, s2);
+}
+
+EXPORT int strncmp(const char *s1, const char *s2, size_t n)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, n, true);
+	return real_strncmp(s1, s2, n);
+}
+
+EXPORT int strcasecmp(const char *s1, const char *s2)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, SIZE_MAX, true);
+	return real_strcasecmp(s1, s2);
+}
+
+EXPORT int strncasecmp(const char *s1, const char *s2, size_t n)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, n, true);
+	return real_strncasecmp(s1, s2, n);
+}
+
+EXPORT int memcmp(const void *s1, const void *s2, size_t n)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, n, false);
+	return real_memcmp(s1, s2, n);
+}
+
+EXPORT int bcmp(const void *s1, const void *s2, size_t n)
+{
+	if (__builtin_expect(dict_active, 0))
+		dict_collect(s1, s2, n, false);
+	return real_bcmp(s1, s2, n);
+}
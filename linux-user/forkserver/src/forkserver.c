@@ -25,36 +25,98 @@
 
 #include <sys/stat.h>
 #include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "nyx_api.h"
+#include "nyx_batch.h"
 #include "nyx_agent.h"
+#include "forkserver.h"
 
-#define ASAN_EXIT_CODE 101
 //#define REDIRECT_STDERR_TO_HPRINTF
 //#define REDIRECT_STDOUT_TO_HPRINTF
 
 #define PAYLOAD_MAX_SIZE (128 * 1024)
 
 char output_filename[] = "/tmp/payload"; // = getenv()
-uint8_t stdin_mode = 0;
+char *target_name = NULL;                 // = getenv("NYX_TARGET")
+bool stdin_mode = false; // = getenv("NYX_STDIN")
+uint32_t payload_size = PAYLOAD_MAX_SIZE; // = host_config.payload_buffer_size
+int stdin_pipe[2] = { -1, -1 };
+bool desock_mode = false; // = getenv("NYX_DESOCK")
 
-const bool allow_persistent = false; // = getenv()
+bool allow_persistent = false;
+unsigned persistent_iters = 1; // = getenv("NYX_PERSISTENT")
 
-//extern uint32_t memlimit;
+bool cmplog_mode = false; // = getenv("NYX_CMPLOG")
+char cmplog_name[32] = "cmplog.bin";
 
-long int random(void)
+unsigned dtm_check_runs = 0; // = getenv("NYX_DETERMINISM_CHECK")
+
+bool agent_trace = false; // = getenv("NYX_AGENT_TRACE")
+unsigned calibrate_runs = 0; // = getenv("NYX_CALIBRATE")
+unsigned calibrate_execs = 0; // = getenv("NYX_CALIBRATE_EXECS")
+char trace_mask_name[32] = "trace_mask.bin";
+
+unsigned havoc_runs = 0; // = getenv("NYX_HAVOC")
+char havoc_name[32] = "havoc";
+uint32_t havoc_seed = 0;
+kAFL_payload *havoc_buffer = NULL;
+
+bool batch_mode = false; // = getenv("NYX_BATCH")
+kAFL_payload *batch_buffer = NULL;
+
+bool replay_mode = false; // = getenv("NYX_REPLAY")
+char *replay_dir = NULL;
+
+typedef enum {
+	EXEC_OK,
+	EXEC_CRASH,
+	EXEC_TIMEOUT,
+	EXEC_SANITIZER,
+	EXEC_OOM,
+} exec_class_t;
+
+#undef hprintf
+#undef habort
+
+void fs_hprintf(const char *format, ...)
 {
-	return 0;
+	va_list args;
+
+	va_start(args, format);
+	if (replay_mode) {
+		vfprintf(stderr, format, args);
+	} else {
+		char buf[HPRINTF_MAX_SIZE];
+		vsnprintf(buf, sizeof(buf), format, args);
+		hprintf("%s", buf);
+	}
+	va_end(args);
 }
-int rand(void)
+
+void fs_habort(char *msg)
 {
-	return 0;
+	if (replay_mode) {
+		fprintf(stderr, "Abort: %s\n", msg);
+		exit(1);
+	}
+	habort(msg);
 }
 
+#define hprintf fs_hprintf
+#define habort fs_habort
+
 // TODO - refactor into reusable lib component
 int agent_init(int verbose)
 {
 	static host_config_t host_config __attribute__((aligned(PAGE_SIZE)));
+	int ret;
+
 	memset(&host_config, 0, sizeof(host_config));
 
 	get_nyx_cpu_type();
@@ -75,6 +137,11 @@ int agent_init(int verbose)
 		fprintf(stderr, "\tworker id: %d\n", host_config.worker_id);
 	}
 
+	snprintf(cmplog_name, sizeof(cmplog_name), "cmplog_%u.bin", host_config.worker_id);
+	snprintf(trace_mask_name, sizeof(trace_mask_name), "trace_mask_%u.bin", host_config.worker_id);
+	snprintf(havoc_name, sizeof(havoc_name), "havoc_%u", host_config.worker_id);
+	havoc_seed = host_config.worker_id;
+
 	if (host_config.host_magic != NYX_HOST_MAGIC) {
 		hprintf("HOST_MAGIC mismatch: %08x != %08x\n", host_config.host_magic, NYX_HOST_MAGIC);
 		habort("HOST_MAGIC mismatch!");
@@ -90,13 +157,15 @@ int agent_init(int verbose)
 	}
 
 	if (host_config.payload_buffer_size > PAYLOAD_MAX_SIZE) {
-		hprintf("Fuzzer payload size too large: %lu > %lu\n",
+		hprintf("Fuzzer payload size too large: %u > %u\n",
 		        host_config.payload_buffer_size,
 		        PAYLOAD_MAX_SIZE);
 		habort("Host payload size too large!");
 		return -1;
 	}
 
+	payload_size = host_config.payload_buffer_size;
+
 	static agent_config_t agent_config __attribute__((aligned(PAGE_SIZE)));
 	memset(&agent_config, 0, sizeof(agent_config));
 	agent_config.agent_magic = NYX_AGENT_MAGIC;
@@ -108,6 +177,24 @@ int agent_init(int verbose)
 	agent_config.trace_buffer_vaddr = 0xdeadbeef;
 	agent_config.ijon_trace_buffer_vaddr = 0xdeadbeef;
 	agent_config.coverage_bitmap_size = host_config.bitmap_size;
+
+	// IJON annotations, if supported by host
+	if (ijon_setup(&host_config, &agent_config) == 0) {
+		hprintf("IJON buffer at 0x%lx (%u bytes)\n",
+		        agent_config.ijon_trace_buffer_vaddr, host_config.ijon_bitmap_size);
+	}
+
+	// coverage from trace-pc-guard instrumentation instead of host tracing
+	if (agent_trace) {
+		ret = trace_setup(&host_config, &agent_config);
+		if (ret != 0) {
+			hprintf("Agent tracing unavailable: %s\n", strerror(-ret));
+			habort("Failed to set up agent tracing");
+			return -1;
+		}
+		hprintf("Agent trace buffer at 0x%lx (%u bytes)\n",
+		        agent_config.trace_buffer_vaddr, trace_bitmap_size);
+	}
 	//agent_config.input_buffer_size;
 	//agent_config.dump_payloads; // set by hypervisor (??)
 
@@ -120,50 +207,60 @@ int agent_init(int verbose)
 	return 0;
 }
 
-#define ERRNO_FAIL_ON(cond, msg)                     \
-	do {                                             \
-		if ((cond)) {                                \
-			hprintf("Error: %s\n", strerror(errno)); \
-			habort(msg);                             \
-		}                                            \
-	} while (0)
-
 static int detectranges(char *mapfile, char *pattern)
 {
-	int ret = 0;
+	nyx_map_t maps[64];
 	unsigned region = 0;
-	char line[4096];
+	int num_maps;
 
 	if (!mapfile || !pattern) {
 		return -1;
 	}
 
-	FILE *fp = fopen(mapfile, "r");
-	ERRNO_FAIL_ON(fp == NULL, "fopen() failure");
-
-	while ((fgets(line, sizeof(line), fp) == line)) {
-		unsigned long start = 0;
-		unsigned long end = 0;
-		char *file;
+	num_maps = maps_read(mapfile, pattern, maps, ARRAY_SIZE(maps));
+	ERRNO_FAIL_ON(num_maps < 0, "maps_read() failure");
 
-		ret = sscanf(line, "%lx-%lx %*2cxp %*x %*2d:%*2d %*d %ms", &start, &end, &file);
-		//hprintf("Got %d args out of line %s", ret, line);
+	for (int i = 0; i < num_maps && region < 4; i++) {
+		/* executable private mappings only */
+		if (maps[i].perms[2] != 'x' || maps[i].perms[3] != 'p')
+			continue;
 
-		if (ret == 3) {
-			if (strstr(file, pattern)) {
-				hprintf(" => matched range %u: %lx-%lx (%s)\n", region, start, end, file);
-				hrange_submit(region, start, end);
-				region++;
-				free(file);
-			}
-		}
+		hprintf(" => matched range %u: %lx-%lx (%s)\n",
+		        region, maps[i].start, maps[i].end, maps[i].path);
+		hrange_submit(region, maps[i].start, maps[i].end);
+		region++;
 	}
 	return region;
 }
 
+void *resolve_next(const char *name)
+{
+	/* per thread, another thread may be inside dlsym() meanwhile */
+	static __thread bool resolving;
+	void *sym;
+
+	/* dlsym() may itself call interposed functions */
+	if (resolving)
+		return NULL;
+
+	resolving = true;
+	sym = dlsym(RTLD_NEXT, name);
+	resolving = false;
+
+	return sym;
+}
+
 void snapshot_reload()
 {
+	/* stability check runs exit without touching the snapshot */
+	if (dtm_replica)
+		return;
+
 	if (!allow_persistent) {
+		memlimit_exec_end();
+		if (cmplog_mode) {
+			cmplog_flush(cmplog_name);
+		}
 		hypercall(HYPERCALL_KAFL_RELEASE, 0);
 	}
 }
@@ -171,63 +268,613 @@ void snapshot_reload()
 /* Trampoline for the real main() */
 int (*main_orig)(int, char **, char **);
 
-int forkserver(int argc, char **argv, char **envp)
+#if defined(REDIRECT_STDERR_TO_HPRINTF)
+int pipe_stderr_hprintf[2];
+#endif
+#if defined(REDIRECT_STDOUT_TO_HPRINTF)
+int pipe_stdout_hprintf[2];
+#endif
+
+/*
+ * Truncated stdin payloads are reported once. Set before the snapshot when
+ * the pipe cannot hold a full payload, so exec children inherit it.
+ */
+static bool stdin_pipe_warned;
+
+/**
+ * Create stdin pipe sized to hold a full payload. Call before FAST_ACQUIRE,
+ * so that it becomes part of the snapshot.
+ */
+static void stdin_pipe_create(void)
 {
-	struct rlimit r;
-	int fd = 0;
-	int pipefd[2];
+	/* payload data is not page aligned and spans one extra pipe buffer */
+	int size = payload_size + PAGE_SIZE;
+	int ret;
+
+	ret = pipe(stdin_pipe);
+	ERRNO_FAIL_ON(ret == -1, "pipe");
+
+	ret = fcntl(stdin_pipe[1], F_SETPIPE_SZ, size);
+	if (ret < size && !stdin_pipe_warned) {
+		hprintf("Failed to resize stdin pipe to %d bytes, see /proc/sys/fs/pipe-max-size\n",
+		        size);
+		stdin_pipe_warned = true;
+	}
+}
 
+/**
+ * Deliver payload to the target, via stdin pipe or output_filename
+ */
+static void payload_deliver(kAFL_payload *payload_buffer)
+{
 	struct iovec iov;
+	int fd;
+	int ret;
+
+	if (stdin_mode) {
+		if (stdin_pipe[1] == -1) {
+			stdin_pipe_create();
+		}
+
+		iov.iov_base = payload_buffer->data;
+		iov.iov_len = payload_buffer->size;
+
+		/* pipe is only read after delivery, never block on a full pipe */
+		while (iov.iov_len) {
+			ret = vmsplice(stdin_pipe[1], &iov, 1, SPLICE_F_GIFT | SPLICE_F_NONBLOCK);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				if (!stdin_pipe_warned) {
+					hprintf("stdin payload truncated to %u bytes\n",
+					        payload_buffer->size - (uint32_t)iov.iov_len);
+					stdin_pipe_warned = true;
+				}
+				break;
+			}
+			iov.iov_base = (uint8_t *)iov.iov_base + ret;
+			iov.iov_len -= ret;
+		}
+
+		/* target sees EOF after the payload */
+		dup2(stdin_pipe[0], STDIN_FILENO);
+		close(stdin_pipe[0]);
+		close(stdin_pipe[1]);
+		stdin_pipe[0] = stdin_pipe[1] = -1;
+	} else {
+		fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		ERRNO_FAIL_ON(fd == -1, "open");
+
+		ret = write(fd, payload_buffer->data, payload_buffer->size);
+		ERRNO_FAIL_ON(ret != payload_buffer->size, "write");
+		close(fd);
+	}
+
+	if (desock_mode) {
+		desock_exec_begin(payload_buffer->data, payload_buffer->size);
+	}
+}
+
+/**
+ * Run input calibrate_runs times and push coverage indices that differ
+ * between runs. Call in exec child before main().
+ */
+static void calibrate_exec(int argc, char **argv, char **envp, const struct itimerval *timer)
+{
+	trace_calibrate_begin();
+
+	for (unsigned i = 0; i < calibrate_runs; i++) {
+		int status;
+		pid_t pid;
+
+		pid = fork();
+		ERRNO_FAIL_ON(pid == -1, "fork");
+
+		if (!pid) {
+			dtm_replica = true;
+			setitimer(ITIMER_VIRTUAL, timer, NULL);
+			exit(main_orig(argc, argv, envp));
+		}
+
+		waitpid(pid, &status, 0);
+		trace_calibrate_run();
+	}
+
+	trace_calibrate_flush(trace_mask_name);
+}
+
+/**
+ * Prepare exec child after payload delivery, up to the call of main()
+ */
+static void exec_child_setup(int argc, char **argv, char **envp)
+{
+	struct itimerval timer;
+
+#ifdef REDIRECT_STDERR_TO_HPRINTF
+	dup2(pipe_stderr_hprintf[1], STDERR_FILENO);
+	close(pipe_stderr_hprintf[0]);
+#endif
+#ifdef REDIRECT_STDOUT_TO_HPRINTF
+	dup2(pipe_stdout_hprintf[1], STDOUT_FILENO);
+	close(pipe_stdout_hprintf[0]);
+#endif
+
+	memlimit_exec_begin();
+
+	//if (payload_buffer->redqueen_mode) {
+	//	timer.it_value.tv_sec = 10;
+	//	timer.it_value.tv_usec = 0;
+	//} else {
+	timer.it_value.tv_sec = 1;
+	timer.it_value.tv_usec = 200;
+	//}
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 0;
+	setitimer(ITIMER_VIRTUAL, &timer, NULL);
+
+	seccomp_filter_install();
+
+	/* havoc replicas only run the target */
+	if (dtm_check_runs && !dtm_replica) {
+		dtm_check(main_orig, argc, argv, envp, dtm_check_runs, &timer);
+	}
+
+	if (calibrate_runs && !dtm_replica && trace_calibrate_inputs() < calibrate_execs) {
+		calibrate_exec(argc, argv, envp, &timer);
+	}
+
+	proctree_exec_begin();
+}
+
+/**
+ * Classify exit status of an exec child
+ */
+static exec_class_t exec_classify(int status)
+{
+	if (memlimit_oom(status)) {
+		return EXEC_OOM;
+	} else if (WIFSIGNALED(status)) {
+		if (WTERMSIG(status) == SIGVTALRM) {
+			return EXEC_TIMEOUT;
+		}
+		return EXEC_CRASH;
+	} else if (WEXITSTATUS(status) == ASAN_EXIT_CODE) {
+		return EXEC_SANITIZER;
+	}
+	return EXEC_OK;
+}
+
+/**
+ * Report exec class to the host
+ */
+static void exec_report(exec_class_t class)
+{
+	switch (class) {
+	case EXEC_TIMEOUT:
+		hprintf("TIMEOUT found\n");
+		//kAFL_hypercall(HYPERCALL_KAFL_TIMEOUT, 1);
+		break;
+	case EXEC_CRASH:
+		kAFL_hypercall(HYPERCALL_KAFL_PANIC, 1);
+		break;
+	case EXEC_SANITIZER:
+		kAFL_hypercall(HYPERCALL_KAFL_KASAN, 1);
+		break;
+	case EXEC_OOM:
+		/* PANIC_EXTENDED would be filed as a crash, keep OOM out of crashes/ */
+		hprintf("%s\n", memlimit_oom_msg());
+		break;
+	case EXEC_OK:
+		break;
+	}
+}
+
+/**
+ * Run input in a forked replica of the exec child and classify its exit.
+ * Call in exec child before delivering the payload.
+ */
+static exec_class_t replica_exec(kAFL_payload *input, int argc, char **argv, char **envp)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	ERRNO_FAIL_ON(pid == -1, "fork");
+
+	if (!pid) {
+		dtm_replica = true;
+		/* fresh stdin pipe, the one of the exec child holds the snapshot payload */
+		if (stdin_mode) {
+			close(stdin_pipe[0]);
+			close(stdin_pipe[1]);
+			stdin_pipe[0] = stdin_pipe[1] = -1;
+		}
+		payload_deliver(input);
+		exec_child_setup(argc, argv, envp);
+		exit(main_orig(argc, argv, envp));
+	}
+
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	return exec_classify(status);
+}
+
+/**
+ * Run havoc_runs local mutations of the payload in forked replicas and dump
+ * mutants with new coverage or crashes to the host. Call in exec child
+ * before delivering the payload.
+ */
+static void havoc_exec(kAFL_payload *payload_buffer, int argc, char **argv, char **envp)
+{
+	for (unsigned i = 0; i < havoc_runs; i++) {
+		exec_class_t class;
+
+		memcpy(havoc_buffer->data, payload_buffer->data, payload_buffer->size);
+		havoc_buffer->size = havoc_mutate(havoc_buffer->data, payload_buffer->size, payload_size);
+
+		trace_reset();
+		class = replica_exec(havoc_buffer, argc, argv, envp);
+		if (class == EXEC_CRASH || class == EXEC_SANITIZER) {
+			havoc_dump(havoc_name, havoc_buffer->data, havoc_buffer->size, true);
+		} else if (class != EXEC_TIMEOUT && havoc_check_coverage()) {
+			havoc_dump(havoc_name, havoc_buffer->data, havoc_buffer->size, false);
+		}
+	}
+	havoc_count(havoc_runs, 100000);
+
+	/* coverage, comparisons and IJON state of the payload itself go to the host */
+	trace_reset();
+	cmplog_reset();
+	ijon_reset();
+}
+
+static const char *exec_class_str[] = {
+	[EXEC_OK] = "ok",
+	[EXEC_CRASH] = "crash",
+	[EXEC_TIMEOUT] = "timeout",
+	[EXEC_SANITIZER] = "sanitizer",
+	[EXEC_OOM] = "oom",
+};
+
+/**
+ * Run the records of a batch payload back-to-back in forked replicas and
+ * report the index of the first one which does not exit normally
+ */
+static void batch_exec(nyx_batch_t *batch, int argc, char **argv, char **envp)
+{
+	const uint8_t *data;
+	uint32_t len;
+
+	while (nyx_batch_next(batch, &data, &len)) {
+		exec_class_t class;
+
+		memcpy(batch_buffer->data, data, len);
+		batch_buffer->size = len;
+
+		class = replica_exec(batch_buffer, argc, argv, envp);
+		if (class != EXEC_OK) {
+			nyx_batch_panic(batch->index, exec_class_str[class]);
+			return;
+		}
+	}
+}
+
+static int replay_filter(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+/**
+ * Run each file in replay_dir with the forkserver logic but without any
+ * hypercalls, and report wall time, max RSS and exit class as CSV.
+ */
+static int replay(int argc, char **argv, char **envp, kAFL_payload *payload_buffer, FILE *csv)
+{
+	struct dirent **files;
+	int num_files;
+
+	num_files = scandir(replay_dir, &files, replay_filter, alphasort);
+	ERRNO_FAIL_ON(num_files < 0, "scandir");
+
+	fprintf(csv, "file,wall_ms,maxrss_kb,class,status\n");
+
+	for (int i = 0; i < num_files; i++) {
+		char path[PATH_MAX];
+		struct timespec start, end;
+		struct rusage usage;
+		struct stat st;
+		exec_class_t class;
+		int status = 0;
+		ssize_t len;
+		int fd;
+		pid_t pid;
+
+		snprintf(path, sizeof(path), "%s/%s", replay_dir, files[i]->d_name);
+		free(files[i]);
+
+		fd = open(path, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+
+		len = read(fd, payload_buffer->data, PAYLOAD_MAX_SIZE);
+		close(fd);
+		if (len < 0) {
+			hprintf("Failed to read %s: %s\n", path, strerror(errno));
+			continue;
+		}
+		if (st.st_size > PAYLOAD_MAX_SIZE) {
+			hprintf("Truncating %s to %u bytes\n", path, PAYLOAD_MAX_SIZE);
+		}
+		payload_buffer->size = len;
+
+		fflush(csv);
+
+		/* raw syscall, clock_gettime() may be virtualized for the target */
+		syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &start);
+
+		pid = fork();
+		assert(pid != -1);
+
+		if (!pid) {
+			fclose(csv);
+			payload_deliver(payload_buffer);
+			exec_child_setup(argc, argv, envp);
+			return main_orig(argc, argv, envp);
+		}
+
+		proctree_wait(pid, &status, &usage);
+		proctree_kill(pid);
+		syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &end);
+
+		class = exec_classify(status);
+		memlimit_record(usage.ru_maxrss, class == EXEC_OOM);
+
+		fprintf(csv, "%s,%.3f,%ld,%s,%d\n",
+		        path,
+		        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+		        usage.ru_maxrss,
+		        exec_class_str[class],
+		        WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+	}
+	free(files);
+	fclose(csv);
+	memlimit_report();
+	return 0;
+}
+
+int forkserver(int argc, char **argv, char **envp)
+{
+	kAFL_payload *payload_buffer;
+	nyx_batch_t batch;
+	FILE *csv = NULL;
+	struct rusage usage;
+	exec_class_t class;
 	int pid;
 	int status = 0;
 	int ret = 0;
 
-	ret = pipe(pipefd);
-	ERRNO_FAIL_ON(ret == -1, "pipe");
-
 #ifdef REDIRECT_STDERR_TO_HPRINTF
-	int pipe_stderr_hprintf[2];
 	ret = pipe(pipe_stderr_hprintf);
 	ERRNO_FAIL_ON(ret == -1, "pipe");
 #endif
 #ifdef REDIRECT_STDOUT_TO_HPRINTF
-	int pipe_stdout_hprintf[2];
 	ret = pipe(pipe_stdout_hprintf);
 	ERRNO_FAIL_ON(ret == -1, "pipe");
 #endif
 
-	//r.rlim_max = (rlim_t)(memlimit << 20);
-	//r.rlim_cur = (rlim_t)(memlimit << 20);
+	/* deliver payload on stdin instead of output_filename, e.g. NYX_STDIN=1 */
+	char *stdin_env = getenv("NYX_STDIN");
+	stdin_mode = stdin_env && atoi(stdin_env) > 0;
+
+	if (replay_mode) {
+		/* CSV to NYX_REPLAY_CSV or original stdout, keep stderr for triage */
+		char *csv_env = getenv("NYX_REPLAY_CSV");
+		if (csv_env) {
+			csv = fopen(csv_env, "w");
+		} else {
+			csv = fdopen(dup(STDOUT_FILENO), "w");
+		}
+		ERRNO_FAIL_ON(!csv, "Failed to open CSV output");
+	}
 
 	ret = dup2(open("/dev/null", O_WRONLY), STDOUT_FILENO);
 	ERRNO_FAIL_ON(ret == -1, "dup2(STDOUT)");
-	ret = dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
-	ERRNO_FAIL_ON(ret == -1, "dup2(STDERR)");
+	if (!replay_mode) {
+		ret = dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+		ERRNO_FAIL_ON(ret == -1, "dup2(STDERR)");
+	}
 
 	if (!stdin_mode) {
 		ret = dup2(open("/dev/null", O_RDONLY), STDIN_FILENO);
 		ERRNO_FAIL_ON(ret == -1, "dup2(STDIN)");
 	}
 
-	agent_init(1);
+	/* optional in-process persistent loop, e.g. NYX_PERSISTENT=1000 iterations per fork */
+	char *persistent_env = getenv("NYX_PERSISTENT");
+	if (persistent_env && atoi(persistent_env) > 1 && !replay_mode) {
+		persistent_iters = atoi(persistent_env);
+		allow_persistent = true;
+	}
+
+	if (replay_mode) {
+		payload_buffer = malloc(sizeof(kAFL_payload) + PAYLOAD_MAX_SIZE);
+		ERRNO_FAIL_ON(!payload_buffer, "malloc");
+	} else {
+		/* coverage from -fsanitize-coverage=trace-pc-guard, e.g. NYX_AGENT_TRACE=1 */
+		char *trace_env = getenv("NYX_AGENT_TRACE");
+		agent_trace = trace_env && atoi(trace_env) > 0;
+
+		agent_init(1);
 
-	kAFL_payload *payload_buffer = malloc_resident_pages(PAYLOAD_MAX_SIZE / PAGE_SIZE);
-	kAFL_hypercall(HYPERCALL_KAFL_GET_PAYLOAD, (uintptr_t)payload_buffer);
+		payload_buffer = malloc_resident_pages(PAYLOAD_MAX_SIZE / PAGE_SIZE);
+		kAFL_hypercall(HYPERCALL_KAFL_GET_PAYLOAD, (uintptr_t)payload_buffer);
 
 #if defined(__i386__)
-	kAFL_hypercall(HYPERCALL_KAFL_USER_SUBMIT_MODE, KAFL_MODE_32);
+		kAFL_hypercall(HYPERCALL_KAFL_USER_SUBMIT_MODE, KAFL_MODE_32);
 #elif defined(__x86_64__)
-	kAFL_hypercall(HYPERCALL_KAFL_USER_SUBMIT_MODE, KAFL_MODE_64);
+		kAFL_hypercall(HYPERCALL_KAFL_USER_SUBMIT_MODE, KAFL_MODE_64);
 #endif
 
-	//hpush_file("/proc/self/maps", "proc_map.txt", 0);
-	//agent_setrange(0,0x555555550000,0x555555567000);
-	ret = detectranges("/proc/self/maps", "bison");
-	if (ret < 1) {
-		habort("No IP ranges registered?!");
+		//hpush_file("/proc/self/maps", "proc_map.txt", 0);
+		//agent_setrange(0,0x555555550000,0x555555567000);
+		ret = detectranges("/proc/self/maps", target_name);
+		if (ret < 1) {
+			habort("No IP ranges registered?!");
+		}
+
+		hprintf("main() => %p\n", main_orig);
 	}
 
-	hprintf("main() => 0x%lx\n", main_orig);
+	/* profiler, dictionary and cmplog report to the host */
+	if (!replay_mode) {
+		/* optional sampling profiler, e.g. NYX_PROFILE_HZ=1000 */
+		char *profile_hz = getenv("NYX_PROFILE_HZ");
+		if (profile_hz && atoi(profile_hz) > 0) {
+			char *profile_flush = getenv("NYX_PROFILE_FLUSH");
+			ret = profile_init(atoi(profile_hz), profile_flush ? atoi(profile_flush) : 1000);
+			if (ret != 0) {
+				habort("Failed to initialize profiler");
+			}
+		}
+
+		/*
+		 * optional dictionary harvesting: NYX_DICT=<warm-up execs> collects
+		 * on every exec at first, NYX_DICT_SAMPLE=<period> on every n-th
+		 * exec after that (default 100, 0 = warm-up only)
+		 */
+		char *dict_env = getenv("NYX_DICT");
+		if (dict_env && atoi(dict_env) > 0) {
+			char *dict_sample = getenv("NYX_DICT_SAMPLE");
+			ret = dict_init(atoi(dict_env), dict_sample ? atoi(dict_sample) : 100);
+			if (ret != 0) {
+				habort("Failed to initialize dictionary harvesting");
+			}
+		}
+
+		/* optional comparison logging for -fsanitize-coverage=trace-cmp targets */
+		char *cmplog_env = getenv("NYX_CMPLOG");
+		if (cmplog_env && atoi(cmplog_env) > 0) {
+			ret = cmplog_init(64);
+			ERRNO_FAIL_ON(ret != 0, "cmplog_init");
+			cmplog_mode = true;
+		}
+	}
+
+	/* virtualize time, randomness etc., e.g. NYX_DETERMINISM=rand,time (default rand) or none */
+	char *dtm_env = getenv("NYX_DETERMINISM");
+	if (dtm_env) {
+		ret = dtm_init(dtm_env);
+		ERRNO_FAIL_ON(ret != 0, "dtm_init");
+	}
+
+	/* optional stability check, e.g. NYX_DETERMINISM_CHECK=3 reruns per input */
+	char *dtm_check_env = getenv("NYX_DETERMINISM_CHECK");
+	if (dtm_check_env && atoi(dtm_check_env) > 0) {
+		if (stdin_mode) {
+			hprintf("NYX_DETERMINISM_CHECK not supported in stdin mode\n");
+		} else {
+			dtm_check_runs = atoi(dtm_check_env);
+		}
+	}
+
+	/* optional socket emulation for network servers, e.g. NYX_DESOCK=1 */
+	char *desock_env = getenv("NYX_DESOCK");
+	if (desock_env && atoi(desock_env) > 0) {
+		char *framed_env = getenv("NYX_DESOCK_FRAMED");
+		if (allow_persistent) {
+			/* the second accept() ends the exec, not just the iteration */
+			hprintf("NYX_DESOCK not supported in persistent mode\n");
+		} else {
+			desock_init(framed_env && atoi(framed_env) > 0);
+			desock_mode = true;
+		}
+	}
+
+	/* optional coverage stability calibration, e.g. NYX_CALIBRATE=4 runs per input */
+	char *calibrate_env = getenv("NYX_CALIBRATE");
+	if (calibrate_env && atoi(calibrate_env) > 1 && !replay_mode) {
+		char *calibrate_execs_env = getenv("NYX_CALIBRATE_EXECS");
+		if (!agent_trace) {
+			hprintf("NYX_CALIBRATE requires NYX_AGENT_TRACE\n");
+		} else if (stdin_mode || desock_mode) {
+			hprintf("NYX_CALIBRATE not supported in stdin or desock mode\n");
+		} else {
+			ret = trace_calibrate_init();
+			ERRNO_FAIL_ON(ret != 0, "trace_calibrate_init");
+			calibrate_runs = atoi(calibrate_env);
+			calibrate_execs = calibrate_execs_env ? atoi(calibrate_execs_env) : 100;
+		}
+	}
+
+	/* optional in-guest havoc stage, e.g. NYX_HAVOC=64 mutants per payload */
+	char *havoc_env = getenv("NYX_HAVOC");
+	if (havoc_env && atoi(havoc_env) > 0 && !replay_mode) {
+		if (!agent_trace) {
+			hprintf("NYX_HAVOC requires NYX_AGENT_TRACE\n");
+		} else {
+			ret = havoc_init(havoc_seed);
+			ERRNO_FAIL_ON(ret != 0, "havoc_init");
+			havoc_buffer = malloc(sizeof(kAFL_payload) + payload_size);
+			ERRNO_FAIL_ON(!havoc_buffer, "malloc");
+			havoc_runs = atoi(havoc_env);
+		}
+	}
+
+	/* optional batched payloads, see nyx_batch.h, e.g. NYX_BATCH=1 */
+	char *batch_env = getenv("NYX_BATCH");
+	if (batch_env && atoi(batch_env) > 0 && !replay_mode) {
+		batch_buffer = malloc(sizeof(kAFL_payload) + payload_size);
+		ERRNO_FAIL_ON(!batch_buffer, "malloc");
+		batch_mode = true;
+	}
+
+	/* optional syscall filter, e.g. NYX_SECCOMP=offline or sleep,sync */
+	char *seccomp_env = getenv("NYX_SECCOMP");
+	if (seccomp_env) {
+		ret = seccomp_filter_init(seccomp_env);
+		ERRNO_FAIL_ON(ret != 0, "seccomp_filter_init");
+	}
+
+	/* track process tree of executions, optionally in a cgroup v2, e.g. NYX_CGROUP=/sys/fs/cgroup/kafl */
+	ret = proctree_init(getenv("NYX_CGROUP"));
+	ERRNO_FAIL_ON(ret != 0, "proctree_init");
+
+	/* optional memory limit, e.g. NYX_MEMLIMIT=512 (MB, 0 = peak RSS statistics only) */
+	char *memlimit_env = getenv("NYX_MEMLIMIT");
+	if (memlimit_env) {
+		char *report_env = getenv("NYX_MEMLIMIT_REPORT");
+		ret = memlimit_init(atoi(memlimit_env), report_env ? atoi(report_env) : 10000);
+		if (ret != 0) {
+			habort("Failed to initialize memory limit");
+		}
+	}
+
+	/* optional per-iteration heap arena, e.g. NYX_HEAP_ARENA=64 (MB) */
+	char *arena_env = getenv("NYX_HEAP_ARENA");
+	if (arena_env && atoi(arena_env) > 0) {
+		if (!allow_persistent) {
+			hprintf("NYX_HEAP_ARENA requires NYX_PERSISTENT\n");
+		} else if (heap_arena_init(atoi(arena_env)) != 0) {
+			habort("Failed to initialize heap arena");
+		}
+	}
+
+	/* optional restore of target globals between iterations, e.g. NYX_DATASNAP=data or heap */
+	char *datasnap_env = getenv("NYX_DATASNAP");
+	if (datasnap_env) {
+		if (!allow_persistent) {
+			hprintf("NYX_DATASNAP requires NYX_PERSISTENT\n");
+		} else if (datasnap_init(datasnap_env) != 0) {
+			habort("Failed to initialize data snapshot");
+		}
+	}
+
+	if (replay_mode) {
+		return replay(argc, argv, envp, payload_buffer, csv);
+	}
 
 	while (1) {
 #if defined(REDIRECT_STDERR_TO_HPRINTF) || defined(REDIRECT_STDOUT_TO_HPRINTF)
@@ -244,55 +891,57 @@ int forkserver(int argc, char **argv, char **envp)
 			//kAFL_hypercall(HYPERCALL_KAFL_SUBMIT_CR3, 0);
 			//kAFL_hypercall(HYPERCALL_KAFL_NEXT_PAYLOAD, 0);
 			//kAFL_hypercall(HYPERCALL_KAFL_ACQUIRE, 0);
-			kAFL_hypercall(HYPERCALL_KAFL_USER_FAST_ACQUIRE, 0);
-
-			if (stdin_mode) {
-				ret = pipe(pipefd);
-				ERRNO_FAIL_ON(ret == -1, "pipe");
-			} else {
-				fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
-				ERRNO_FAIL_ON(fd == -1, "open");
-			}
+			for (unsigned iter = 1;; iter++) {
+				if (stdin_mode) {
+					stdin_pipe_create();
+				}
 
-			if (stdin_mode) {
-				iov.iov_base = payload_buffer->data;
-				iov.iov_len = payload_buffer->size;
+				kAFL_hypercall(HYPERCALL_KAFL_USER_FAST_ACQUIRE, 0);
 
-				vmsplice(pipefd[1], &iov, 1, SPLICE_F_GIFT);
-				dup2(pipefd[0], STDIN_FILENO);
-				close(pipefd[1]);
-			} else {
-				ret = write(fd, payload_buffer->data, payload_buffer->size);
-				ERRNO_FAIL_ON(ret != payload_buffer->size, "write");
-				close(fd);
-			}
+				profile_start();
+				dict_exec_begin();
+				dtm_exec_begin();
+				cmplog_reset();
+				/* no snapshot restore between persistent iterations */
+				ijon_reset();
 
-#ifdef REDIRECT_STDERR_TO_HPRINTF
-			dup2(pipe_stderr_hprintf[1], STDERR_FILENO);
-			close(pipe_stderr_hprintf[0]);
-#endif
-#ifdef REDIRECT_STDOUT_TO_HPRINTF
-			dup2(pipe_stdout_hprintf[1], STDOUT_FILENO);
-			close(pipe_stdout_hprintf[0]);
-#endif
+				/* batch runs end through snapshot_reload() or the forkserver */
+				if (batch_mode && nyx_batch_open(&batch, payload_buffer->data, payload_buffer->size)) {
+					batch_exec(&batch, argc, argv, envp);
+					exit(0);
+				}
 
-#ifndef ASAN_BUILD
-			/* disable setrlimtit in case of ASAN builds... */
-			setrlimit(RLIMIT_AS, &r);
-#endif
-			struct itimerval timer;
-			//if (payload_buffer->redqueen_mode) {
-			//	timer.it_value.tv_sec = 10;
-			//	timer.it_value.tv_usec = 0;
-			//} else {
-			timer.it_value.tv_sec = 1;
-			timer.it_value.tv_usec = 200;
-			//}
-			timer.it_interval.tv_sec = 0;
-			timer.it_interval.tv_usec = 0;
-			setitimer(ITIMER_VIRTUAL, &timer, NULL);
+				if (havoc_runs) {
+					havoc_exec(payload_buffer, argc, argv, envp);
+				}
+				payload_deliver(payload_buffer);
+				exec_child_setup(argc, argv, envp);
+
+				/* last iteration exits through snapshot_reload() */
+				if (iter >= persistent_iters) {
+					heap_arena_report();
+					datasnap_report();
+					return main_orig(argc, argv, envp);
+				}
 
-			return main_orig(argc, argv, envp);
+				if (iter == 1) {
+					datasnap_capture();
+				}
+
+				heap_arena_begin();
+				main_orig(argc, argv, envp);
+				memlimit_exec_end();
+				if (proctree_iteration_end(&status)) {
+					exec_report(exec_classify(status));
+				}
+				heap_arena_end();
+				datasnap_restore();
+
+				if (cmplog_mode) {
+					cmplog_flush(cmplog_name);
+				}
+				kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
+			}
 
 		} else if (pid > 0) {
 #ifdef REDIRECT_STDERR_TO_HPRINTF
@@ -301,7 +950,12 @@ int forkserver(int argc, char **argv, char **envp)
 #ifdef REDIRECT_STDOUT_TO_HPRINTF
 			close(pipe_stdout_hprintf[1]);
 #endif
-			waitpid(pid, &status, WUNTRACED);
+			if (proctree_wait(pid, &status, &usage)) {
+				hprintf("Crash in descendant of exec child\n");
+			}
+			proctree_kill(pid);
+			class = exec_classify(status);
+			memlimit_record(usage.ru_maxrss, class == EXEC_OOM);
 
 #ifdef REDIRECT_STDERR_TO_HPRINTF
 			while ((ret = read(pipe_stderr_hprintf[0], stdio_buf, HPRINTF_MAX_SIZE - 1))) {
@@ -318,23 +972,18 @@ int forkserver(int argc, char **argv, char **envp)
 			}
 #endif
 
-			if (WIFSIGNALED(status)) {
-				if (WTERMSIG(status) == SIGVTALRM) {
-					hprintf("TIMEOUT found\n");
-					//kAFL_hypercall(HYPERCALL_KAFL_TIMEOUT, 1);
-				} else {
-					kAFL_hypercall(HYPERCALL_KAFL_PANIC, 1);
-				}
-			} else if (WEXITSTATUS(status) == ASAN_EXIT_CODE) {
-				kAFL_hypercall(HYPERCALL_KAFL_KASAN, 1);
+			if (cmplog_mode) {
+				cmplog_flush(cmplog_name);
 			}
+
+			exec_report(class);
 			//hprintf("EXIT OK\n");
 			kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
 		}
 	}
 }
 
-int __libc_start_main(int (*main)(int, char **, char **),
+EXPORT int __libc_start_main(int (*main)(int, char **, char **),
                       int argc,
                       char **argv,
                       void (*init)(void),
@@ -345,9 +994,25 @@ int __libc_start_main(int (*main)(int, char **, char **),
 	/* Save the real main function address */
 	main_orig = main;
 
+	/* Replay inputs from a directory on plain Linux, without hypercalls */
+	replay_dir = getenv("NYX_REPLAY");
+	replay_mode = replay_dir != NULL;
+
 	/* Find the real __libc_start_main()... */
 	typeof(&__libc_start_main) orig = dlsym(RTLD_NEXT, "__libc_start_main");
 
+	/* exec'd descendants of the target only report crashes */
+	if (getenv("NYX_FORKSERVER")) {
+		proctree_helper();
+		return orig(main, argc, argv, init, fini, rtld_fini, stack_end);
+	}
+
+	/* Name of target binary for range detection */
+	target_name = getenv("NYX_TARGET");
+	if (!target_name) {
+		target_name = strdup(basename(argv[0]));
+	}
+
 	/* ... and call it with our custom main function */
 	return orig(forkserver, argc, argv, init, fini, rtld_fini, stack_end);
 }
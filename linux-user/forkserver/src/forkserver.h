@@ -0,0 +1,143 @@
+/*
+ * Copyright 2019 Sergej Schumilo, Cornelius Aschermann
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * forkserver.h - shared definitions of forkserver.so components
+ */
+
+#ifndef FORKSERVER_H
+#define FORKSERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "nyx_api.h"
+
+/*
+ * forkserver.so is built with -fvisibility=hidden, so internal names cannot
+ * collide with symbols of the target. Interposed functions must be exported.
+ */
+#define EXPORT __attribute__((visibility("default")))
+
+/*
+ * hprintf() and habort() go to stderr in replay mode, where no hypervisor
+ * is available to handle hypercalls.
+ */
+extern bool replay_mode;
+
+void fs_hprintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void fs_habort(char *msg);
+
+#define hprintf fs_hprintf
+#define habort fs_habort
+
+#define ERRNO_FAIL_ON(cond, msg)                     \
+	do {                                             \
+		if ((cond)) {                                \
+			hprintf("Error: %s\n", strerror(errno)); \
+			habort(msg);                             \
+		}                                            \
+	} while (0)
+
+/* exit code of sanitizer errors, e.g. ASAN_OPTIONS=exitcode=101 */
+#define ASAN_EXIT_CODE 101
+
+/* target binary name, used to find its mappings in /proc/self/maps */
+extern char *target_name;
+
+/* persistent mode, iterations run in a single exec child */
+extern bool allow_persistent;
+
+/* resolve next definition of an interposed libc symbol, NULL on recursion */
+void *resolve_next(const char *name);
+
+/* resolve and cache real_<func>, the next definition of func */
+#define NEXT(func)                                   \
+	({                                               \
+		if (!real_##func)                            \
+			real_##func = resolve_next(#func);       \
+		real_##func;                                 \
+	})
+
+/* fail like a missing libc function if the symbol cannot be resolved */
+#define CALL_NEXT(func, err, ...)                \
+	do {                                         \
+		if (!NEXT(func)) {                       \
+			errno = ENOSYS;                      \
+			return err;                          \
+		}                                        \
+		return real_##func(__VA_ARGS__);         \
+	} while (0)
+
+/* dict.c - dictionary harvesting from comparison operands */
+int dict_init(unsigned warmup, unsigned sample);
+void dict_exec_begin(void);
+
+/* determinism.c - virtualized sources of nondeterminism */
+#define DTM_RAND      (1 << 0)
+#define DTM_TIME      (1 << 1)
+#define DTM_URANDOM   (1 << 2)
+#define DTM_GETRANDOM (1 << 3)
+#define DTM_PID       (1 << 4)
+
+extern bool dtm_replica;
+
+int dtm_init(const char *spec);
+void dtm_exec_begin(void);
+void dtm_check(int (*main_fn)(int, char **, char **), int argc, char **argv, char **envp,
+               unsigned runs, const struct itimerval *timer);
+
+/* desock.c - serve listening sockets from the payload */
+void desock_init(bool framed);
+void desock_exec_begin(const uint8_t *data, size_t len);
+
+/* heap.c - per-iteration heap arena for persistent mode */
+int heap_arena_init(size_t size_mb);
+void heap_arena_begin(void);
+void heap_arena_end(void);
+void heap_arena_report(void);
+void heap_alloc_checks(void);
+EXPORT void heap_arena_pause(void);
+EXPORT void heap_arena_resume(void);
+
+/* datasnap.c - restore writable data between persistent iterations */
+#define DATASNAP_DATA 1
+#define DATASNAP_HEAP 2
+
+int datasnap_init(const char *mode);
+void datasnap_capture(void);
+void datasnap_restore(void);
+void datasnap_report(void);
+
+/* seccomp.c - slow syscall elimination */
+int seccomp_filter_init(const char *spec);
+void seccomp_filter_install(void);
+
+/* proctree.c - process tree tracking of forking targets */
+int proctree_init(const char *cgroup);
+const char *proctree_cgroup(void);
+void proctree_exec_begin(void);
+void proctree_helper(void);
+bool proctree_wait(pid_t pid, int *status, struct rusage *usage);
+void proctree_kill(pid_t pid);
+bool proctree_iteration_end(int *status);
+
+/* memlimit.c - per-exec memory limit and peak RSS statistics */
+int memlimit_init(size_t limit_mb, unsigned report_execs);
+void memlimit_exec_begin(void);
+void memlimit_exec_end(void);
+void memlimit_record(uint64_t rss_kb, bool oom);
+void memlimit_alloc_failed(void);
+bool memlimit_oom(int status);
+const char *memlimit_oom_msg(void);
+void memlimit_report(void);
+
+#endif /* FORKSERVER_H */
@@ -0,0 +1,522 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * heap.c - per-iteration heap arena for persistent-mode targets
+ *
+ * Interposes malloc() and friends. While an iteration is running, requests
+ * made from the target binary are served from a bump allocator that is
+ * reset wholesale at iteration end, so leaks and fragmentation do not
+ * accumulate over thousands of iterations.
+ *
+ * Everything else goes to the next allocator, libc or a jemalloc/tcmalloc
+ * the target is linked against: requests from shared libraries (stdio
+ * buffers, locale data, ..) which may outlive the iteration, requests
+ * outside of iterations, large requests and anything that does not fit
+ * into the remaining arena. The first iteration after the snapshot also
+ * skips the arena, since that is where targets typically initialize caches
+ * and other state that outlives the iteration. Targets can bracket further
+ * long-lived allocations with heap_arena_pause() and heap_arena_resume().
+ * Failed allocations are passed to memlimit.c, which ends the exec if it
+ * ran into the memory limit.
+ *
+ * Unless the arena or allocation checks are enabled, the interposers test
+ * a single flag and call the next allocator. Aligned requests go through
+ * its memalign(), so they stay within one allocator. Requests made while
+ * dlsym() resolves it are served from a small static buffer.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define HEAP_ALIGN 16
+#define HEAP_MAX_RANGES 4
+#define HEAP_MAGIC 0x6e796861 /* "nyha" */
+#define HEAP_BOOT_SIZE 4096
+
+typedef struct {
+	size_t size;
+	uint32_t magic;
+	uint32_t gen; /* iteration that made the allocation */
+} heap_hdr_t;
+
+static bool heap_hooked; /* arena or allocation checks enabled */
+static uint8_t *arena_base;
+static size_t arena_size;
+static size_t arena_pos;
+static uint32_t arena_gen;
+static bool arena_warm;
+static bool arena_active;
+static __thread unsigned arena_paused;
+
+/* callers served from the arena */
+static struct {
+	uintptr_t start;
+	uintptr_t end;
+} heap_ranges[HEAP_MAX_RANGES];
+static int heap_num_ranges;
+
+static struct {
+	uint64_t iterations;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t leaked_allocs;
+	uint64_t leaked_bytes;
+	uint64_t fallbacks;
+	size_t peak;
+} heap_stats;
+static uint64_t iter_allocs;
+static uint64_t iter_frees;
+static uint64_t iter_bytes;
+
+/* serves allocations made by dlsym() before the next allocator is known */
+static uint8_t heap_boot[HEAP_BOOT_SIZE] __attribute__((aligned(HEAP_ALIGN)));
+static size_t heap_boot_pos;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static void *(*real_memalign)(size_t, size_t);
+static size_t (*real_malloc_usable_size)(void *);
+
+static inline bool heap_in_boot(const void *ptr)
+{
+	return (uint8_t *)ptr >= heap_boot && (uint8_t *)ptr < heap_boot + sizeof(heap_boot);
+}
+
+static void *heap_boot_alloc(size_t size, size_t align)
+{
+	size_t pos, start, end;
+	heap_hdr_t *hdr;
+
+	if (align < HEAP_ALIGN)
+		align = HEAP_ALIGN;
+
+	pos = __atomic_load_n(&heap_boot_pos, __ATOMIC_RELAXED);
+	do {
+		start = (pos + sizeof(heap_hdr_t) + align - 1) & ~(align - 1);
+		end = start + size;
+		if (end > sizeof(heap_boot) || end < start)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&heap_boot_pos, &pos, end, true,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	hdr = (heap_hdr_t *)(heap_boot + start) - 1;
+	hdr->size = size;
+	return heap_boot + start;
+}
+
+/* next allocator, static buffer while dlsym() resolves it */
+static inline void *next_malloc(size_t size)
+{
+	if (__builtin_expect(!NEXT(malloc), 0))
+		return heap_boot_alloc(size, HEAP_ALIGN);
+	return real_malloc(size);
+}
+
+static inline void *next_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	/* static buffer is never reused, so it is still zero */
+	if (__builtin_expect(!NEXT(calloc), 0))
+		return __builtin_mul_overflow(nmemb, size, &total) ? NULL : heap_boot_alloc(total, HEAP_ALIGN);
+	return real_calloc(nmemb, size);
+}
+
+static inline void next_free(void *ptr)
+{
+	if (__builtin_expect(heap_in_boot(ptr), 0))
+		return;
+	if (NEXT(free))
+		real_free(ptr);
+}
+
+static inline void *next_realloc(void *ptr, size_t size)
+{
+	if (__builtin_expect(heap_in_boot(ptr), 0)) {
+		heap_hdr_t *hdr = (heap_hdr_t *)ptr - 1;
+		void *new_ptr = next_malloc(size);
+
+		if (new_ptr)
+			memcpy(new_ptr, ptr, size < hdr->size ? size : hdr->size);
+		return new_ptr;
+	}
+	if (__builtin_expect(!NEXT(realloc), 0))
+		return ptr ? NULL : heap_boot_alloc(size, HEAP_ALIGN);
+	return real_realloc(ptr, size);
+}
+
+static inline void *next_memalign(size_t alignment, size_t size)
+{
+	if (__builtin_expect(!NEXT(memalign), 0))
+		return heap_boot_alloc(size, alignment);
+	return real_memalign(alignment, size);
+}
+
+/**
+ * Reserve arena of size_mb. Call once, before the snapshot is taken.
+ */
+int heap_arena_init(size_t size_mb)
+{
+	nyx_map_t maps[64];
+	int num_maps;
+
+	num_maps = maps_read("/proc/self/maps", target_name, maps, ARRAY_SIZE(maps));
+	for (int i = 0; i < num_maps && heap_num_ranges < HEAP_MAX_RANGES; i++) {
+		if (maps[i].perms[2] == 'x') {
+			heap_ranges[heap_num_ranges].start = maps[i].start;
+			heap_ranges[heap_num_ranges].end = maps[i].end;
+			heap_num_ranges++;
+		}
+	}
+	if (heap_num_ranges == 0) {
+		hprintf("[heap] No executable mappings found for %s\n", target_name);
+		return -ENOENT;
+	}
+
+	arena_size = size_mb << 20;
+	arena_base = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena_base == MAP_FAILED) {
+		arena_base = NULL;
+		return -ENOMEM;
+	}
+
+	heap_hooked = true;
+	hprintf("[heap] Arena of %zu MB at %p\n", size_mb, arena_base);
+	return 0;
+}
+
+/**
+ * Pass failed allocations to memlimit_alloc_failed()
+ */
+void heap_alloc_checks(void)
+{
+	heap_hooked = true;
+}
+
+/**
+ * Start serving target allocations from the arena
+ */
+void heap_arena_begin(void)
+{
+	if (!arena_base)
+		return;
+
+	/* lazily initialized state of the first iteration skips the arena */
+	if (!arena_warm) {
+		arena_warm = true;
+		return;
+	}
+
+	arena_gen++;
+	arena_pos = 0;
+	iter_allocs = iter_frees = iter_bytes = 0;
+	__atomic_store_n(&arena_active, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * End of iteration: account leaks and release all arena allocations
+ */
+void heap_arena_end(void)
+{
+	if (!arena_active)
+		return;
+
+	__atomic_store_n(&arena_active, false, __ATOMIC_RELEASE);
+
+	heap_stats.iterations++;
+	heap_stats.allocs += iter_allocs;
+	heap_stats.frees += iter_frees;
+	if (iter_allocs > iter_frees) {
+		heap_stats.leaked_allocs += iter_allocs - iter_frees;
+		heap_stats.leaked_bytes += iter_bytes;
+	}
+	if (arena_pos > heap_stats.peak)
+		heap_stats.peak = arena_pos;
+
+	arena_pos = 0;
+}
+
+/**
+ * Target API: bypass the arena until heap_arena_resume(), for state that
+ * must outlive the iteration. Calls nest and are per thread.
+ */
+EXPORT void heap_arena_pause(void)
+{
+	arena_paused++;
+}
+
+EXPORT void heap_arena_resume(void)
+{
+	if (arena_paused)
+		arena_paused--;
+}
+
+void heap_arena_report(void)
+{
+	if (!arena_base || !heap_stats.iterations)
+		return;
+
+	hprintf("[heap] %lu iterations, peak %zu KB, %lu/%lu allocs leaked (%lu KB reclaimed), "
+	        "%lu fallbacks\n",
+	        heap_stats.iterations, heap_stats.peak >> 10,
+	        heap_stats.leaked_allocs, heap_stats.allocs,
+	        heap_stats.leaked_bytes >> 10, heap_stats.fallbacks);
+}
+
+static inline bool heap_in_arena(const void *ptr)
+{
+	return arena_base && (uint8_t *)ptr >= arena_base && (uint8_t *)ptr < arena_base + arena_size;
+}
+
+static inline bool heap_use_arena(uintptr_t caller, size_t size)
+{
+	if (!__atomic_load_n(&arena_active, __ATOMIC_ACQUIRE) || arena_paused)
+		return false;
+
+	/* large requests would exhaust the arena in few iterations */
+	if (size > arena_size / 4)
+		return false;
+
+	for (int i = 0; i < heap_num_ranges; i++) {
+		if (caller >= heap_ranges[i].start && caller < heap_ranges[i].end)
+			return true;
+	}
+	return false;
+}
+
+static void *heap_alloc(size_t size, size_t align)
+{
+	size_t pos, start, end;
+	heap_hdr_t *hdr;
+
+	if (align < HEAP_ALIGN)
+		align = HEAP_ALIGN;
+
+	pos = __atomic_load_n(&arena_pos, __ATOMIC_RELAXED);
+	do {
+		start = (pos + sizeof(heap_hdr_t) + align - 1) & ~(align - 1);
+		end = (start + size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+		if (end > arena_size || end < start) {
+			__atomic_add_fetch(&heap_stats.fallbacks, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&arena_pos, &pos, end, true,
+	                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	hdr = (heap_hdr_t *)(arena_base + start) - 1;
+	hdr->size = size;
+	hdr->magic = HEAP_MAGIC;
+	hdr->gen = arena_gen;
+
+	__atomic_add_fetch(&iter_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&iter_bytes, size, __ATOMIC_RELAXED);
+	return arena_base + start;
+}
+
+/* header of a live arena allocation, NULL if it is from an earlier iteration */
+static heap_hdr_t *heap_hdr(void *ptr)
+{
+	heap_hdr_t *hdr = (heap_hdr_t *)ptr - 1;
+	return hdr->magic == HEAP_MAGIC && hdr->gen == arena_gen ? hdr : NULL;
+}
+
+static void heap_free(void *ptr)
+{
+	heap_hdr_t *hdr = heap_hdr(ptr);
+
+	/* stale pointers from earlier iterations are ignored */
+	if (arena_active && hdr) {
+		hdr->magic = 0;
+		__atomic_add_fetch(&iter_frees, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&iter_bytes, hdr->size, __ATOMIC_RELAXED);
+	}
+}
+
+#define CALLER() ((uintptr_t)__builtin_return_address(0))
+
+/* failed allocations may be the memory limit */
+static inline void *heap_checked(void *ptr, size_t size)
+{
+	if (__builtin_expect(!ptr && size, 0))
+		memlimit_alloc_failed();
+	return ptr;
+}
+
+static __attribute__((noinline)) void *heap_malloc(uintptr_t caller, size_t size)
+{
+	if (heap_use_arena(caller, size)) {
+		void *ptr = heap_alloc(size, HEAP_ALIGN);
+		if (ptr)
+			return ptr;
+	}
+	return heap_checked(next_malloc(size), size);
+}
+
+static __attribute__((noinline)) void *heap_calloc(uintptr_t caller, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (!__builtin_mul_overflow(nmemb, size, &total) && heap_use_arena(caller, total)) {
+		void *ptr = heap_alloc(total, HEAP_ALIGN);
+		if (ptr) {
+			/* arena is reused across iterations */
+			memset(ptr, 0, total);
+			return ptr;
+		}
+	}
+	return heap_checked(next_calloc(nmemb, size), nmemb * size);
+}
+
+static __attribute__((noinline)) void *heap_realloc(uintptr_t caller, void *ptr, size_t size)
+{
+	heap_hdr_t *hdr;
+	void *new_ptr;
+
+	if (!heap_in_arena(ptr)) {
+		if (!ptr && heap_use_arena(caller, size) && (new_ptr = heap_alloc(size, HEAP_ALIGN)))
+			return new_ptr;
+		return heap_checked(next_realloc(ptr, size), size);
+	}
+
+	/* contents and size of a stale allocation are gone, copying would overflow */
+	hdr = heap_hdr(ptr);
+	if (!hdr)
+		habort("[heap] realloc() of arena allocation from an earlier iteration, "
+		       "see heap_arena_pause()");
+
+	if (size <= hdr->size) {
+		return ptr;
+	}
+
+	new_ptr = NULL;
+	if (heap_use_arena(caller, size))
+		new_ptr = heap_alloc(size, HEAP_ALIGN);
+	if (!new_ptr)
+		new_ptr = heap_checked(next_malloc(size), size);
+	if (new_ptr) {
+		memcpy(new_ptr, ptr, hdr->size);
+		heap_free(ptr);
+	}
+	return new_ptr;
+}
+
+static __attribute__((noinline)) void *heap_memalign(uintptr_t caller, size_t alignment, size_t size)
+{
+	if ((alignment & (alignment - 1)) == 0 && alignment <= PAGE_SIZE &&
+	    heap_use_arena(caller, size)) {
+		void *ptr = heap_alloc(size, alignment);
+		if (ptr)
+			return ptr;
+	}
+	return heap_checked(next_memalign(alignment, size), size);
+}
+
+EXPORT void *malloc(size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_malloc(CALLER(), size);
+	return next_malloc(size);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_calloc(CALLER(), nmemb, size);
+	return next_calloc(nmemb, size);
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_realloc(CALLER(), ptr, size);
+	return next_realloc(ptr, size);
+}
+
+EXPORT void free(void *ptr)
+{
+	if (__builtin_expect(heap_hooked, 0) && heap_in_arena(ptr)) {
+		heap_free(ptr);
+		return;
+	}
+	next_free(ptr);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_memalign(CALLER(), alignment, size);
+	return next_memalign(alignment, size);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_memalign(CALLER(), alignment, size);
+	return next_memalign(alignment, size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	if (__builtin_expect(heap_hooked, 0))
+		ptr = heap_memalign(CALLER(), alignment, size);
+	else
+		ptr = next_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+EXPORT void *valloc(size_t size)
+{
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_checked(next_memalign(PAGE_SIZE, size), size);
+	return next_memalign(PAGE_SIZE, size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+	size_t aligned = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+	if (__builtin_expect(heap_hooked, 0))
+		return heap_checked(next_memalign(PAGE_SIZE, aligned), size);
+	return next_memalign(PAGE_SIZE, aligned);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+	heap_hdr_t *hdr;
+
+	if (__builtin_expect(heap_hooked, 0) && heap_in_arena(ptr))
+		return (hdr = heap_hdr(ptr)) ? hdr->size : 0;
+	if (heap_in_boot(ptr))
+		return ((heap_hdr_t *)ptr - 1)->size;
+	if (!NEXT(malloc_usable_size))
+		return 0;
+	return real_malloc_usable_size(ptr);
+}
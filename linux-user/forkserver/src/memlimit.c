@@ -0,0 +1,338 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * memlimit.c - per-exec memory limit and peak RSS statistics
+ *
+ * The limit is enforced by the first available mechanism:
+ *
+ *   cgroup - memory.max of the NYX_CGROUP leaf, the kernel OOM-kills the
+ *            execution and the kill is detected from memory.events
+ *   asan   - ASAN reserves terabytes of shadow memory, so RLIMIT_AS is
+ *            unusable. A sanitizer malloc hook checks the allocated bytes.
+ *   rlimit - RLIMIT_AS, allocation failures in heap.c end the execution
+ *
+ * Executions over the limit end with SIGKILL and are reported as
+ * out-of-memory rather than as a crash: in cgroup mode if the oom_kill count
+ * of memory.events went up, otherwise if the exec flagged the kill in shared
+ * memory before raising it. The exit status is never used, so targets are
+ * free to exit with any code. Like timeouts, out-of-memory executions are
+ * only logged via hprintf, since any PANIC variant is filed as a crash by
+ * the host. They are counted in the periodic report. Peak RSS of every
+ * execution is kept in a log2 histogram that survives snapshot restore and
+ * is reported periodically.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define MEM_HIST_BUCKETS 32
+
+enum {
+	MEM_NONE,
+	MEM_CGROUP,
+	MEM_ASAN,
+	MEM_RLIMIT,
+};
+
+static const char *mem_mode_str[] = {
+	[MEM_NONE] = "none",
+	[MEM_CGROUP] = "cgroup",
+	[MEM_ASAN] = "asan",
+	[MEM_RLIMIT] = "rlimit",
+};
+
+typedef struct {
+	uint64_t execs;
+	uint64_t ooms;
+	uint64_t max_kb;
+	uint64_t hist[MEM_HIST_BUCKETS]; /* peak RSS, bucket i holds [2^i, 2^(i+1)) KB */
+	uint32_t oom_pending;            /* set by an exec that kills itself over the limit */
+} mem_stats_t;
+
+static mem_stats_t *mem_stats;
+static unsigned mem_report_execs;
+static int mem_mode;
+static size_t mem_limit;
+static bool mem_active;
+static int mem_clear_refs_fd = -1;
+static int mem_events_fd = -1;
+static uint64_t mem_oom_kills;
+static char mem_oom_msg[64];
+
+extern int __sanitizer_install_malloc_and_free_hooks(
+	void (*malloc_hook)(const volatile void *, size_t),
+	void (*free_hook)(const volatile void *)) __attribute__((weak));
+extern size_t __sanitizer_get_current_allocated_bytes(void) __attribute__((weak));
+
+static uint64_t mem_read_oom_kills(void)
+{
+	char buf[512];
+	char *p;
+	ssize_t len;
+
+	len = pread(mem_events_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	p = strstr(buf, "oom_kill ");
+	return p ? strtoull(p + 9, NULL, 10) : 0;
+}
+
+static int mem_cgroup_write(const char *cgroup, const char *file, const char *value)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, value, strlen(value));
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+static int mem_cgroup_init(const char *cgroup)
+{
+	char path[PATH_MAX];
+	char value[32];
+
+	snprintf(value, sizeof(value), "%zu", mem_limit);
+	if (mem_cgroup_write(cgroup, "memory.max", value) != 0)
+		return -1;
+	/* swapping out would only slow down the execution */
+	mem_cgroup_write(cgroup, "memory.swap.max", "0");
+
+	snprintf(path, sizeof(path), "%s/memory.events", cgroup);
+	mem_events_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (mem_events_fd < 0)
+		return -1;
+	mem_oom_kills = mem_read_oom_kills();
+	return 0;
+}
+
+/* end the exec over the limit, see memlimit_oom() */
+static void mem_oom_kill(void)
+{
+	__atomic_store_n(&mem_stats->oom_pending, 1, __ATOMIC_RELEASE);
+	raise(SIGKILL);
+}
+
+static void mem_asan_hook(const volatile void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+
+	if (mem_active && __sanitizer_get_current_allocated_bytes() > mem_limit)
+		mem_oom_kill();
+}
+
+static bool mem_is_asan(void)
+{
+#ifdef ASAN_BUILD
+	return true;
+#else
+	return dlsym(RTLD_DEFAULT, "__asan_init") != NULL;
+#endif
+}
+
+/**
+ * Set up memory limit and statistics. Call once in the forkserver.
+ *
+ * limit_mb     - per-exec limit, 0 only collects statistics
+ * report_execs - report statistics every report_execs execs (0 = never)
+ */
+int memlimit_init(size_t limit_mb, unsigned report_execs)
+{
+	const char *cgroup = proctree_cgroup();
+	size_t pages = (sizeof(mem_stats_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if (replay_mode) {
+		/* shared with exec children for oom_pending */
+		mem_stats = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (mem_stats == MAP_FAILED)
+			mem_stats = NULL;
+	} else {
+		mem_stats = malloc_shared_pages(pages);
+		if (mem_stats) {
+			memset(mem_stats, 0, pages * PAGE_SIZE);
+			persist_pages(mem_stats, pages);
+		}
+	}
+	if (!mem_stats)
+		return -ENOMEM;
+
+	mem_report_execs = report_execs;
+	mem_clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+
+	mem_limit = limit_mb << 20;
+	if (!mem_limit) {
+		mem_mode = MEM_NONE;
+	} else if (cgroup && mem_cgroup_init(cgroup) == 0) {
+		mem_mode = MEM_CGROUP;
+	} else if (mem_is_asan()) {
+		if (!__sanitizer_install_malloc_and_free_hooks || !__sanitizer_get_current_allocated_bytes ||
+		    !__sanitizer_install_malloc_and_free_hooks(mem_asan_hook, NULL)) {
+			hprintf("[mem] No cgroup or sanitizer malloc hook for memory limit\n");
+			return -ENOSYS;
+		}
+		mem_mode = MEM_ASAN;
+	} else {
+		mem_mode = MEM_RLIMIT;
+		heap_alloc_checks();
+	}
+
+	snprintf(mem_oom_msg, sizeof(mem_oom_msg), "OOM: exceeded memory limit of %zu MB", limit_mb);
+	hprintf("[mem] Limit %zu MB (%s)\n", limit_mb, mem_mode_str[mem_mode]);
+	return 0;
+}
+
+/**
+ * Apply limit and reset peak RSS. Call in child before main().
+ */
+void memlimit_exec_begin(void)
+{
+	if (!mem_stats)
+		return;
+
+	/* "5" resets the peak RSS reported by getrusage() */
+	if (mem_clear_refs_fd >= 0 && write(mem_clear_refs_fd, "5", 1) != 1) {
+		close(mem_clear_refs_fd);
+		mem_clear_refs_fd = -1;
+	}
+
+	if (mem_mode == MEM_RLIMIT) {
+		struct rlimit r = { .rlim_cur = mem_limit, .rlim_max = mem_limit };
+		static bool set;
+
+		/* the hard limit cannot be raised again, set once per process */
+		if (!set) {
+			ERRNO_FAIL_ON(setrlimit(RLIMIT_AS, &r) != 0, "setrlimit(RLIMIT_AS)");
+			set = true;
+		}
+	}
+	mem_active = true;
+
+	if (mem_report_execs && mem_stats->execs && mem_stats->execs % mem_report_execs == 0)
+		memlimit_report();
+}
+
+/**
+ * Account peak RSS in KB of an exec
+ */
+void memlimit_record(uint64_t rss_kb, bool oom)
+{
+	int bucket;
+
+	if (!mem_stats)
+		return;
+
+	bucket = rss_kb ? 63 - __builtin_clzll(rss_kb) : 0;
+	if (bucket >= MEM_HIST_BUCKETS)
+		bucket = MEM_HIST_BUCKETS - 1;
+
+	mem_stats->execs++;
+	mem_stats->hist[bucket]++;
+	if (rss_kb > mem_stats->max_kb)
+		mem_stats->max_kb = rss_kb;
+	if (oom)
+		mem_stats->ooms++;
+}
+
+/**
+ * Account peak RSS of the current process. Call in child at the end of an exec.
+ */
+void memlimit_exec_end(void)
+{
+	struct rusage usage;
+
+	if (!mem_active)
+		return;
+
+	getrusage(RUSAGE_SELF, &usage);
+	memlimit_record(usage.ru_maxrss, false);
+}
+
+/**
+ * Allocation in heap.c failed. Ends the exec if it ran into the limit.
+ */
+void memlimit_alloc_failed(void)
+{
+	if (mem_active && mem_mode == MEM_RLIMIT)
+		mem_oom_kill();
+}
+
+/**
+ * Check if the exec child terminated with status was out of memory
+ */
+bool memlimit_oom(int status)
+{
+	uint64_t kills;
+	bool pending;
+
+	if (!mem_stats || mem_mode == MEM_NONE)
+		return false;
+
+	pending = __atomic_exchange_n(&mem_stats->oom_pending, 0, __ATOMIC_ACQ_REL);
+	if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL)
+		return false;
+	if (pending)
+		return true;
+
+	if (mem_mode != MEM_CGROUP)
+		return false;
+
+	kills = mem_read_oom_kills();
+	if (kills == mem_oom_kills)
+		return false;
+	mem_oom_kills = kills;
+	return true;
+}
+
+/**
+ * Description of an out-of-memory exec for the host
+ */
+const char *memlimit_oom_msg(void)
+{
+	return mem_oom_msg;
+}
+
+void memlimit_report(void)
+{
+	char buf[HPRINTF_MAX_SIZE];
+	size_t pos = 0;
+
+	if (!mem_stats || !mem_stats->execs)
+		return;
+
+	pos += snprintf(buf + pos, sizeof(buf) - pos, "[mem] %lu execs, %lu OOM, max %lu KB, peak RSS:",
+	                mem_stats->execs, mem_stats->ooms, mem_stats->max_kb);
+	for (int i = 0; i < MEM_HIST_BUCKETS && pos < sizeof(buf); i++) {
+		if (mem_stats->hist[i])
+			pos += snprintf(buf + pos, sizeof(buf) - pos, " %luK:%lu", 1UL << i, mem_stats->hist[i]);
+	}
+	hprintf("%s\n", buf);
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * proctree.c - track and kill the process tree of an execution
+ *
+ * Each exec child becomes the leader of its own process group and, with
+ * NYX_CGROUP, joins a cgroup v2 leaf. The forkserver is a child subreaper,
+ * so descendants orphaned by the target are reparented to it and their exit
+ * status can be inspected. When an execution ends, the whole tree is killed
+ * at once with cgroup.kill, or with kill(-pgid) without a cgroup. The
+ * kill(-pgid) fallback misses descendants that left the process group with
+ * setsid() or setpgid(), use NYX_CGROUP for targets that daemonize.
+ *
+ * In persistent mode, the exec child is a subreaper as well. Descendants of
+ * an iteration then remain its children until reaped, so a single waitid()
+ * tells whether there is anything to clean up after the iteration.
+ *
+ * Crashes of the exec child itself are classified and reported by the
+ * forkserver. Processes forked by the exec child, which the target rather
+ * than the forkserver waits for, report crashes and sanitizer errors directly
+ * to the host. Descendants that exec() another binary inherit LD_PRELOAD and
+ * the NYX_FORKSERVER marker, so they do the same instead of starting another
+ * forkserver.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#define PROCTREE_MAX_PIDS 256
+#define PROCTREE_LEAF "nyx_exec"
+
+/* leaves room for the names of cgroup files */
+static char pt_cgroup[PATH_MAX - 32];
+static int pt_procs_fd = -1;
+static int pt_kill_fd = -1;
+
+static const int pt_crash_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTRAP, SIGSYS,
+};
+
+extern void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+/**
+ * Become child subreaper and set up optional cgroup. Call once in the forkserver.
+ */
+int proctree_init(const char *cgroup)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+	if (ret != 0)
+		return -1;
+
+	/* exec'd descendants must not start another forkserver */
+	setenv("NYX_FORKSERVER", "1", 1);
+
+	if (!cgroup)
+		return 0;
+
+	snprintf(pt_cgroup, sizeof(pt_cgroup), "%s/%s", cgroup, PROCTREE_LEAF);
+	if (mkdir(pt_cgroup, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", pt_cgroup);
+	pt_procs_fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (pt_procs_fd < 0)
+		return -1;
+
+	/* cgroup.kill needs Linux 5.14, fall back to kill(-pgid) */
+	snprintf(path, sizeof(path), "%s/cgroup.kill", pt_cgroup);
+	pt_kill_fd = open(path, O_WRONLY | O_CLOEXEC);
+
+	hprintf("[proctree] Executions in cgroup %s%s\n", pt_cgroup,
+	        pt_kill_fd < 0 ? " (no cgroup.kill)" : "");
+	return 0;
+}
+
+/**
+ * Path of the cgroup leaf holding executions, NULL without NYX_CGROUP
+ */
+const char *proctree_cgroup(void)
+{
+	return pt_procs_fd < 0 ? NULL : pt_cgroup;
+}
+
+static void pt_crash_handler(int sig)
+{
+	/* replicas are waited for and classified by the exec child */
+	if (!dtm_replica)
+		kAFL_hypercall(HYPERCALL_KAFL_PANIC, 1);
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void pt_sanitizer_handler(void)
+{
+	if (!dtm_replica)
+		kAFL_hypercall(HYPERCALL_KAFL_KASAN, 1);
+}
+
+/* report crashes of processes the forkserver cannot wait for */
+static void pt_install_handlers(void)
+{
+	struct sigaction sa;
+
+	if (replay_mode)
+		return;
+
+	for (unsigned i = 0; i < ARRAY_SIZE(pt_crash_signals); i++) {
+		/* keep handlers of the target and sanitizers */
+		if (sigaction(pt_crash_signals[i], NULL, &sa) != 0 || sa.sa_handler != SIG_DFL)
+			continue;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = pt_crash_handler;
+		sigaction(pt_crash_signals[i], &sa, NULL);
+	}
+
+	if (__sanitizer_set_death_callback)
+		__sanitizer_set_death_callback(pt_sanitizer_handler);
+}
+
+/**
+ * Move exec child into its own process group and cgroup. Call in child before main().
+ *
+ * Crash handlers are installed only in processes forked by the exec child.
+ */
+void proctree_exec_begin(void)
+{
+	/* persistent iterations run in the same exec child */
+	static bool atfork_registered = false;
+
+	setpgid(0, 0);
+
+	if (allow_persistent && prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) != 0) {
+		hprintf("[proctree] Failed to become subreaper: %s\n", strerror(errno));
+	}
+
+	if (pt_procs_fd >= 0 && write(pt_procs_fd, "0", 1) != 1) {
+		hprintf("[proctree] Failed to join cgroup: %s\n", strerror(errno));
+	}
+
+	if (!atfork_registered) {
+		pthread_atfork(NULL, NULL, pt_install_handlers);
+		atfork_registered = true;
+	}
+}
+
+/**
+ * Entry point of exec'd descendants, instead of the forkserver
+ */
+void proctree_helper(void)
+{
+	pt_install_handlers();
+}
+
+static bool pt_crashed(int status)
+{
+	if (WIFSIGNALED(status)) {
+		for (unsigned i = 0; i < ARRAY_SIZE(pt_crash_signals); i++) {
+			if (WTERMSIG(status) == pt_crash_signals[i])
+				return true;
+		}
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == ASAN_EXIT_CODE;
+}
+
+/**
+ * Wait for exec child pid, reaping orphaned descendants meanwhile.
+ *
+ * Returns true and the status of a descendant if it crashed before the exec
+ * child ended, false and the status of the exec child otherwise.
+ */
+bool proctree_wait(pid_t pid, int *status, struct rusage *usage)
+{
+	while (1) {
+		int child_status;
+		pid_t ret;
+
+		ret = wait4(-1, &child_status, WUNTRACED | __WALL, usage);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			ERRNO_FAIL_ON(true, "waitpid");
+		}
+
+		if (ret == pid) {
+			*status = child_status;
+			return false;
+		}
+		if (pt_crashed(child_status)) {
+			*status = child_status;
+			return true;
+		}
+	}
+}
+
+/**
+ * Kill and reap remaining process tree of exec child pid. Call in forkserver.
+ */
+void proctree_kill(pid_t pid)
+{
+	if (pt_kill_fd >= 0 && write(pt_kill_fd, "1", 1) == 1) {
+		/* all children of the forkserver are in the cgroup */
+		while (waitpid(-1, NULL, __WALL) > 0 || errno == EINTR)
+			;
+		return;
+	}
+
+	kill(-pid, SIGKILL);
+	while (waitpid(-pid, NULL, __WALL) > 0 || errno == EINTR)
+		;
+	/* descendants which left the process group */
+	while (waitpid(-1, NULL, __WALL | WNOHANG) > 0)
+		;
+}
+
+static int pt_read_stat(pid_t pid, pid_t *ppid, pid_t *pgrp)
+{
+	char path[64];
+	char buf[512];
+	char *comm_end;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	/* comm may contain spaces and parentheses */
+	comm_end = strrchr(buf, ')');
+	if (!comm_end || sscanf(comm_end + 1, " %*c %d %d", ppid, pgrp) != 2)
+		return -1;
+	return 0;
+}
+
+static int pt_list_pids(pid_t *pids, int max)
+{
+	int num = 0;
+
+	if (pt_procs_fd >= 0) {
+		char path[PATH_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/cgroup.procs", pt_cgroup);
+		f = fopen(path, "r");
+		if (f) {
+			while (num < max && fscanf(f, "%d", &pids[num]) == 1)
+				num++;
+			fclose(f);
+			return num;
+		}
+	}
+
+	DIR *dir = opendir("/proc");
+	struct dirent *entry;
+	pid_t pgrp = getpgrp();
+
+	if (!dir)
+		return 0;
+	while (num < max && (entry = readdir(dir))) {
+		pid_t pid = atoi(entry->d_name);
+		pid_t ppid, pid_pgrp;
+
+		if (pid > 0 && pt_read_stat(pid, &ppid, &pid_pgrp) == 0 && pid_pgrp == pgrp)
+			pids[num++] = pid;
+	}
+	closedir(dir);
+	return num;
+}
+
+/**
+ * Kill descendants of the current persistent iteration. Call in exec child.
+ *
+ * Returns true and the status of a descendant which crashed.
+ */
+bool proctree_iteration_end(int *status)
+{
+	pid_t pids[PROCTREE_MAX_PIDS];
+	/* getpid() may be virtualized by determinism.c */
+	pid_t self = syscall(SYS_getpid);
+	bool crashed = false;
+	siginfo_t info;
+	int num_pids;
+
+	/* skip the scan unless the iteration left children, running or not */
+	if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT | __WALL) == -1 &&
+	    errno == ECHILD)
+		return false;
+
+	num_pids = pt_list_pids(pids, ARRAY_SIZE(pids));
+	for (int i = 0; i < num_pids; i++) {
+		pid_t ppid, pgrp, ret;
+		int child_status;
+
+		if (pids[i] == self || pt_read_stat(pids[i], &ppid, &pgrp) != 0)
+			continue;
+
+		kill(pids[i], SIGKILL);
+
+		/* grandchildren are reparented to us and reaped below */
+		if (ppid != self)
+			continue;
+		do {
+			ret = waitpid(pids[i], &child_status, __WALL);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == pids[i] && !crashed && pt_crashed(child_status)) {
+			*status = child_status;
+			crashed = true;
+		}
+	}
+
+	while (1) {
+		int child_status;
+
+		if (waitpid(-1, &child_status, __WALL | WNOHANG) <= 0)
+			break;
+		if (!crashed && pt_crashed(child_status)) {
+			*status = child_status;
+			crashed = true;
+		}
+	}
+	return crashed;
+}
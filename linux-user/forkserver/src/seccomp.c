@@ -0,0 +1,178 @@
+/*
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * seccomp.c - eliminate slow syscalls with a seccomp-bpf filter
+ *
+ * Builds a filter from a comma-separated list of rule groups and/or curated
+ * profiles, and installs it in the exec child before main(). Syscalls are
+ * answered by the kernel filter directly, so this also covers targets that
+ * bypass libc. Rule groups:
+ *
+ *   sleep - nanosleep(), clock_nanosleep() return 0 immediately
+ *   yield - sched_yield() returns 0 immediately
+ *   sync  - fsync() and friends succeed without writeback
+ *   net   - connect() fails with ECONNREFUSED
+ *
+ * Profiles:
+ *
+ *   fast    - sleep,yield,sync
+ *   offline - sleep,yield,sync,net
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include "nyx_api.h"
+#include "nyx_agent.h"
+#include "forkserver.h"
+
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_I386
+#endif
+
+#define SECCOMP_MAX_INSNS 64
+
+#define SC_SLEEP (1 << 0)
+#define SC_YIELD (1 << 1)
+#define SC_SYNC  (1 << 2)
+#define SC_NET   (1 << 3)
+
+static const struct {
+	const char *name;
+	unsigned groups;
+} sc_names[] = {
+	{ "sleep", SC_SLEEP },
+	{ "yield", SC_YIELD },
+	{ "sync", SC_SYNC },
+	{ "net", SC_NET },
+	{ "fast", SC_SLEEP | SC_YIELD | SC_SYNC },
+	{ "offline", SC_SLEEP | SC_YIELD | SC_SYNC | SC_NET },
+};
+
+static const struct {
+	long nr;
+	unsigned group;
+	int err;
+} sc_rules[] = {
+	{ SYS_nanosleep, SC_SLEEP, 0 },
+	{ SYS_clock_nanosleep, SC_SLEEP, 0 },
+	{ SYS_sched_yield, SC_YIELD, 0 },
+	{ SYS_fsync, SC_SYNC, 0 },
+	{ SYS_fdatasync, SC_SYNC, 0 },
+	{ SYS_sync, SC_SYNC, 0 },
+	{ SYS_syncfs, SC_SYNC, 0 },
+	{ SYS_sync_file_range, SC_SYNC, 0 },
+	{ SYS_msync, SC_SYNC, 0 },
+#ifdef SYS_connect
+	/* i386 targets using socketcall() are not covered */
+	{ SYS_connect, SC_NET, ECONNREFUSED },
+#endif
+};
+
+static struct sock_filter sc_insns[SECCOMP_MAX_INSNS];
+static struct sock_fprog sc_prog;
+
+static void sc_emit(struct sock_filter insn)
+{
+	if (sc_prog.len >= SECCOMP_MAX_INSNS)
+		habort("seccomp: filter too large");
+	sc_insns[sc_prog.len++] = insn;
+}
+
+/**
+ * Build filter from comma-separated rule groups or profiles, "none" disables
+ */
+int seccomp_filter_init(const char *spec)
+{
+	char buf[256];
+	char *tok, *saveptr;
+	unsigned groups = 0;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		unsigned i;
+
+		if (0 == strcmp(tok, "none"))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(sc_names); i++) {
+			if (0 == strcmp(tok, sc_names[i].name)) {
+				groups |= sc_names[i].groups;
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(sc_names)) {
+			hprintf("[seccomp] Unknown rule group or profile: %s\n", tok);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	sc_prog.len = 0;
+	sc_prog.filter = sc_insns;
+	if (!groups)
+		return 0;
+
+	/* seccomp filters need CONFIG_SECCOMP_FILTER */
+	if (prctl(PR_GET_SECCOMP, 0, 0, 0, 0) < 0)
+		return -1;
+
+	/* foreign syscall ABI: allow */
+	sc_emit((struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	                                     offsetof(struct seccomp_data, arch)));
+	sc_emit((struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0));
+	sc_emit((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+
+	sc_emit((struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	                                     offsetof(struct seccomp_data, nr)));
+	for (unsigned i = 0; i < ARRAY_SIZE(sc_rules); i++) {
+		if (!(groups & sc_rules[i].group))
+			continue;
+		sc_emit((struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sc_rules[i].nr, 0, 1));
+		sc_emit((struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		                                     SECCOMP_RET_ERRNO | sc_rules[i].err));
+	}
+	sc_emit((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+
+	hprintf("[seccomp] Filter %s: %u instructions\n", spec, sc_prog.len);
+	return 0;
+}
+
+/**
+ * Install filter in the current process. Call in child before main().
+ */
+void seccomp_filter_install(void)
+{
+	static bool installed;
+	int ret;
+
+	/* filters stack up, install only once per process */
+	if (!sc_prog.len || installed)
+		return;
+	installed = true;
+
+	ret = prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+	ERRNO_FAIL_ON(ret != 0, "prctl(PR_SET_NO_NEW_PRIVS)");
+
+	ret = prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &sc_prog);
+	ERRNO_FAIL_ON(ret != 0, "prctl(PR_SET_SECCOMP)");
+}
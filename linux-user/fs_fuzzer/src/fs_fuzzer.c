@@ -121,6 +121,8 @@ int main(int argc, char **argv)
 	int loopctlfd, loopfd, backingfile;
 	long devnr;
 	char *filesystemtype = NULL;
+	static char crash[256];
+	bool kmsg;
 
 	if (argc != 2) {
 		fprintf(stderr, "Usage: fs_fuzzer <fstype>\n"
@@ -160,6 +162,9 @@ int main(int argc, char **argv)
 	ret = ioctl(loopfd, LOOP_SET_FD, backingfile);
 	CHECK_ERRNO(ret != -1, "Failed to ioctl(LOOP_SET_FD)");
 
+	// watch for non-fatal kernel reports (KASAN, UBSAN, ..) logged after boot
+	kmsg = (kmsg_open(false) == 0);
+
 	pbuf->size = 20;
 
 	while (1) {
@@ -193,6 +198,12 @@ int main(int argc, char **argv)
 			}
 		}
 
+		if (kmsg && kmsg_poll(0) > 0 && kmsg_crash_line()) {
+			snprintf(crash, sizeof(crash), "%s", kmsg_crash_line());
+			kmsg_ship();
+			kAFL_hypercall(HYPERCALL_KAFL_PANIC_EXTENDED, (uintptr_t)crash);
+		}
+
 		// first round for warmup - real start now
 		kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
 		kAFL_hypercall(HYPERCALL_KAFL_NEXT_PAYLOAD, 0);
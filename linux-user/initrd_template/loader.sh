@@ -21,8 +21,13 @@ export PATH=$PATH:/fuzz
 #vmcall check
 #echo "Nyx CPU type: $?" | vmcall hcat
 
-vmcall hget -x -o /fuzz agent.sh
-/fuzz/agent.sh 2>&1|tee /fuzz/agent.log
+# agent.sh is executed from memory, /fuzz only holds its log
+mkdir -p /fuzz
+
+# large sharedir trees can be mounted instead, fetching files on first use
+#vmcall hmount rootfs /fuzz/rootfs
+
+vmcall hexec agent.sh 2>&1|tee /fuzz/agent.log
 
 echo "Return from agent.sh. Uploading agent.log" |vmcall hcat
 vmcall hpush /fuzz/agent.log
@@ -17,6 +17,8 @@
  * agent_lib.c - common helper functions for Linux kAFL agents
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -79,6 +81,53 @@ void free_resident_pages(void *buf, size_t num_pages)
 	}
 }
 
+/**
+ * Allocate page-aligned memory that remains shared with forked children
+ *
+ * Unlike malloc_resident_pages(), writes from a forked child land in the
+ * same physical pages, so buffers registered with the host stay valid.
+ */
+void *malloc_shared_pages(size_t num_pages)
+{
+	size_t data_size = PAGE_SIZE * num_pages;
+	void *ptr = NULL;
+
+	ptr = mmap(NULL, data_size, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "Allocation failure: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (mlock(ptr, data_size) == -1) {
+		fprintf(stderr, "Error locking shared buffer: %s\n", strerror(errno));
+		munmap(ptr, data_size);
+		return NULL;
+	}
+	return ptr;
+}
+
+/**
+ * Free memory allocated by malloc_shared_pages()
+ */
+void free_shared_pages(void *buf, size_t num_pages)
+{
+	if (buf) {
+		munmap(buf, num_pages * PAGE_SIZE);
+	}
+}
+
+/**
+ * Exclude pages from snapshot restore, so their content survives across execs
+ */
+void persist_pages(void *buf, size_t num_pages)
+{
+	for (size_t i = 0; i < num_pages; i++) {
+		hypercall(HYPERCALL_KAFL_PERSIST_PAGE_PAST_SNAPSHOT,
+		          (uintptr_t)buf + i * PAGE_SIZE);
+	}
+}
+
 /**
  * Get Nyx VMM type from CPUID
  */
@@ -160,32 +209,46 @@ ssize_t hprintf_from_file(FILE *f)
 	static char hprintf_buffer[HPRINTF_MAX_SIZE] __attribute__((aligned(PAGE_SIZE)));
 
 	while (!feof(f)) {
-		read = fread(hprintf_buffer, 1, sizeof(hprintf_buffer), f);
+		read = fread(hprintf_buffer, 1, sizeof(hprintf_buffer) - 1, f);
 		if (ferror(f)) {
 			fprintf(stderr, "Error reading from file descriptor %d\n", fileno(f));
 			return -1;
 		}
+		if (!read)
+			continue;
 
+		/* the buffer is reused, do not print what is left of the last call */
+		hprintf_buffer[read] = '\0';
 		hypercall(HYPERCALL_KAFL_PRINTF, (uintptr_t)hprintf_buffer);
 		written += read;
 	}
 	return written;
 }
 
-int hget_file(char *src_path, mode_t flags)
+/**
+ * Stream file from sharedir into fd, returns bytes written or negative errno
+ *
+ * All transfers reuse one locked scratch buffer, allocated on first use.
+ */
+ssize_t hget_fd(const char *src_path, int fd)
 {
 	static req_data_bulk_t req_file __attribute((aligned(PAGE_SIZE)));
+	static uint8_t *scratch_buf = NULL;
 
-	int ret = 0;
 	const int num_pages = 256; // 1MB at a time
 
 	size_t scratch_size = num_pages * PAGE_SIZE;
-	uint8_t *scratch_buf = malloc_resident_pages(num_pages);
 
-	for (int i = 0; i < num_pages; i++) {
-		req_file.addresses[i] = (uintptr_t)(scratch_buf + i * PAGE_SIZE);
+	if (!scratch_buf) {
+		scratch_buf = malloc_resident_pages(num_pages);
+		if (!scratch_buf) {
+			return -ENOMEM;
+		}
+		for (int i = 0; i < num_pages; i++) {
+			req_file.addresses[i] = (uintptr_t)(scratch_buf + i * PAGE_SIZE);
+		}
+		req_file.num_addresses = num_pages;
 	}
-	req_file.num_addresses = num_pages;
 
 	if (strlen(src_path) < sizeof(req_file.file_name)) {
 		strcpy(req_file.file_name, src_path);
@@ -193,13 +256,6 @@ int hget_file(char *src_path, mode_t flags)
 		return -ENAMETOOLONG;
 	}
 
-	char *dst_path = basename(src_path); // src_path mangled!
-	int fd = creat(dst_path, flags);
-	if (fd == -1) {
-		fprintf(stderr, "[[hget]  Error opening file %s: %s\n", dst_path, strerror(errno));
-		return errno;
-	}
-
 	unsigned long read = 0;
 	unsigned long written = 0;
 	do {
@@ -207,88 +263,150 @@ int hget_file(char *src_path, mode_t flags)
 		if (read == 0xFFFFFFFFFFFFFFFFUL) {
 			fprintf(stderr, "[hget]  Could not get %s from sharedir. Check Qemu logs.\n",
 			        req_file.file_name);
-			ret = -EIO;
-			goto err_out;
+			return -EIO;
 		}
 
 		if (read != write(fd, scratch_buf, read)) {
-			fprintf(stderr, "[hget]  Failed writing to %s: %s\n", dst_path, strerror(errno));
-			ret = -EIO;
-			goto err_out;
+			fprintf(stderr, "[hget]  Failed writing %s: %s\n", src_path, strerror(errno));
+			return -EIO;
 		}
 
 		written += read;
-		debug_printf("[hget]  %s => %s (read: %lu / written: %lu)\n",
-		             req_file.file_name, dst_path, read, written);
+		debug_printf("[hget]  %s => fd %d (read: %lu / written: %lu)\n",
+		             req_file.file_name, fd, read, written);
 
 	} while (read == scratch_size);
 
-	fprintf(stderr, "[hget]  Successfully fetched %s (%lu bytes)\n", dst_path, written);
+	return written;
+}
 
-err_out:
+/**
+ * Fetch file from sharedir into the current directory
+ */
+int hget_file(char *src_path, mode_t flags)
+{
+	char req_path[sizeof(((req_data_bulk_t *)0)->file_name)];
+	ssize_t written;
+
+	if (strlen(src_path) >= sizeof(req_path)) {
+		return -ENAMETOOLONG;
+	}
+	strcpy(req_path, src_path);
+
+	char *dst_path = basename(src_path); // src_path mangled!
+	int fd = creat(dst_path, flags);
+	if (fd == -1) {
+		fprintf(stderr, "[[hget]  Error opening file %s: %s\n", dst_path, strerror(errno));
+		return errno;
+	}
+
+	written = hget_fd(req_path, fd);
 	close(fd);
-	free(scratch_buf);
-	return ret;
+	if (written < 0) {
+		return written;
+	}
+
+	fprintf(stderr, "[hget]  Successfully fetched %s (%lu bytes)\n", dst_path, written);
+	return 0;
+}
+
+/**
+ * Fetch file from sharedir into an anonymous memory file
+ *
+ * The descriptor is inherited across exec, so that it can be passed to
+ * fexecve() or referenced as /proc/self/fd/N. Returns the descriptor or
+ * negative errno.
+ */
+int hget_memfd(const char *src_path)
+{
+	ssize_t written;
+	int fd;
+
+	fd = memfd_create(src_path, 0);
+	if (fd == -1) {
+		fprintf(stderr, "[hget]  Failed to create memfd for %s: %s\n", src_path, strerror(errno));
+		return -errno;
+	}
+
+	written = hget_fd(src_path, fd);
+	if (written < 0) {
+		close(fd);
+		return written;
+	}
+
+	debug_printf("[hget]  Fetched %s to memfd %d (%lu bytes)\n", src_path, fd, written);
+	return fd;
 }
 
 int hpush_file(char *src_path, char *dst_name, int append)
 {
-	int fd = -1;
-	int ret = 0;
-	ssize_t total_sent = 0;
+	return hpush_file_codec(src_path, dst_name, append, HPUSH_RAW);
+}
+
+/**
+ * Push everything read from fd until EOF, e.g. stdin or a pipe
+ *
+ * Returns the number of bytes read or a negative errno.
+ */
+ssize_t hpush_fd(int fd, const char *dst_name, int append, hpush_codec_t codec)
+{
 	ssize_t bytes = 0;
+	ssize_t total_sent = 0;
+	ssize_t size_hint = -1;
+	struct stat st;
+	hpush_stream_t *stream;
+	static uint8_t read_buf[64 * 1024];
+	int ret;
+
+	/* procfs and pipes report no useful size */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size_hint = st.st_size;
+	}
 
-	uint8_t *scratch_buf = NULL;
-	size_t scratch_size = 1024 * 1024;
-	unsigned scratch_pages = scratch_size / PAGE_SIZE;
+	stream = hpush_open(dst_name, append, codec, size_hint);
+	if (!stream) {
+		return -errno;
+	}
 
-	kafl_dump_file_t put_req __attribute__((aligned(PAGE_SIZE)));
+	while ((bytes = read(fd, read_buf, sizeof(read_buf))) > 0) {
+		if (hpush_write(stream, read_buf, bytes) < 0) {
+			break;
+		}
+		total_sent += bytes;
+	}
+	if (bytes < 0) {
+		habort("hpush read error");
+	}
+
+	ret = hpush_close(stream);
+	return ret ? ret : total_sent;
+}
+
+/**
+ * Push local file to host, compressed if codec is not HPUSH_RAW
+ */
+int hpush_file_codec(char *src_path, char *dst_name, int append, hpush_codec_t codec)
+{
+	int fd = -1;
+	ssize_t ret = 0;
 
 	fd = open(src_path, O_RDONLY);
 	if (fd < 0) {
 		fprintf(stderr, "[hpush] Failed to open file %s: %s\n",
 		        src_path, strerror(errno));
-		ret = errno;
-		goto err_out;
+		return errno;
 	}
 
-	scratch_buf = malloc_resident_pages(scratch_pages);
+	ret = hpush_fd(fd, dst_name, append, codec);
+	close(fd);
 
-	if (!scratch_buf) {
-		fprintf(stderr, "[hpush] Failed to allocate file buffer for %s: %s\n",
-		        src_path, strerror(errno));
-		ret = errno;
-		goto err_out;
+	if (ret < 0) {
+		fprintf(stderr, "[hpush] Failed to push %s: %s\n", src_path, strerror(-ret));
+		return -ret;
 	}
 
-	put_req.file_name_str_ptr = (uintptr_t)dst_name;
-	put_req.append = append;
-	put_req.data_ptr = (uintptr_t)scratch_buf;
-
-	do {
-		bytes = read(fd, scratch_buf, scratch_size);
-		hprintf("[hpush] %s => %s (%lu bytes)\n", src_path, dst_name, bytes);
-
-		if (bytes == -1) {
-			habort("hpush read error");
-		} else if (bytes == 0) {
-			break;
-		} else if (bytes > 0) {
-			put_req.bytes = bytes;
-			kAFL_hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&put_req);
-			total_sent += bytes;
-			// append any subsequent chunks
-			put_req.append = 1;
-		}
-	} while (bytes > 0);
-
-	hprintf("[hpush] %s => %s (%lu bytes)\n",
-	        src_path, dst_name, total_sent);
-
-err_out:
-	free_resident_pages(scratch_buf, scratch_pages);
-	close(fd);
-	return ret;
+	hprintf("[hpush] %s => %s (%lu bytes)\n", src_path, dst_name, ret);
+	return 0;
 }
 
 int check_host_magic(int verbose)
@@ -323,3 +441,55 @@ int check_host_magic(int verbose)
 	}
 	return 0;
 }
+
+/**
+ * Parse /proc/<pid>/maps and return mappings whose path contains pattern
+ *
+ * A NULL pattern matches all mappings, anonymous mappings have an empty path.
+ * Returns the number of entries stored in maps, or -1 on error.
+ */
+int maps_read(const char *mapfile, const char *pattern, nyx_map_t *maps, int max_maps)
+{
+	char line[4096];
+	int num_maps = 0;
+
+	FILE *fp = fopen(mapfile, "r");
+	if (!fp) {
+		fprintf(stderr, "Failed to open %s: %s\n", mapfile, strerror(errno));
+		return -1;
+	}
+
+	while (num_maps < max_maps && fgets(line, sizeof(line), fp) == line) {
+		nyx_map_t *map = &maps[num_maps];
+		int ret;
+
+		ret = sscanf(line, "%lx-%lx %4c %lx %*x:%*x %*d %255s",
+		             &map->start, &map->end, map->perms, &map->offset, map->path);
+
+		if (ret == 4)
+			map->path[0] = '\0';
+		else if (ret != 5)
+			continue;
+
+		map->perms[4] = '\0';
+		if (pattern && !strstr(map->path, pattern))
+			continue;
+
+		num_maps++;
+	}
+
+	fclose(fp);
+	return num_maps;
+}
+
+/**
+ * Find the mapping containing addr, or NULL
+ */
+const nyx_map_t *maps_lookup(const nyx_map_t *maps, int num_maps, uintptr_t addr)
+{
+	for (int i = 0; i < num_maps; i++) {
+		if (addr >= maps[i].start && addr < maps[i].end)
+			return &maps[i];
+	}
+	return NULL;
+}
@@ -16,7 +16,10 @@
  * kafl_agent.h - common helpers for Linux kAFL agents
  */
 
+#include <stdbool.h>
+
 #include <nyx_api.h>
+#include <nyx_ijon.h>
 
 #define KAFL_CPUID_IDENTIFIER 0x80000004
 #define PAGE_SIZE 4096
@@ -41,13 +44,123 @@ typedef enum {
 
 extern nyx_cpu_type_t nyx_cpu_type;
 
+/* streaming uploads with optional compression, see nyx_hpush.c */
+typedef enum {
+	HPUSH_RAW = 0,
+	HPUSH_ZSTD, /* needs WITH_ZSTD=1 */
+	HPUSH_LZ4   /* needs WITH_LZ4=1 */
+} hpush_codec_t;
+
+typedef struct hpush_stream hpush_stream_t;
+
+hpush_codec_t hpush_default_codec(void);
+hpush_stream_t *hpush_open(const char *dst_name, int append, hpush_codec_t codec, ssize_t size_hint);
+ssize_t hpush_write(hpush_stream_t *s, const void *data, size_t len);
+int hpush_close(hpush_stream_t *s);
+
+/* kernel log tail capture, see nyx_kmsg.c */
+#define KMSG_TAIL_SIZE (64 * 1024)
+
+int kmsg_open(bool from_start);
+int kmsg_poll(int timeout_ms);
+const char *kmsg_crash_line(void);
+size_t kmsg_ship(void);
+void kmsg_close(void);
+
 void *malloc_resident_pages(size_t num_pages);
 void free_resident_pages(void *buf, size_t num_pages);
 nyx_cpu_type_t get_nyx_cpu_type(void);
 unsigned long hypercall(unsigned id, uintptr_t arg);
 ssize_t hprintf_from_file(FILE *f);
+ssize_t hget_fd(const char *src_path, int fd);
 int hget_file(char *src_path, mode_t flags);
+int hget_memfd(const char *src_path);
 int hpush_file(char *src_path, char *dst_name, int append);
+int hpush_file_codec(char *src_path, char *dst_name, int append, hpush_codec_t codec);
+ssize_t hpush_fd(int fd, const char *dst_name, int append, hpush_codec_t codec);
 int check_host_magic(int verbose);
 void habort_msg(const char *msg);
 void hrange_submit(unsigned id, uintptr_t start, uintptr_t end);
+
+/* shared + snapshot-persistent memory */
+void *malloc_shared_pages(size_t num_pages);
+void free_shared_pages(void *buf, size_t num_pages);
+void persist_pages(void *buf, size_t num_pages);
+
+/* /proc/<pid>/maps parsing */
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+	uintptr_t offset;
+	char perms[5];
+	char path[256];
+} nyx_map_t;
+
+int maps_read(const char *mapfile, const char *pattern, nyx_map_t *maps, int max_maps);
+const nyx_map_t *maps_lookup(const nyx_map_t *maps, int num_maps, uintptr_t addr);
+
+/* sampling profiler, see nyx_profile.c */
+int profile_init(unsigned hz, unsigned flush_execs);
+void profile_start(void);
+int profile_flush(char *dst_name);
+
+/* IJON state annotations, see nyx_ijon.h */
+int ijon_setup(host_config_t *host_config, agent_config_t *agent_config);
+void ijon_reset(void);
+
+/* comparison logging, see nyx_cmplog.c */
+#define CMPLOG_MAGIC 0x434c794e
+#define CMPLOG_MAX_OPERAND 32
+#define CMPLOG_TYPE_INT 1
+#define CMPLOG_TYPE_MEM 2
+
+typedef struct {
+	uint64_t pc;
+	uint8_t type;
+	uint8_t size;
+	uint8_t op0[CMPLOG_MAX_OPERAND];
+	uint8_t op1[CMPLOG_MAX_OPERAND];
+} __attribute__((packed)) cmplog_entry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t entry_size;
+	uint32_t num_entries;
+	uint32_t dropped;
+	cmplog_entry_t entries[];
+} __attribute__((packed)) cmplog_hdr_t;
+
+int cmplog_init(size_t num_pages);
+void cmplog_reset(void);
+int cmplog_flush(char *dst_name);
+
+/* agent-side coverage and stability calibration, see nyx_trace.c */
+#define TRACE_MASK_MAGIC 0x4d49794e
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint64_t inputs;
+	uint32_t unstable;
+	uint32_t dirty;
+	uint8_t mask[]; /* 1 = unstable bitmap index */
+} __attribute__((packed)) trace_mask_hdr_t;
+
+extern uint8_t *trace_bitmap;
+extern uint32_t trace_bitmap_size;
+
+int trace_setup(host_config_t *host_config, agent_config_t *agent_config);
+void trace_reset(void);
+size_t trace_diff(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len);
+int trace_calibrate_init(void);
+uint64_t trace_calibrate_inputs(void);
+void trace_calibrate_begin(void);
+void trace_calibrate_run(void);
+int trace_calibrate_flush(char *dst_name);
+
+/* in-guest havoc mutations on agent-side coverage, see nyx_havoc.c */
+int havoc_init(uint64_t seed);
+size_t havoc_mutate(uint8_t *buf, size_t len, size_t max_len);
+bool havoc_check_coverage(void);
+int havoc_dump(const char *prefix, const uint8_t *buf, size_t len, bool crashed);
+void havoc_count(unsigned runs, unsigned report);
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_cmplog.c - agent-side comparison logging
+ *
+ * Implements the SanitizerCoverage trace-cmp callbacks and the sanitizer
+ * memcmp/strcmp weak hooks. Operand pairs are recorded into a shared buffer
+ * which is dumped to the host for input-to-state replacement, as a
+ * replacement for Redqueen on hosts without PT tracing.
+ *
+ * Build targets with -fsanitize-coverage=trace-cmp (optionally together with
+ * -fsanitize=address for the memcmp/strcmp hooks) and call cmplog_init().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <strings.h>
+
+#include <errno.h>
+
+#include <sys/types.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define CMPLOG_SEEN_SLOTS 4096
+
+static cmplog_hdr_t *cmplog;
+static uint32_t cmplog_max_entries;
+
+/* skip repeated identical comparisons, e.g. from loops */
+static uint32_t cmplog_seen[CMPLOG_SEEN_SLOTS];
+
+static inline uint32_t cmplog_hash(uintptr_t pc, const void *op0, const void *op1, size_t len)
+{
+	const uint8_t *a = op0;
+	const uint8_t *b = op1;
+	uint32_t hash = 0x811c9dc5 ^ (uint32_t)pc ^ (uint32_t)((uint64_t)pc >> 32);
+
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ a[i]) * 0x01000193;
+		hash = (hash ^ b[i]) * 0x01000193;
+	}
+	return hash ? hash : 1;
+}
+
+static void cmplog_record(uintptr_t pc, uint8_t type, const void *op0, const void *op1, size_t len)
+{
+	cmplog_entry_t *entry;
+	uint32_t hash;
+	uint32_t idx;
+
+	if (!cmplog)
+		return;
+
+	if (len > CMPLOG_MAX_OPERAND)
+		len = CMPLOG_MAX_OPERAND;
+
+	hash = cmplog_hash(pc, op0, op1, len);
+	if (cmplog_seen[hash % CMPLOG_SEEN_SLOTS] == hash)
+		return;
+	cmplog_seen[hash % CMPLOG_SEEN_SLOTS] = hash;
+
+	idx = __atomic_fetch_add(&cmplog->num_entries, 1, __ATOMIC_RELAXED);
+	if (idx >= cmplog_max_entries) {
+		cmplog->num_entries = cmplog_max_entries;
+		__atomic_add_fetch(&cmplog->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	entry = &cmplog->entries[idx];
+	entry->pc = pc;
+	entry->type = type;
+	entry->size = len;
+	memcpy(entry->op0, op0, len);
+	memcpy(entry->op1, op1, len);
+}
+
+static inline void cmplog_int(uintptr_t pc, uint64_t arg1, uint64_t arg2, size_t len)
+{
+	if (arg1 != arg2) {
+		cmplog_record(pc, CMPLOG_TYPE_INT, &arg1, &arg2, len);
+	}
+}
+
+/**
+ * Allocate shared comparison log of num_pages and start recording
+ */
+int cmplog_init(size_t num_pages)
+{
+	cmplog = malloc_shared_pages(num_pages);
+	if (!cmplog)
+		return -ENOMEM;
+
+	cmplog_max_entries = (num_pages * PAGE_SIZE - sizeof(cmplog_hdr_t)) / sizeof(cmplog_entry_t);
+	cmplog_reset();
+	return 0;
+}
+
+/**
+ * Clear log, e.g. between persistent-mode iterations
+ */
+void cmplog_reset(void)
+{
+	if (cmplog) {
+		memset(cmplog, 0, sizeof(cmplog_hdr_t));
+		cmplog->magic = CMPLOG_MAGIC;
+		cmplog->entry_size = sizeof(cmplog_entry_t);
+		memset(cmplog_seen, 0, sizeof(cmplog_seen));
+	}
+}
+
+/**
+ * Dump log to host, straight from the shared buffer
+ */
+int cmplog_flush(char *dst_name)
+{
+	kafl_dump_file_t put_req __attribute__((aligned(PAGE_SIZE)));
+
+	if (!cmplog)
+		return -EINVAL;
+
+	put_req.file_name_str_ptr = (uintptr_t)dst_name;
+	put_req.append = 0;
+	put_req.data_ptr = (uintptr_t)cmplog;
+	put_req.bytes = sizeof(cmplog_hdr_t) + cmplog->num_entries * sizeof(cmplog_entry_t);
+
+	hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&put_req);
+	return 0;
+}
+
+/*
+ * SanitizerCoverage -fsanitize-coverage=trace-cmp callbacks
+ */
+#define PC() ((uintptr_t)__builtin_return_address(0))
+
+void __sanitizer_cov_trace_cmp1(uint8_t arg1, uint8_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 1);
+}
+
+void __sanitizer_cov_trace_cmp2(uint16_t arg1, uint16_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 2);
+}
+
+void __sanitizer_cov_trace_cmp4(uint32_t arg1, uint32_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 4);
+}
+
+void __sanitizer_cov_trace_cmp8(uint64_t arg1, uint64_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 8);
+}
+
+void __sanitizer_cov_trace_const_cmp1(uint8_t arg1, uint8_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 1);
+}
+
+void __sanitizer_cov_trace_const_cmp2(uint16_t arg1, uint16_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 2);
+}
+
+void __sanitizer_cov_trace_const_cmp4(uint32_t arg1, uint32_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 4);
+}
+
+void __sanitizer_cov_trace_const_cmp8(uint64_t arg1, uint64_t arg2)
+{
+	cmplog_int(PC(), arg1, arg2, 8);
+}
+
+void __sanitizer_cov_trace_switch(uint64_t val, uint64_t *cases)
+{
+	uintptr_t pc = PC();
+
+	/* cases[0] = number of cases, cases[1] = bit width */
+	for (uint64_t i = 0; i < cases[0]; i++) {
+		cmplog_int(pc + i, val, cases[i + 2], cases[1] / 8);
+	}
+}
+
+/*
+ * Sanitizer interceptor hooks for memory and string comparisons
+ */
+static void cmplog_mem(uintptr_t pc, const void *s1, const void *s2, size_t n, int result)
+{
+	if (result != 0 && n > 1) {
+		cmplog_record(pc, CMPLOG_TYPE_MEM, s1, s2, n);
+	}
+}
+
+void __sanitizer_weak_hook_memcmp(void *called_pc, const void *s1, const void *s2, size_t n,
+                                  int result)
+{
+	cmplog_mem((uintptr_t)called_pc, s1, s2, n, result);
+}
+
+void __sanitizer_weak_hook_strncmp(void *called_pc, const char *s1, const char *s2, size_t n,
+                                   int result)
+{
+	size_t len = strnlen(s1, n);
+	cmplog_mem((uintptr_t)called_pc, s1, s2, strnlen(s2, len), result);
+}
+
+void __sanitizer_weak_hook_strcmp(void *called_pc, const char *s1, const char *s2, int result)
+{
+	size_t len = strnlen(s2, CMPLOG_MAX_OPERAND);
+	cmplog_mem((uintptr_t)called_pc, s1, s2, strnlen(s1, len + 1), result);
+}
+
+void __sanitizer_weak_hook_strncasecmp(void *called_pc, const char *s1, const char *s2, size_t n,
+                                       int result)
+{
+	__sanitizer_weak_hook_strncmp(called_pc, s1, s2, n, result);
+}
+
+void __sanitizer_weak_hook_strcasecmp(void *called_pc, const char *s1, const char *s2, int result)
+{
+	__sanitizer_weak_hook_strcmp(called_pc, s1, s2, result);
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_havoc.c - in-guest havoc mutations with local coverage feedback
+ *
+ * Mutates a host payload with stacked AFL-style havoc operations and checks
+ * the agent coverage bitmap (see nyx_trace.c) of each run against a virgin
+ * map. Inputs that hit new bitmap entries are dumped to the host, so that
+ * cheap targets are fuzzed at the speed of the target instead of the speed
+ * of VM exits and snapshot restores.
+ *
+ * The virgin map and random state are persisted across snapshot restore.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+
+#include <sys/types.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define HAVOC_MAX_STACK_POW2 5
+#define HAVOC_BLOCK_MAX 128
+
+typedef struct {
+	uint64_t rand_state;
+	uint64_t runs;
+	uint64_t finds;
+	uint64_t crashes;
+	uint8_t virgin[]; /* 1 = hit-count class not seen yet */
+} havoc_state_t;
+
+static havoc_state_t *havoc;
+static size_t havoc_pages;
+
+static const int8_t havoc_int8[] = { -128, -1, 0, 1, 16, 32, 64, 100, 127 };
+static const int16_t havoc_int16[] = { -32768, -129, 128, 255, 256, 512, 1000, 1024, 4096, 32767 };
+static const int32_t havoc_int32[] = { -2147483647 - 1, -100663046, -32769, 32768, 65535,
+	                                   65536, 100663045, 2147483647 };
+
+/* AFL hit-count classes */
+static inline uint8_t havoc_class(uint8_t count)
+{
+	if (count <= 2)
+		return count;
+	if (count == 3)
+		return 4;
+	if (count < 8)
+		return 8;
+	if (count < 16)
+		return 16;
+	if (count < 32)
+		return 32;
+	if (count < 128)
+		return 64;
+	return 128;
+}
+
+static inline uint64_t havoc_rand(void)
+{
+	/* splitmix64 */
+	uint64_t z = (havoc->rand_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline size_t havoc_below(size_t limit)
+{
+	return limit ? havoc_rand() % limit : 0;
+}
+
+/**
+ * Allocate persistent virgin map and random state. Call after trace_setup().
+ */
+int havoc_init(uint64_t seed)
+{
+	if (!trace_bitmap) {
+		return -EINVAL;
+	}
+
+	havoc_pages = (sizeof(havoc_state_t) + trace_bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	havoc = malloc_shared_pages(havoc_pages);
+	if (!havoc) {
+		return -ENOMEM;
+	}
+	memset(havoc, 0, sizeof(havoc_state_t));
+	memset(havoc->virgin, 0xff, trace_bitmap_size);
+	persist_pages(havoc, havoc_pages);
+
+	havoc->rand_state = seed;
+	return 0;
+}
+
+/**
+ * Apply a stack of random havoc mutations to buf in place
+ *
+ * Returns the new length, at most max_len.
+ */
+size_t havoc_mutate(uint8_t *buf, size_t len, size_t max_len)
+{
+	unsigned stack;
+
+	if (!havoc || max_len == 0) {
+		return len;
+	}
+	stack = 1 << (1 + havoc_below(HAVOC_MAX_STACK_POW2));
+	if (len == 0) {
+		buf[0] = havoc_rand();
+		len = 1;
+	}
+
+	for (unsigned i = 0; i < stack; i++) {
+		size_t pos = havoc_below(len);
+
+		switch (havoc_below(12)) {
+		case 0:
+			buf[pos] ^= 1 << havoc_below(8);
+			break;
+		case 1:
+			buf[pos] = havoc_rand();
+			break;
+		case 2:
+			buf[pos] += 1 + havoc_below(35);
+			break;
+		case 3:
+			buf[pos] -= 1 + havoc_below(35);
+			break;
+		case 4:
+			buf[pos] = havoc_int8[havoc_below(ARRAY_SIZE(havoc_int8))];
+			break;
+		case 5:
+			if (len >= 2) {
+				int16_t val = havoc_int16[havoc_below(ARRAY_SIZE(havoc_int16))];
+				if (havoc_below(2))
+					val = __builtin_bswap16(val);
+				memcpy(buf + havoc_below(len - 1), &val, sizeof(val));
+			}
+			break;
+		case 6:
+			if (len >= 4) {
+				int32_t val = havoc_int32[havoc_below(ARRAY_SIZE(havoc_int32))];
+				if (havoc_below(2))
+					val = __builtin_bswap32(val);
+				memcpy(buf + havoc_below(len - 3), &val, sizeof(val));
+			}
+			break;
+		case 7:
+			if (len >= 2) {
+				uint16_t val;
+				size_t off = havoc_below(len - 1);
+				memcpy(&val, buf + off, sizeof(val));
+				val += (havoc_below(2) ? 1 : -1) * (1 + havoc_below(35));
+				memcpy(buf + off, &val, sizeof(val));
+			}
+			break;
+		case 8: {
+			/* delete block */
+			size_t block = 1 + havoc_below(len < HAVOC_BLOCK_MAX ? len : HAVOC_BLOCK_MAX);
+			if (block < len) {
+				pos = havoc_below(len - block + 1);
+				memmove(buf + pos, buf + pos + block, len - pos - block);
+				len -= block;
+			}
+			break;
+		}
+		case 9: {
+			/* clone or insert constant block */
+			size_t block = 1 + havoc_below(len < HAVOC_BLOCK_MAX ? len : HAVOC_BLOCK_MAX);
+			size_t src = havoc_below(len - block + 1);
+			if (len + block > max_len)
+				break;
+			pos = havoc_below(len + 1);
+			if (pos < len)
+				memmove(buf + pos + block, buf + pos, len - pos);
+			if (havoc_below(4)) {
+				memmove(buf + pos, buf + (src < pos ? src : src + block), block);
+			} else {
+				memset(buf + pos, havoc_below(2) ? havoc_rand() : buf[havoc_below(len)], block);
+			}
+			len += block;
+			break;
+		}
+		case 10: {
+			/* overwrite with block from the same input */
+			size_t block = 1 + havoc_below(len < HAVOC_BLOCK_MAX ? len : HAVOC_BLOCK_MAX);
+			size_t src = havoc_below(len - block + 1);
+			pos = havoc_below(len - block + 1);
+			memmove(buf + pos, buf + src, block);
+			break;
+		}
+		case 11: {
+			/* overwrite with constant block */
+			size_t block = 1 + havoc_below(len - pos < HAVOC_BLOCK_MAX ? len - pos : HAVOC_BLOCK_MAX);
+			memset(buf + pos, havoc_below(2) ? havoc_rand() : buf[havoc_below(len)], block);
+			break;
+		}
+		}
+	}
+	return len;
+}
+
+/**
+ * Check coverage bitmap for hit-count classes not seen before
+ *
+ * Updates the virgin map and returns true if the last run found new coverage.
+ */
+bool havoc_check_coverage(void)
+{
+	bool found = false;
+
+	if (!havoc) {
+		return false;
+	}
+
+	for (size_t i = 0; i < trace_bitmap_size; i += sizeof(uint64_t)) {
+		uint64_t word;
+
+		/* bitmaps are sparse, skip empty words */
+		memcpy(&word, trace_bitmap + i, sizeof(word));
+		if (!word) {
+			continue;
+		}
+
+		for (size_t j = i; j < i + sizeof(uint64_t) && j < trace_bitmap_size; j++) {
+			uint8_t class = havoc_class(trace_bitmap[j]);
+
+			if (class & havoc->virgin[j]) {
+				havoc->virgin[j] &= ~class;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+/**
+ * Dump an input which found new coverage to the host as <prefix>_<n>, or
+ * one which crashed as <prefix>_crash_<n>
+ */
+int havoc_dump(const char *prefix, const uint8_t *buf, size_t len, bool crashed)
+{
+	kafl_dump_file_t put_req __attribute__((aligned(PAGE_SIZE)));
+	char name[64];
+	uint64_t id;
+
+	if (!havoc) {
+		return -EINVAL;
+	}
+
+	id = crashed ? ++havoc->crashes : ++havoc->finds;
+	snprintf(name, sizeof(name), "%s%s_%lu", prefix, crashed ? "_crash" : "", id);
+
+	put_req.file_name_str_ptr = (uintptr_t)name;
+	put_req.append = 0;
+	put_req.data_ptr = (uintptr_t)buf;
+	put_req.bytes = len;
+
+	hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&put_req);
+	return 0;
+}
+
+/**
+ * Account mutant runs, report statistics every report runs
+ */
+void havoc_count(unsigned runs, unsigned report)
+{
+	if (!havoc) {
+		return;
+	}
+
+	if (report && havoc->runs / report != (havoc->runs + runs) / report) {
+		hprintf("[havoc] %lu runs, %lu new inputs, %lu crashes\n",
+		        havoc->runs + runs, havoc->finds, havoc->crashes);
+	}
+	havoc->runs += runs;
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_hpush.c - streaming file upload via HYPERCALL_KAFL_DUMP_FILE
+ *
+ * Data written to an hpush stream is collected in a resident scratch buffer
+ * and dumped to the host whenever it fills up. Optionally, the stream is
+ * compressed in the guest using zstd (WITH_ZSTD=1) or lz4 (WITH_LZ4=1) and
+ * the host file gets a matching .zst/.lz4 suffix. Both formats allow
+ * concatenated frames, so appending to a compressed file stays valid.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define HPUSH_SCRATCH_SIZE (1024 * 1024)
+#define HPUSH_CHUNK_SIZE (64 * 1024) /* compressor input per step */
+#define HPUSH_NAME_SIZE 256
+
+struct hpush_stream {
+	kafl_dump_file_t req __attribute__((aligned(PAGE_SIZE)));
+	char name[HPUSH_NAME_SIZE];
+	hpush_codec_t codec;
+	uint8_t *buf;
+	size_t len;
+	size_t total_in;
+	size_t total_out;
+	bool failed;
+#ifdef WITH_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+#ifdef WITH_LZ4
+	LZ4F_cctx *lz4;
+	LZ4F_preferences_t lz4_prefs;
+#endif
+};
+
+/* single stream, it shares the resident scratch buffer across all uploads */
+static struct hpush_stream hpush_stream;
+static bool hpush_busy = false;
+
+static const char *hpush_ext[] = {
+	[HPUSH_RAW] = "",
+	[HPUSH_ZSTD] = ".zst",
+	[HPUSH_LZ4] = ".lz4",
+};
+
+/**
+ * Return the best compression codec built into this library, if any
+ */
+hpush_codec_t hpush_default_codec(void)
+{
+#if defined(WITH_ZSTD)
+	return HPUSH_ZSTD;
+#elif defined(WITH_LZ4)
+	return HPUSH_LZ4;
+#else
+	return HPUSH_RAW;
+#endif
+}
+
+/**
+ * Pick compression level by input size, -1 if unknown
+ *
+ * Small dumps are cheap to squeeze hard, large ones would stall the
+ * guest on exit so they get the fastest level.
+ */
+static int hpush_level(hpush_codec_t codec, ssize_t size)
+{
+	if (codec == HPUSH_ZSTD) {
+		if (size < 0)
+			return 3;
+		if (size < 64 * 1024)
+			return 19;
+		if (size < 4 * 1024 * 1024)
+			return 9;
+		if (size < 64 * 1024 * 1024)
+			return 3;
+		return 1;
+	}
+	if (codec == HPUSH_LZ4) {
+		/* levels >= 3 select LZ4HC */
+		if (size >= 0 && size < 4 * 1024 * 1024)
+			return 9;
+		return 0;
+	}
+	return 0;
+}
+
+static void hpush_dump(struct hpush_stream *s)
+{
+	if (!s->len)
+		return;
+
+	s->req.bytes = s->len;
+	kAFL_hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&s->req);
+	s->total_out += s->len;
+	s->len = 0;
+	// append any subsequent chunks
+	s->req.append = 1;
+}
+
+#if defined(WITH_ZSTD) || defined(WITH_LZ4)
+static ssize_t hpush_fail(struct hpush_stream *s)
+{
+	s->failed = true;
+	errno = EIO;
+	return -1;
+}
+#endif
+
+/**
+ * Make room for at least need bytes of output in the scratch buffer
+ */
+static void hpush_reserve(struct hpush_stream *s, size_t need)
+{
+	if (HPUSH_SCRATCH_SIZE - s->len < need)
+		hpush_dump(s);
+}
+
+/**
+ * Open stream to host file dst_name, with suffix added for the given codec
+ *
+ * size_hint is the expected input size for selecting a compression level,
+ * or -1 if unknown. It is not recorded in the frame header, so files may
+ * still grow while being pushed. Returns NULL and sets errno on error.
+ */
+hpush_stream_t *hpush_open(const char *dst_name, int append, hpush_codec_t codec, ssize_t size_hint)
+{
+	struct hpush_stream *s = &hpush_stream;
+	int level = hpush_level(codec, size_hint);
+
+	if (hpush_busy) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	if (codec == HPUSH_ZSTD) {
+#ifndef WITH_ZSTD
+		errno = ENOTSUP;
+		return NULL;
+#endif
+	} else if (codec == HPUSH_LZ4) {
+#ifndef WITH_LZ4
+		errno = ENOTSUP;
+		return NULL;
+#endif
+	} else if (codec != HPUSH_RAW) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!s->buf) {
+		s->buf = malloc_resident_pages(HPUSH_SCRATCH_SIZE / PAGE_SIZE);
+		if (!s->buf)
+			return NULL;
+	}
+
+	if (snprintf(s->name, sizeof(s->name), "%s%s", dst_name, hpush_ext[codec]) >= sizeof(s->name)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	s->codec = codec;
+	s->len = 0;
+	s->total_in = 0;
+	s->total_out = 0;
+	s->failed = false;
+	s->req.file_name_str_ptr = (uintptr_t)s->name;
+	s->req.data_ptr = (uintptr_t)s->buf;
+	s->req.append = append;
+
+#ifdef WITH_ZSTD
+	if (codec == HPUSH_ZSTD) {
+		if (!s->zstd)
+			s->zstd = ZSTD_createCCtx();
+		if (!s->zstd) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		ZSTD_CCtx_reset(s->zstd, ZSTD_reset_session_and_parameters);
+		ZSTD_CCtx_setParameter(s->zstd, ZSTD_c_compressionLevel, level);
+		ZSTD_CCtx_setParameter(s->zstd, ZSTD_c_checksumFlag, 1);
+	}
+#endif
+#ifdef WITH_LZ4
+	if (codec == HPUSH_LZ4) {
+		size_t ret;
+
+		if (!s->lz4 && LZ4F_isError(LZ4F_createCompressionContext(&s->lz4, LZ4F_VERSION))) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(&s->lz4_prefs, 0, sizeof(s->lz4_prefs));
+		s->lz4_prefs.compressionLevel = level;
+		s->lz4_prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+		ret = LZ4F_compressBegin(s->lz4, s->buf, HPUSH_SCRATCH_SIZE, &s->lz4_prefs);
+		if (LZ4F_isError(ret)) {
+			fprintf(stderr, "[hpush] lz4 error: %s\n", LZ4F_getErrorName(ret));
+			errno = EIO;
+			return NULL;
+		}
+		s->len = ret;
+	}
+#endif
+	(void)level;
+
+	hpush_busy = true;
+	return s;
+}
+
+/**
+ * Append len bytes of data to the stream, returns len or -1 on error
+ */
+ssize_t hpush_write(hpush_stream_t *s, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	size_t left = len;
+
+	if (s->failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	while (left) {
+		size_t chunk = left < HPUSH_CHUNK_SIZE ? left : HPUSH_CHUNK_SIZE;
+
+		switch (s->codec) {
+#ifdef WITH_ZSTD
+		case HPUSH_ZSTD: {
+			ZSTD_inBuffer in = { src, chunk, 0 };
+			while (in.pos < in.size) {
+				ZSTD_outBuffer out = { s->buf, HPUSH_SCRATCH_SIZE, s->len };
+				size_t ret = ZSTD_compressStream2(s->zstd, &out, &in, ZSTD_e_continue);
+				if (ZSTD_isError(ret)) {
+					fprintf(stderr, "[hpush] zstd error: %s\n", ZSTD_getErrorName(ret));
+					return hpush_fail(s);
+				}
+				s->len = out.pos;
+				if (s->len == HPUSH_SCRATCH_SIZE)
+					hpush_dump(s);
+			}
+			break;
+		}
+#endif
+#ifdef WITH_LZ4
+		case HPUSH_LZ4: {
+			size_t ret;
+
+			hpush_reserve(s, LZ4F_compressBound(chunk, &s->lz4_prefs));
+			ret = LZ4F_compressUpdate(s->lz4, s->buf + s->len, HPUSH_SCRATCH_SIZE - s->len,
+			                          src, chunk, NULL);
+			if (LZ4F_isError(ret)) {
+				fprintf(stderr, "[hpush] lz4 error: %s\n", LZ4F_getErrorName(ret));
+				return hpush_fail(s);
+			}
+			s->len += ret;
+			break;
+		}
+#endif
+		default:
+			hpush_reserve(s, chunk);
+			memcpy(s->buf + s->len, src, chunk);
+			s->len += chunk;
+			break;
+		}
+
+		src += chunk;
+		left -= chunk;
+		s->total_in += chunk;
+	}
+	return len;
+}
+
+/**
+ * Finish compression, dump remaining data and release the stream
+ */
+int hpush_close(hpush_stream_t *s)
+{
+	int ret = s->failed ? -EIO : 0;
+
+#ifdef WITH_ZSTD
+	if (s->codec == HPUSH_ZSTD && !s->failed) {
+		ZSTD_inBuffer in = { NULL, 0, 0 };
+		size_t left;
+		do {
+			ZSTD_outBuffer out = { s->buf, HPUSH_SCRATCH_SIZE, s->len };
+			left = ZSTD_compressStream2(s->zstd, &out, &in, ZSTD_e_end);
+			if (ZSTD_isError(left)) {
+				fprintf(stderr, "[hpush] zstd error: %s\n", ZSTD_getErrorName(left));
+				ret = -EIO;
+				break;
+			}
+			s->len = out.pos;
+			if (left)
+				hpush_dump(s);
+		} while (left);
+	}
+#endif
+#ifdef WITH_LZ4
+	if (s->codec == HPUSH_LZ4 && !s->failed) {
+		size_t end;
+
+		hpush_reserve(s, LZ4F_compressBound(0, &s->lz4_prefs));
+		end = LZ4F_compressEnd(s->lz4, s->buf + s->len, HPUSH_SCRATCH_SIZE - s->len, NULL);
+		if (LZ4F_isError(end)) {
+			fprintf(stderr, "[hpush] lz4 error: %s\n", LZ4F_getErrorName(end));
+			ret = -EIO;
+		} else {
+			s->len += end;
+		}
+	}
+#endif
+
+	hpush_dump(s);
+
+	if (s->codec != HPUSH_RAW && s->total_in) {
+		hprintf("[hpush] %s: %lu => %lu bytes (%lu%%)\n", s->name,
+		        s->total_in, s->total_out, s->total_out * 100 / s->total_in);
+	}
+
+	hpush_busy = false;
+	return ret;
+}
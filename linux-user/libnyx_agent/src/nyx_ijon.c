@@ -0,0 +1,73 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_ijon.c - IJON buffer setup for Linux agents
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include <sys/types.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+uint8_t *ijon_buffer = NULL;
+uint32_t ijon_buffer_size = 0;
+
+/**
+ * Allocate IJON buffer and register it in agent_config
+ *
+ * Call before HYPERCALL_KAFL_SET_AGENT_CONFIG. The buffer is shared, so
+ * annotations from forked children are visible to the host.
+ */
+int ijon_setup(host_config_t *host_config, agent_config_t *agent_config)
+{
+	size_t num_pages;
+
+	if (host_config->ijon_bitmap_size < IJON_MIN_SIZE) {
+		return -ENOTSUP;
+	}
+
+	num_pages = (host_config->ijon_bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	ijon_buffer = malloc_shared_pages(num_pages);
+	if (!ijon_buffer) {
+		return -ENOMEM;
+	}
+
+	memset(ijon_buffer, 0, num_pages * PAGE_SIZE);
+	ijon_buffer_size = host_config->ijon_bitmap_size;
+
+	agent_config->agent_ijon_tracing = 1;
+	agent_config->ijon_trace_buffer_vaddr = (uintptr_t)ijon_buffer;
+	return 0;
+}
+
+/**
+ * Clear IJON state, e.g. of local runs which are not reported to the host
+ */
+void ijon_reset(void)
+{
+	if (ijon_buffer) {
+		memset(ijon_buffer, 0, ijon_buffer_size);
+	}
+}
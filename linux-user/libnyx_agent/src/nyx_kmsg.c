@@ -0,0 +1,233 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_kmsg.c - kernel log capture from /dev/kmsg
+ *
+ * Kernel log records are read in bulk and kept as formatted text in a tail
+ * ring. Records are matched against common oops/panic markers, so the tail
+ * can be shipped via hprintf only when something went wrong. This allows
+ * running kernel targets with the serial console quiet, avoiding one UART
+ * exit per character.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define KMSG_DEV "/dev/kmsg"
+#define KMSG_RECORD_MAX 8192
+
+static const char *kmsg_markers[] = {
+	"Kernel panic",
+	"Oops",
+	"BUG:",
+	"kernel BUG at",
+	"general protection fault",
+	"Unable to handle kernel",
+	"stack segment:",
+	"KASAN:",
+	"KFENCE:",
+	"UBSAN:",
+};
+
+static int kmsg_fd = -1;
+static char kmsg_ring[KMSG_TAIL_SIZE];
+static size_t kmsg_head; /* next write offset */
+static bool kmsg_wrapped;
+static char kmsg_crash[256];
+
+/**
+ * Open kernel log, skipping records logged so far unless from_start is set
+ */
+int kmsg_open(bool from_start)
+{
+	if (kmsg_fd >= 0)
+		return 0;
+
+	kmsg_fd = open(KMSG_DEV, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (kmsg_fd < 0) {
+		fprintf(stderr, "[kmsg] Failed to open " KMSG_DEV ": %s\n", strerror(errno));
+		return -errno;
+	}
+	if (!from_start) {
+		lseek(kmsg_fd, 0, SEEK_END);
+	}
+
+	kmsg_head = 0;
+	kmsg_wrapped = false;
+	kmsg_crash[0] = '\0';
+	return 0;
+}
+
+void kmsg_close(void)
+{
+	if (kmsg_fd >= 0)
+		close(kmsg_fd);
+	kmsg_fd = -1;
+}
+
+static void kmsg_ring_put(const char *str, size_t len)
+{
+	while (len) {
+		size_t n = sizeof(kmsg_ring) - kmsg_head;
+
+		if (n > len)
+			n = len;
+		memcpy(kmsg_ring + kmsg_head, str, n);
+		kmsg_head += n;
+		str += n;
+		len -= n;
+		if (kmsg_head == sizeof(kmsg_ring)) {
+			kmsg_head = 0;
+			kmsg_wrapped = true;
+		}
+	}
+}
+
+/**
+ * Format one "prio,seq,usec,flags;text\n[ KEY=val\n].." record into the ring
+ * and remember the first line that looks like an oops or panic
+ */
+static void kmsg_record(char *rec, size_t len)
+{
+	unsigned long long usec = 0;
+	char prefix[32];
+	char *text;
+	char *end;
+	int n;
+
+	rec[len] = '\0';
+	text = strchr(rec, ';');
+	if (!text)
+		return;
+	text++;
+
+	end = strchr(text, '\n');
+	if (end)
+		*end = '\0';
+
+	sscanf(rec, "%*u,%*u,%llu", &usec);
+	n = snprintf(prefix, sizeof(prefix), "[%5llu.%06llu] ", usec / 1000000, usec % 1000000);
+	kmsg_ring_put(prefix, n);
+	kmsg_ring_put(text, strlen(text));
+	kmsg_ring_put("\n", 1);
+
+	for (int i = 0; i < ARRAY_SIZE(kmsg_markers); i++) {
+		if (!kmsg_crash[0] && strstr(text, kmsg_markers[i])) {
+			snprintf(kmsg_crash, sizeof(kmsg_crash), "%s", text);
+			break;
+		}
+	}
+}
+
+/**
+ * Read all pending kernel log records into the tail ring
+ *
+ * Waits up to timeout_ms for new records (-1 blocks, 0 does not wait).
+ * Returns the number of records read or a negative errno. Use
+ * kmsg_crash_line() to check if any of them reported an oops or panic.
+ */
+int kmsg_poll(int timeout_ms)
+{
+	static char rec[KMSG_RECORD_MAX];
+	struct pollfd pfd = { .fd = kmsg_fd, .events = POLLIN };
+	int records = 0;
+	ssize_t len;
+
+	if (kmsg_fd < 0)
+		return -EBADF;
+
+	if (timeout_ms != 0 && poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+		return -errno;
+
+	while (1) {
+		len = read(kmsg_fd, rec, sizeof(rec) - 1);
+		if (len < 0) {
+			if (errno == EPIPE) {
+				// records were overwritten before we got to them
+				continue;
+			}
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			return -errno;
+		}
+		if (len == 0)
+			break;
+		kmsg_record(rec, len);
+		records++;
+	}
+	return records;
+}
+
+/**
+ * First oops/panic line seen since the last kmsg_ship(), or NULL
+ */
+const char *kmsg_crash_line(void)
+{
+	return kmsg_crash[0] ? kmsg_crash : NULL;
+}
+
+/**
+ * Ship the tail ring via hprintf and clear it, returns bytes sent
+ */
+size_t kmsg_ship(void)
+{
+	static char hprintf_buffer[HPRINTF_MAX_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	size_t start = kmsg_wrapped ? kmsg_head : 0;
+	size_t len = kmsg_wrapped ? sizeof(kmsg_ring) : kmsg_head;
+	size_t sent = 0;
+
+	// skip partial first line after wrap-around
+	if (kmsg_wrapped) {
+		while (len && kmsg_ring[start] != '\n') {
+			start = (start + 1) % sizeof(kmsg_ring);
+			len--;
+		}
+		if (len) {
+			start = (start + 1) % sizeof(kmsg_ring);
+			len--;
+		}
+	}
+
+	while (sent < len) {
+		size_t n = 0;
+
+		while (n < sizeof(hprintf_buffer) - 1 && sent + n < len) {
+			hprintf_buffer[n] = kmsg_ring[(start + sent + n) % sizeof(kmsg_ring)];
+			n++;
+		}
+		hprintf_buffer[n] = '\0';
+		hypercall(HYPERCALL_KAFL_PRINTF, (uintptr_t)hprintf_buffer);
+		sent += n;
+	}
+
+	kmsg_head = 0;
+	kmsg_wrapped = false;
+	kmsg_crash[0] = '\0';
+	return sent;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_profile.c - in-guest sampling profiler with folded-stack output
+ *
+ * Samples PC and frame-pointer callchain on SIGPROF and aggregates them in a
+ * shared buffer that survives snapshot restore. The aggregate is periodically
+ * written as folded stacks ("mod+0x10;mod+0x20 42") and pushed to the host
+ * for use with flamegraph.pl and similar tools.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <libgen.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_SLOTS 4096
+#define PROFILE_PROBES 32
+#define PROFILE_MAX_MAPS 512
+#define PROFILE_TMP_FILE "/tmp/profile.folded"
+#define PROFILE_MAX_HZ 100000
+
+#if defined(__x86_64__)
+#define UC_PC(uc) ((uc)->uc_mcontext.gregs[REG_RIP])
+#define UC_FP(uc) ((uc)->uc_mcontext.gregs[REG_RBP])
+#define UC_SP(uc) ((uc)->uc_mcontext.gregs[REG_RSP])
+#elif defined(__i386__)
+#define UC_PC(uc) ((uc)->uc_mcontext.gregs[REG_EIP])
+#define UC_FP(uc) ((uc)->uc_mcontext.gregs[REG_EBP])
+#define UC_SP(uc) ((uc)->uc_mcontext.gregs[REG_ESP])
+#endif
+
+typedef struct {
+	uint64_t hash;
+	uint32_t count;
+	uint32_t depth;
+	uintptr_t pc[PROFILE_MAX_DEPTH];
+} profile_slot_t;
+
+typedef struct {
+	uint64_t execs;
+	uint64_t samples;
+	uint64_t dropped;
+	profile_slot_t slots[PROFILE_SLOTS];
+} profile_data_t;
+
+static profile_data_t *profile;
+static size_t profile_pages;
+static unsigned profile_hz;
+static unsigned profile_flush_execs;
+
+/* main thread stack, used to bound the frame pointer walk */
+static uintptr_t stack_lo;
+static uintptr_t stack_hi;
+
+static uint64_t profile_hash(const uintptr_t *pc, unsigned depth)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (unsigned i = 0; i < depth; i++) {
+		hash ^= pc[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash ? hash : 1;
+}
+
+/**
+ * Walk saved frame pointers, staying within the main thread stack
+ */
+static unsigned profile_unwind(ucontext_t *uc, uintptr_t *pc)
+{
+	uintptr_t fp = UC_FP(uc);
+	uintptr_t sp = UC_SP(uc);
+	unsigned depth = 0;
+
+	pc[depth++] = UC_PC(uc);
+
+	if (sp < stack_lo || sp >= stack_hi)
+		return depth;
+
+	while (depth < PROFILE_MAX_DEPTH) {
+		if (fp < sp || fp + 2 * sizeof(uintptr_t) > stack_hi)
+			break;
+		if (fp % sizeof(uintptr_t))
+			break;
+
+		uintptr_t *frame = (uintptr_t *)fp;
+		if (frame[1] == 0)
+			break;
+
+		pc[depth++] = frame[1];
+		sp = fp + 2 * sizeof(uintptr_t);
+		fp = frame[0];
+	}
+	return depth;
+}
+
+static void profile_sample(int sig, siginfo_t *info, void *ctx)
+{
+	uintptr_t pc[PROFILE_MAX_DEPTH];
+	unsigned depth;
+	uint64_t hash;
+	int saved_errno = errno;
+
+	depth = profile_unwind((ucontext_t *)ctx, pc);
+	hash = profile_hash(pc, depth);
+
+	__atomic_add_fetch(&profile->samples, 1, __ATOMIC_RELAXED);
+
+	for (unsigned i = 0; i < PROFILE_PROBES; i++) {
+		profile_slot_t *slot = &profile->slots[(hash + i) % PROFILE_SLOTS];
+		uint64_t expected = 0;
+
+		if (slot->hash == hash ||
+		    __atomic_compare_exchange_n(&slot->hash, &expected, hash, false,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			if (slot->depth == 0) {
+				memcpy(slot->pc, pc, depth * sizeof(pc[0]));
+				slot->depth = depth;
+			}
+			__atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+			errno = saved_errno;
+			return;
+		}
+	}
+
+	__atomic_add_fetch(&profile->dropped, 1, __ATOMIC_RELAXED);
+	errno = saved_errno;
+}
+
+/**
+ * Allocate persistent sample buffer. Call once, before the snapshot is taken.
+ *
+ * hz          - sampling frequency (of consumed CPU time)
+ * flush_execs - push folded stacks to host every flush_execs executions
+ */
+int profile_init(unsigned hz, unsigned flush_execs)
+{
+	nyx_map_t stack;
+
+	if (hz == 0)
+		return -EINVAL;
+	if (hz > PROFILE_MAX_HZ) {
+		fprintf(stderr, "[profile] Sampling rate %u too high, using %u Hz\n", hz, PROFILE_MAX_HZ);
+		hz = PROFILE_MAX_HZ;
+	}
+
+	profile_pages = (sizeof(profile_data_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+	profile = malloc_shared_pages(profile_pages);
+	if (!profile)
+		return -ENOMEM;
+
+	memset(profile, 0, profile_pages * PAGE_SIZE);
+	persist_pages(profile, profile_pages);
+
+	if (maps_read("/proc/self/maps", "[stack]", &stack, 1) == 1) {
+		stack_lo = stack.start;
+		stack_hi = stack.end;
+	}
+
+	profile_hz = hz;
+	profile_flush_execs = flush_execs;
+	return 0;
+}
+
+/**
+ * Start sampling the current process. Call at the start of each execution.
+ */
+void profile_start(void)
+{
+	static bool timer_failed = false;
+	struct sigaction sa;
+	struct itimerval timer;
+
+	if (!profile)
+		return;
+
+	profile->execs++;
+	if (profile_flush_execs && (profile->execs % profile_flush_execs) == 0) {
+		profile_flush("profile.folded");
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = profile_sample;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+
+	timer.it_interval.tv_sec = 1 / profile_hz;
+	timer.it_interval.tv_usec = (1000000 / profile_hz) % 1000000;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0 && !timer_failed) {
+		hprintf("[profile] Failed to start sampling timer: %s\n", strerror(errno));
+		timer_failed = true;
+	}
+}
+
+static void profile_print_frame(FILE *f, const nyx_map_t *maps, int num_maps, uintptr_t pc)
+{
+	const nyx_map_t *map = maps_lookup(maps, num_maps, pc);
+
+	if (map && map->path[0]) {
+		char path[sizeof(map->path)];
+		strcpy(path, map->path);
+		fprintf(f, "%s+0x%lx", basename(path), pc - map->start + map->offset);
+	} else {
+		fprintf(f, "0x%lx", pc);
+	}
+}
+
+/**
+ * Resolve aggregated samples to module offsets and push as folded stacks,
+ * returns 0 or a negative errno
+ */
+int profile_flush(char *dst_name)
+{
+	static nyx_map_t maps[PROFILE_MAX_MAPS];
+	int num_maps;
+	FILE *f;
+	int ret;
+
+	if (!profile)
+		return -EINVAL;
+
+	num_maps = maps_read("/proc/self/maps", NULL, maps, ARRAY_SIZE(maps));
+	if (num_maps < 0)
+		return -EIO;
+
+	f = fopen(PROFILE_TMP_FILE, "w");
+	if (!f) {
+		fprintf(stderr, "[profile] Failed to open %s: %s\n", PROFILE_TMP_FILE, strerror(errno));
+		return -errno;
+	}
+
+	for (int i = 0; i < PROFILE_SLOTS; i++) {
+		profile_slot_t *slot = &profile->slots[i];
+
+		if (!slot->count || !slot->depth)
+			continue;
+
+		/* folded format is root-first */
+		for (int d = slot->depth - 1; d >= 0; d--) {
+			profile_print_frame(f, maps, num_maps, slot->pc[d]);
+			fputc(d ? ';' : ' ', f);
+		}
+		fprintf(f, "%u\n", slot->count);
+	}
+	fclose(f);
+
+	hprintf("[profile] %lu execs, %lu samples, %lu dropped\n",
+	        profile->execs, profile->samples, profile->dropped);
+
+	// hpush_file() returns a positive errno
+	ret = hpush_file(PROFILE_TMP_FILE, dst_name, 0);
+	return ret ? -ret : 0;
+}
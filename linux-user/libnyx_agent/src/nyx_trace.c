@@ -0,0 +1,362 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * This software and the related documents are Intel copyrighted materials, and
+ * your use of them is governed by the express license under which they were
+ * provided to you ("License"). Unless the License provides otherwise, you may
+ * not use, modify, copy, publish, distribute, disclose or transmit this software
+ * or the related documents without Intel's prior written permission. This
+ * software and the related documents are provided as is, with no express or
+ * implied warranties, other than those that are expressly stated in the License.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ */
+
+/*
+ * nyx_trace.c - agent-side coverage tracing and stability calibration
+ *
+ * Implements the SanitizerCoverage trace-pc-guard callbacks on a shared
+ * coverage bitmap, which is registered as agent trace buffer for hosts
+ * that read coverage from the agent instead of tracing with PT.
+ *
+ * Calibration runs the same input several times and compares the bitmaps.
+ * Indices whose hit-count class differs between runs are accumulated into
+ * an ignore mask, which is pushed to the host so it can stop treating
+ * noise edges as new coverage. Build targets with
+ * -fsanitize-coverage=trace-pc-guard.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <nyx_api.h>
+
+#include "nyx_agent.h"
+
+#define TRACE_MAX_MODULES 16
+
+uint8_t *trace_bitmap = NULL;
+uint32_t trace_bitmap_size = 0;
+
+/* guard sections registered before the bitmap size is known */
+static struct {
+	uint32_t *start;
+	uint32_t *stop;
+} trace_modules[TRACE_MAX_MODULES];
+static int trace_num_modules;
+static uint32_t trace_num_guards;
+
+static trace_mask_hdr_t *trace_mask;
+static size_t trace_mask_pages;
+static uint8_t *trace_ref;
+static unsigned trace_run;
+
+/* AFL hit-count classes, differences within a class are not new coverage */
+static const uint8_t trace_class[256] = {
+	[0] = 0,
+	[1] = 1,
+	[2] = 2,
+	[3] = 4,
+	[4 ... 7] = 8,
+	[8 ... 15] = 16,
+	[16 ... 31] = 32,
+	[32 ... 127] = 64,
+	[128 ... 255] = 128,
+};
+
+static inline uint32_t trace_guard_index(uint32_t seq)
+{
+	/* index 0 is never hit, guards with value 0 are disabled */
+	return seq % (trace_bitmap_size - 1) + 1;
+}
+
+/**
+ * Allocate shared coverage bitmap and register it in agent_config
+ *
+ * Call before HYPERCALL_KAFL_SET_AGENT_CONFIG. Requires a target built with
+ * -fsanitize-coverage=trace-pc-guard.
+ */
+int trace_setup(host_config_t *host_config, agent_config_t *agent_config)
+{
+	size_t num_pages;
+
+	if (host_config->bitmap_size < 2) {
+		return -ENOTSUP;
+	}
+	if (trace_num_guards == 0) {
+		return -ENOENT;
+	}
+
+	num_pages = (host_config->bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	trace_bitmap = malloc_shared_pages(num_pages);
+	if (!trace_bitmap) {
+		return -ENOMEM;
+	}
+	memset(trace_bitmap, 0, num_pages * PAGE_SIZE);
+	trace_bitmap_size = host_config->bitmap_size;
+
+	/* map guard sequence numbers into the bitmap */
+	for (int i = 0; i < trace_num_modules; i++) {
+		for (uint32_t *guard = trace_modules[i].start; guard < trace_modules[i].stop; guard++) {
+			if (*guard) {
+				*guard = trace_guard_index(*guard - 1);
+			}
+		}
+	}
+
+	agent_config->agent_tracing = 1;
+	agent_config->trace_buffer_vaddr = (uintptr_t)trace_bitmap;
+	agent_config->coverage_bitmap_size = trace_bitmap_size;
+	return 0;
+}
+
+/**
+ * Clear coverage bitmap
+ */
+void trace_reset(void)
+{
+	if (trace_bitmap) {
+		memset(trace_bitmap, 0, trace_bitmap_size);
+	}
+}
+
+/*
+ * SanitizerCoverage -fsanitize-coverage=trace-pc-guard callbacks
+ */
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop)
+{
+	/* called once per module, but may be repeated */
+	if (start == stop || *start) {
+		return;
+	}
+
+	if (!trace_bitmap) {
+		if (trace_num_modules >= TRACE_MAX_MODULES) {
+			/* leave disabled */
+			return;
+		}
+		trace_modules[trace_num_modules].start = start;
+		trace_modules[trace_num_modules].stop = stop;
+		trace_num_modules++;
+	}
+
+	for (uint32_t *guard = start; guard < stop; guard++) {
+		*guard = trace_bitmap ? trace_guard_index(trace_num_guards) : trace_num_guards + 1;
+		trace_num_guards++;
+	}
+}
+
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard)
+{
+	uint8_t *bitmap = trace_bitmap;
+
+	if (bitmap && *guard) {
+		bitmap[*guard]++;
+	}
+}
+
+/*
+ * Bitmap comparison. Mark indices whose hit-count class differs between
+ * ref and cur in var, returning the number of newly marked indices. Equal
+ * chunks are skipped with vector compares, differing ones are classified
+ * byte by byte.
+ */
+static size_t trace_diff_bytes(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len)
+{
+	size_t marked = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (trace_class[ref[i]] != trace_class[cur[i]] && !var[i]) {
+			var[i] = 1;
+			marked++;
+		}
+	}
+	return marked;
+}
+
+static size_t trace_diff_scalar(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len)
+{
+	size_t marked = 0;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t a, b;
+
+		memcpy(&a, ref + i, sizeof(a));
+		memcpy(&b, cur + i, sizeof(b));
+		if (a != b) {
+			marked += trace_diff_bytes(ref + i, cur + i, var + i, sizeof(uint64_t));
+		}
+	}
+	return marked + trace_diff_bytes(ref + i, cur + i, var + i, len - i);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t trace_diff_sse2(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len)
+{
+	size_t marked = 0;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(ref + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(cur + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+			marked += trace_diff_bytes(ref + i, cur + i, var + i, 16);
+		}
+	}
+	return marked + trace_diff_bytes(ref + i, cur + i, var + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t trace_diff_avx2(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len)
+{
+	size_t marked = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(ref + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(cur + i));
+
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != 0xffffffff) {
+			marked += trace_diff_bytes(ref + i, cur + i, var + i, 32);
+		}
+	}
+	return marked + trace_diff_bytes(ref + i, cur + i, var + i, len - i);
+}
+#endif
+
+size_t trace_diff(const uint8_t *ref, const uint8_t *cur, uint8_t *var, size_t len)
+{
+	static size_t (*diff)(const uint8_t *, const uint8_t *, uint8_t *, size_t);
+
+	if (!diff) {
+		diff = trace_diff_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			diff = trace_diff_avx2;
+		} else if (__builtin_cpu_supports("sse2")) {
+			diff = trace_diff_sse2;
+		}
+#endif
+	}
+	return diff(ref, cur, var, len);
+}
+
+/**
+ * Allocate calibration state. Call after trace_setup().
+ *
+ * The ignore mask is persisted, so that it accumulates across execs.
+ */
+int trace_calibrate_init(void)
+{
+	if (!trace_bitmap) {
+		return -EINVAL;
+	}
+
+	trace_mask_pages = (sizeof(trace_mask_hdr_t) + trace_bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	trace_mask = malloc_shared_pages(trace_mask_pages);
+	if (!trace_mask) {
+		return -ENOMEM;
+	}
+	memset(trace_mask, 0, trace_mask_pages * PAGE_SIZE);
+	persist_pages(trace_mask, trace_mask_pages);
+
+	trace_mask->magic = TRACE_MASK_MAGIC;
+	trace_mask->size = trace_bitmap_size;
+
+	trace_ref = malloc(trace_bitmap_size);
+	if (!trace_ref) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Number of inputs calibrated so far
+ */
+uint64_t trace_calibrate_inputs(void)
+{
+	return trace_mask ? trace_mask->inputs : 0;
+}
+
+/**
+ * Start calibration of a new input
+ */
+void trace_calibrate_begin(void)
+{
+	if (!trace_mask) {
+		return;
+	}
+
+	trace_mask->inputs++;
+	trace_run = 0;
+	trace_reset();
+}
+
+/**
+ * Compare coverage of a run against the first run of this input, then
+ * clear the bitmap for the next run
+ */
+void trace_calibrate_run(void)
+{
+	size_t marked;
+
+	if (!trace_mask) {
+		return;
+	}
+
+	if (trace_run++ == 0) {
+		memcpy(trace_ref, trace_bitmap, trace_bitmap_size);
+	} else {
+		marked = trace_diff(trace_ref, trace_bitmap, trace_mask->mask, trace_bitmap_size);
+		if (marked) {
+			trace_mask->unstable += marked;
+			trace_mask->dirty = 1;
+		}
+	}
+	trace_reset();
+}
+
+/**
+ * Push ignore mask to host if new unstable indices were found
+ */
+int trace_calibrate_flush(char *dst_name)
+{
+	kafl_dump_file_t put_req __attribute__((aligned(PAGE_SIZE)));
+
+	if (!trace_mask) {
+		return -EINVAL;
+	}
+	if (!trace_mask->dirty) {
+		return 0;
+	}
+	trace_mask->dirty = 0;
+
+	hprintf("[trace] %u of %u bitmap indices unstable after %lu inputs\n",
+	        trace_mask->unstable, trace_mask->size, trace_mask->inputs);
+
+	put_req.file_name_str_ptr = (uintptr_t)dst_name;
+	put_req.append = 0;
+	put_req.data_ptr = (uintptr_t)trace_mask;
+	put_req.bytes = sizeof(trace_mask_hdr_t) + trace_mask->size;
+
+	hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&put_req);
+	return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash -e
+
+#
+# Copyright (C)  2022  Intel Corporation.
+#
+# SPDX-License-Identifier: MIT
+
+# Helper script for generating the manifest used by 'vmcall hget -r' and
+# 'vmcall hmount'
+#
+# Lists all files below DIR as "<sha256> <size> <mode> <path>", with paths
+# relative to DIR, and writes the result to DIR/manifest.sha256.
+
+set -e
+set -u
+
+MANIFEST=manifest.sha256
+
+fatal() {
+	echo -e "\nError: $@\n" >&2
+	echo -e "Usage:\n\t$(basename $0) <path/to/sharedir/dir>\n" >&2
+	exit 1
+}
+
+test $# -eq 1 || fatal "Missing argument: directory"
+test -d "$1" || fatal "Not a directory: $1"
+
+cd "$1"
+find . -type f ! -name "$MANIFEST" ! -name "$MANIFEST.tmp" -printf '%P\0' | sort -z |
+	while IFS= read -r -d '' file; do
+		hash=$(sha256sum "$file" | cut -d ' ' -f 1)
+		printf "%s %s %s %s\n" "$hash" "$(stat -c %s "$file")" "$(stat -c %a "$file")" "$file"
+	done > "$MANIFEST.tmp"
+mv "$MANIFEST.tmp" "$MANIFEST"
+
+echo "[*] Wrote $(wc -l < "$MANIFEST") entries to $1/$MANIFEST"
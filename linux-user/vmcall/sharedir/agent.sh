@@ -1,13 +1,16 @@
 #!/bin/sh
 
-echo "Hello from agent.sh" |vmcall hcat
+# batch all hypercall commands in a single vmcall process
+vmcall run - <<EOF
+echo "Hello from agent.sh" | hcat
 
-echo "Checking host config.." |vmcall hcat
-vmcall check|vmcall hcat
+echo "Checking host config.." | hcat
+check
 
-echo "CPU Info:" |vmcall hcat /proc/cpuinfo
+echo "CPU Info:" | hcat /proc/cpuinfo
 
-vmcall hpush /proc/cpuinfo
-vmcall hpush -o "vmcall.map" /proc/self/maps
+hpush /proc/cpuinfo
+hpush -o "vmcall.map" /proc/self/maps
+EOF
 
 # return to loader.sh, which will upload agent.log
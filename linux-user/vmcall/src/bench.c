@@ -0,0 +1,276 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * bench.c - guest/host transport microbenchmark
+ *
+ * Measures bandwidth of REQ_STREAM_DATA_BULK (sharedir reads) over 1-479
+ * pages per request and of DUMP_FILE over a range of buffer sizes, as well
+ * as round-trip latency of PRINTF, GET_HOST_CONFIG and optionally the
+ * ACQUIRE/RELEASE pair. Results are reported as JSON and pushed to the host.
+ *
+ * Hypercalls are issued directly so the numbers reflect the transport only.
+ * Run this before the snapshot is taken; once fuzzing has started most of
+ * these hypercalls are rejected by the host.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <nyx_api.h>
+#include <nyx_agent.h>
+
+#include "vmcall.h"
+
+#define BENCH_DUMP_NAME "vmcall_bench.tmp"
+#define BENCH_DUMP_MAX (4 * 1024 * 1024)
+#define BENCH_DUMP_TOTAL (256UL * 1024 * 1024) /* cap per buffer size */
+
+static const unsigned bench_pages[] = { 1, 8, 32, 128, 256, 479 };
+static const size_t bench_dump_sizes[] = { 4096, 65536, 262144, 1048576, BENCH_DUMP_MAX };
+
+typedef struct {
+	struct timespec ts;
+	uint64_t tsc;
+} bench_clock_t;
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static void bench_start(bench_clock_t *c)
+{
+	clock_gettime(CLOCK_MONOTONIC, &c->ts);
+	c->tsc = rdtsc();
+}
+
+/* add time and cycles since bench_start() */
+static void bench_stop(const bench_clock_t *c, double *secs, uint64_t *cycles)
+{
+	struct timespec now;
+
+	*cycles += rdtsc() - c->tsc;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*secs += (now.tv_sec - c->ts.tv_sec) + (now.tv_nsec - c->ts.tv_nsec) / 1e9;
+}
+
+/**
+ * Append one JSON result record for ops operations moving bytes in total,
+ * and short_ops operations which were left out of the measurement
+ */
+static void bench_record(FILE *json, bool *first, const char *op, const char *param,
+                         uint64_t value, uint64_t ops, uint64_t short_ops, uint64_t bytes,
+                         double secs, uint64_t cycles)
+{
+	fprintf(json, "%s\n    { \"op\": \"%s\", \"%s\": %lu, \"ops\": %lu, \"short_ops\": %lu, "
+	              "\"bytes\": %lu, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"cycles_per_op\": %lu }",
+	        *first ? "" : ",", op, param, value, ops, short_ops, bytes, secs,
+	        secs > 0 ? bytes / secs / 1e6 : 0.0, ops ? cycles / ops : 0);
+	*first = false;
+
+	fprintf(stderr, "[bench] %-20s %s=%-8lu %8lu ops %10.2f MB/s %10lu cycles/op",
+	        op, param, value, ops, secs > 0 ? bytes / secs / 1e6 : 0.0, ops ? cycles / ops : 0);
+	if (short_ops)
+		fprintf(stderr, " (%lu short ops not counted)", short_ops);
+	fputc('\n', stderr);
+}
+
+/**
+ * Append one JSON result record for ops operations timed from bench_start()
+ */
+static void bench_report(FILE *json, bool *first, const bench_clock_t *c, const char *op,
+                         const char *param, uint64_t value, uint64_t ops, uint64_t bytes)
+{
+	uint64_t cycles = 0;
+	double secs = 0;
+
+	bench_stop(c, &secs, &cycles);
+	bench_record(json, first, op, param, value, ops, 0, bytes, secs, cycles);
+}
+
+static int bench_stream_bulk(FILE *json, bool *first, const char *src_file, unsigned iters)
+{
+	static req_data_bulk_t req __attribute__((aligned(PAGE_SIZE)));
+	uint8_t *buf;
+	bench_clock_t clock;
+
+	buf = malloc_resident_pages(ARRAY_SIZE(req.addresses));
+	if (!buf)
+		return -ENOMEM;
+
+	strncpy(req.file_name, src_file, sizeof(req.file_name) - 1);
+	for (int i = 0; i < ARRAY_SIZE(req.addresses); i++) {
+		req.addresses[i] = (uintptr_t)buf + i * PAGE_SIZE;
+	}
+
+	/*
+	 * Reads at the end of src_file come back short and restart the stream.
+	 * Only full-size reads are timed, short ones are counted separately.
+	 */
+	for (int i = 0; i < ARRAY_SIZE(bench_pages); i++) {
+		uint64_t full = (uint64_t)bench_pages[i] * PAGE_SIZE;
+		uint64_t ops = 0, short_ops = 0, cycles = 0;
+		double secs = 0;
+
+		req.num_addresses = bench_pages[i];
+		for (unsigned n = 0; n < iters; n++) {
+			unsigned long ret;
+
+			bench_start(&clock);
+			ret = kAFL_hypercall(HYPERCALL_KAFL_REQ_STREAM_DATA_BULK, (uintptr_t)&req);
+			if (ret == 0xFFFFFFFFFFFFFFFFUL) {
+				fprintf(stderr, "[bench] Could not get %s from sharedir, skipping.\n", src_file);
+				free_resident_pages(buf, ARRAY_SIZE(req.addresses));
+				return 0;
+			}
+			if (ret != full) {
+				short_ops++;
+				continue;
+			}
+			bench_stop(&clock, &secs, &cycles);
+			ops++;
+		}
+		bench_record(json, first, "req_stream_data_bulk", "pages", bench_pages[i],
+		             ops, short_ops, ops * full, secs, cycles);
+	}
+
+	free_resident_pages(buf, ARRAY_SIZE(req.addresses));
+	return 0;
+}
+
+static int bench_dump_file(FILE *json, bool *first, unsigned iters)
+{
+	static kafl_dump_file_t req __attribute__((aligned(PAGE_SIZE)));
+	bench_clock_t clock;
+	uint8_t *buf;
+
+	buf = malloc_resident_pages(BENCH_DUMP_MAX / PAGE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0xa5, BENCH_DUMP_MAX);
+
+	req.file_name_str_ptr = (uintptr_t)BENCH_DUMP_NAME;
+	req.data_ptr = (uintptr_t)buf;
+
+	for (int i = 0; i < ARRAY_SIZE(bench_dump_sizes); i++) {
+		uint64_t ops = iters;
+
+		if (ops * bench_dump_sizes[i] > BENCH_DUMP_TOTAL)
+			ops = BENCH_DUMP_TOTAL / bench_dump_sizes[i];
+
+		req.bytes = bench_dump_sizes[i];
+		req.append = 0;
+		bench_start(&clock);
+		for (uint64_t n = 0; n < ops; n++) {
+			kAFL_hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&req);
+			req.append = 1;
+		}
+		bench_report(json, first, &clock, "dump_file", "bytes_per_op",
+		             bench_dump_sizes[i], ops, ops * bench_dump_sizes[i]);
+	}
+
+	// leave an empty file on the host
+	req.bytes = 0;
+	req.append = 0;
+	kAFL_hypercall(HYPERCALL_KAFL_DUMP_FILE, (uintptr_t)&req);
+
+	free_resident_pages(buf, BENCH_DUMP_MAX / PAGE_SIZE);
+	return 0;
+}
+
+static void bench_latency(FILE *json, bool *first, unsigned iters, bool acquire_release)
+{
+	static char msg[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	static host_config_t host_config __attribute__((aligned(PAGE_SIZE)));
+	bench_clock_t clock;
+
+	bench_start(&clock);
+	for (unsigned n = 0; n < iters; n++) {
+		kAFL_hypercall(HYPERCALL_KAFL_PRINTF, (uintptr_t)msg);
+	}
+	bench_report(json, first, &clock, "printf", "bytes_per_op", 0, iters, 0);
+
+	bench_start(&clock);
+	for (unsigned n = 0; n < iters; n++) {
+		kAFL_hypercall(HYPERCALL_KAFL_GET_HOST_CONFIG, (uintptr_t)&host_config);
+	}
+	bench_report(json, first, &clock, "get_host_config", "bytes_per_op",
+	             sizeof(host_config), iters, iters * sizeof(host_config));
+
+	if (!acquire_release)
+		return;
+
+	bench_start(&clock);
+	for (unsigned n = 0; n < iters; n++) {
+		kAFL_hypercall(HYPERCALL_KAFL_ACQUIRE, 0);
+		kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
+	}
+	bench_report(json, first, &clock, "acquire_release", "bytes_per_op", 0, iters, 0);
+}
+
+/**
+ * Run all benchmarks and push the JSON report to host file dst_name
+ *
+ * src_file is read from the sharedir for the REQ_STREAM_DATA_BULK test and
+ * should be at least 479 pages large. ACQUIRE/RELEASE is only measured on
+ * request: after the initial handshake, each RELEASE waits for the fuzzer.
+ */
+int bench_run(const char *src_file, const char *dst_name, unsigned iters, bool acquire_release)
+{
+	hpush_stream_t *stream;
+	char *report = NULL;
+	size_t report_len = 0;
+	bool first = true;
+	FILE *json;
+	int ret;
+
+	json = open_memstream(&report, &report_len);
+	if (!json)
+		return -errno;
+
+	fprintf(json, "{\n  \"nyx_cpu\": %d,\n  \"iterations\": %u,\n  \"page_size\": %d,\n"
+	              "  \"results\": [", nyx_cpu_type, iters, PAGE_SIZE);
+
+	ret = bench_stream_bulk(json, &first, src_file, iters);
+	if (ret == 0)
+		ret = bench_dump_file(json, &first, iters);
+	if (ret == 0)
+		bench_latency(json, &first, iters, acquire_release);
+
+	fprintf(json, "\n  ]\n}\n");
+	fclose(json);
+
+	if (ret != 0) {
+		fprintf(stderr, "[bench] Failed: %s\n", strerror(-ret));
+		free(report);
+		return ret;
+	}
+
+	fputs(report, stdout);
+
+	stream = hpush_open(dst_name, 0, HPUSH_RAW, report_len);
+	if (!stream) {
+		ret = -errno;
+	} else {
+		hpush_write(stream, report, report_len);
+		ret = hpush_close(stream);
+	}
+	free(report);
+	return ret;
+}
@@ -0,0 +1,535 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * hget_dir.c - recursive sharedir fetch driven by a manifest
+ *
+ * The manifest lists one file per line as "<sha256> <size> <mode> <path>",
+ * relative to the fetched directory (see scripts/gen_manifest.sh). Local
+ * files that already match are skipped. A cache of hash, size and mtime of
+ * previously synced files avoids re-hashing them on every boot when the
+ * guest disk persists.
+ *
+ * Transfers use two locked scratch buffers: the main thread fetches the
+ * next chunk via hypercall while a writer thread writes and hashes the
+ * previous one.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <nyx_api.h>
+#include <nyx_agent.h>
+
+#include "sha256.h"
+#include "vmcall.h"
+
+#define HGET_CHUNK_PAGES 256 // 1MB at a time
+#define HGET_CHUNK_SIZE (HGET_CHUNK_PAGES * PAGE_SIZE)
+#define HGET_CACHE ".hget_cache"
+
+typedef struct {
+	char hash[SHA256_HEX_SIZE];
+	uint64_t size;
+	mode_t mode;
+	long mtime;
+	char *path;
+} hget_entry_t;
+
+typedef struct {
+	hget_entry_t *entry; /* NULL for unverified fetches */
+	char tmp_path[PATH_MAX];
+	int fd;
+	int error;
+	uint64_t written;
+	sha256_ctx_t ctx;
+	bool done;
+} hget_job_t;
+
+typedef struct {
+	req_data_bulk_t req;
+	uint8_t *buf;
+	size_t len;
+	hget_job_t *job;
+	int error; /* fetch error, merged into job by the writer */
+	bool last;
+	bool full;
+} hget_slot_t;
+
+static struct {
+	hget_slot_t slot[2];
+	unsigned head; /* next slot to fetch into */
+	unsigned tail; /* next slot to write out */
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t writer;
+} hget_pipe = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void hget_job_finish(hget_job_t *job)
+{
+	char hash[SHA256_HEX_SIZE];
+	hget_entry_t *entry = job->entry;
+
+	job->done = true;
+	if (!entry) {
+		return;
+	}
+
+	if (!job->error) {
+		sha256_final(&job->ctx, hash);
+		if (job->written != entry->size || strcmp(hash, entry->hash) != 0) {
+			fprintf(stderr, "[hget]  Checksum mismatch for %s\n", entry->path);
+			job->error = -EIO;
+		}
+	}
+	if (!job->error && fchmod(job->fd, entry->mode) != 0) {
+		job->error = -errno;
+	}
+	close(job->fd);
+
+	if (!job->error && rename(job->tmp_path, entry->path) != 0) {
+		job->error = -errno;
+	}
+	if (job->error) {
+		unlink(job->tmp_path);
+	}
+}
+
+static void *hget_writer(void *arg)
+{
+	while (1) {
+		hget_slot_t *slot;
+
+		pthread_mutex_lock(&hget_pipe.lock);
+		slot = &hget_pipe.slot[hget_pipe.tail];
+		while (!slot->full && !hget_pipe.stop) {
+			pthread_cond_wait(&hget_pipe.cond, &hget_pipe.lock);
+		}
+		pthread_mutex_unlock(&hget_pipe.lock);
+		if (!slot->full) {
+			break;
+		}
+
+		/* job state is only touched by the writer while queued */
+		hget_job_t *job = slot->job;
+		if (!job->error) {
+			job->error = slot->error;
+		}
+		if (!job->error && slot->len) {
+			job->error = write_all(job->fd, slot->buf, slot->len);
+			sha256_update(&job->ctx, slot->buf, slot->len);
+			job->written += slot->len;
+		}
+		if (slot->last) {
+			hget_job_finish(job);
+		}
+
+		pthread_mutex_lock(&hget_pipe.lock);
+		slot->full = false;
+		hget_pipe.tail ^= 1;
+		pthread_cond_broadcast(&hget_pipe.cond);
+		pthread_mutex_unlock(&hget_pipe.lock);
+	}
+	return NULL;
+}
+
+static void hget_pipe_free(void)
+{
+	for (int i = 0; i < 2; i++) {
+		if (hget_pipe.slot[i].buf) {
+			free_resident_pages(hget_pipe.slot[i].buf, HGET_CHUNK_PAGES);
+			hget_pipe.slot[i].buf = NULL;
+		}
+	}
+}
+
+static int hget_pipe_init(void)
+{
+	int ret;
+
+	/* state of a previous transfer, the writer has been joined */
+	hget_pipe.head = 0;
+	hget_pipe.tail = 0;
+	hget_pipe.stop = false;
+
+	for (int i = 0; i < 2; i++) {
+		hget_slot_t *slot = &hget_pipe.slot[i];
+
+		slot->len = 0;
+		slot->job = NULL;
+		slot->error = 0;
+		slot->last = false;
+		slot->full = false;
+		slot->buf = malloc_resident_pages(HGET_CHUNK_PAGES);
+		if (!slot->buf) {
+			hget_pipe_free();
+			return -ENOMEM;
+		}
+		for (int j = 0; j < HGET_CHUNK_PAGES; j++) {
+			slot->req.addresses[j] = (uintptr_t)(slot->buf + j * PAGE_SIZE);
+		}
+		slot->req.num_addresses = HGET_CHUNK_PAGES;
+	}
+
+	ret = pthread_create(&hget_pipe.writer, NULL, hget_writer, NULL);
+	if (ret != 0) {
+		hget_pipe_free();
+		return -ret;
+	}
+	return 0;
+}
+
+static void hget_pipe_exit(void)
+{
+	pthread_mutex_lock(&hget_pipe.lock);
+	hget_pipe.stop = true;
+	pthread_cond_broadcast(&hget_pipe.cond);
+	pthread_mutex_unlock(&hget_pipe.lock);
+	pthread_join(hget_pipe.writer, NULL);
+
+	hget_pipe_free();
+}
+
+/* wait until the writer has finished all queued chunks */
+static void hget_pipe_drain(void)
+{
+	pthread_mutex_lock(&hget_pipe.lock);
+	while (hget_pipe.slot[0].full || hget_pipe.slot[1].full) {
+		pthread_cond_wait(&hget_pipe.cond, &hget_pipe.lock);
+	}
+	pthread_mutex_unlock(&hget_pipe.lock);
+}
+
+/* stream src_path from sharedir to the writer thread */
+static void hget_pipe_fetch(const char *src_path, hget_job_t *job)
+{
+	bool last = false;
+
+	sha256_init(&job->ctx);
+
+	while (!last) {
+		hget_slot_t *slot = &hget_pipe.slot[hget_pipe.head];
+		unsigned long len;
+		int error = 0;
+
+		pthread_mutex_lock(&hget_pipe.lock);
+		while (slot->full) {
+			pthread_cond_wait(&hget_pipe.cond, &hget_pipe.lock);
+		}
+		pthread_mutex_unlock(&hget_pipe.lock);
+
+		strcpy(slot->req.file_name, src_path);
+		len = hypercall(HYPERCALL_KAFL_REQ_STREAM_DATA_BULK, (uintptr_t)&slot->req);
+		if (len == 0xFFFFFFFFFFFFFFFFUL) {
+			fprintf(stderr, "[hget]  Could not get %s from sharedir. Check Qemu logs.\n",
+			        src_path);
+			error = -EIO;
+			len = 0;
+		}
+		last = len < HGET_CHUNK_SIZE;
+
+		pthread_mutex_lock(&hget_pipe.lock);
+		slot->len = len;
+		slot->job = job;
+		slot->error = error;
+		slot->last = last;
+		slot->full = true;
+		hget_pipe.head ^= 1;
+		pthread_cond_broadcast(&hget_pipe.cond);
+		pthread_mutex_unlock(&hget_pipe.lock);
+	}
+}
+
+/* create parent directories of a relative path */
+static int mkdir_parents(const char *path)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = strchr(dir, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+			return -errno;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+static bool path_is_safe(const char *path)
+{
+	if (path[0] == '/' || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0) {
+		return false;
+	}
+	return !strstr(path, "/../") && !(strlen(path) >= 3 && !strcmp(path + strlen(path) - 3, "/.."));
+}
+
+/* parse "<sha256> <size> <mode> <path>" lines, optionally followed by mtime */
+static int hget_parse(FILE *f, hget_entry_t **result, size_t *num, bool with_mtime)
+{
+	hget_entry_t *entries = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t max = 0;
+	ssize_t len;
+
+	*num = 0;
+	while ((len = getline(&line, &line_size, f)) > 0) {
+		hget_entry_t entry = { 0 };
+		unsigned mode;
+		int offset = 0;
+
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (with_mtime) {
+			if (sscanf(line, "%64s %lu %o %ld %n", entry.hash, &entry.size, &mode,
+			           &entry.mtime, &offset) != 4)
+				continue;
+		} else {
+			if (sscanf(line, "%64s %lu %o %n", entry.hash, &entry.size, &mode, &offset) != 3)
+				continue;
+		}
+		if (!offset || !line[offset] || strlen(line + offset) >= sizeof(((req_data_bulk_t *)0)->file_name) - 1)
+			continue;
+
+		entry.mode = mode & 07777;
+		entry.path = strdup(line + offset);
+
+		if (*num == max) {
+			hget_entry_t *tmp;
+
+			max = max ? 2 * max : 64;
+			tmp = realloc(entries, max * sizeof(*entries));
+			if (!tmp) {
+				free(entry.path);
+				for (size_t i = 0; i < *num; i++) {
+					free(entries[i].path);
+				}
+				free(entries);
+				free(line);
+				*num = 0;
+				return -ENOMEM;
+			}
+			entries = tmp;
+		}
+		entries[(*num)++] = entry;
+	}
+	free(line);
+	*result = entries;
+	return 0;
+}
+
+static int hget_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const hget_entry_t *)a)->path, ((const hget_entry_t *)b)->path);
+}
+
+/* check if the local copy matches, consulting the cache before hashing */
+static bool hget_is_current(hget_entry_t *entry, hget_entry_t *cache, size_t num_cache)
+{
+	char hash[SHA256_HEX_SIZE];
+	hget_entry_t *cached;
+	struct stat st;
+
+	if (stat(entry->path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != entry->size) {
+		return false;
+	}
+
+	cached = bsearch(entry, cache, num_cache, sizeof(*cache), hget_entry_cmp);
+	if (!cached || cached->mtime != st.st_mtime || cached->size != entry->size ||
+	    strcmp(cached->hash, entry->hash) != 0) {
+		if (sha256_file(entry->path, hash) != 0 || strcmp(hash, entry->hash) != 0) {
+			return false;
+		}
+	}
+
+	if ((st.st_mode & 07777) != entry->mode) {
+		chmod(entry->path, entry->mode);
+	}
+	entry->mtime = st.st_mtime;
+	return true;
+}
+
+static void hget_write_cache(hget_entry_t *entries, size_t num)
+{
+	FILE *f = fopen(HGET_CACHE ".tmp", "w");
+
+	if (!f) {
+		return;
+	}
+	for (size_t i = 0; i < num; i++) {
+		if (entries[i].mtime) {
+			fprintf(f, "%s %lu %o %ld %s\n", entries[i].hash, entries[i].size,
+			        entries[i].mode, entries[i].mtime, entries[i].path);
+		}
+	}
+	if (fclose(f) == 0) {
+		rename(HGET_CACHE ".tmp", HGET_CACHE);
+	}
+}
+
+/**
+ * Fetch directory src_dir from sharedir into the current directory, using
+ * the list of files in src_dir/manifest
+ */
+int hget_dir(const char *src_dir, const char *manifest)
+{
+	char src_path[sizeof(((req_data_bulk_t *)0)->file_name)];
+	hget_entry_t *entries = NULL;
+	hget_entry_t *cache = NULL;
+	size_t num_entries = 0, num_cache = 0;
+	size_t fetched = 0, skipped = 0, failed = 0;
+	hget_job_t *jobs = NULL;
+	hget_job_t manifest_job = { 0 };
+	FILE *f;
+	int ret;
+
+	ret = hget_pipe_init();
+	if (ret != 0) {
+		fprintf(stderr, "[hget]  Failed to set up transfer buffers: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	/* manifest is read once, into an unlinked temporary file */
+	snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, manifest);
+	f = tmpfile();
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+	manifest_job.fd = fileno(f);
+	hget_pipe_fetch(src_path, &manifest_job);
+	hget_pipe_drain();
+	if (manifest_job.error || manifest_job.written == 0) {
+		fprintf(stderr, "[hget]  Failed to fetch manifest %s\n", src_path);
+		fclose(f);
+		ret = -EIO;
+		goto out;
+	}
+	rewind(f);
+	ret = hget_parse(f, &entries, &num_entries, false);
+	fclose(f);
+	if (ret != 0) {
+		goto out;
+	}
+	/* nothing to sync, -EINVAL would be taken for a usage error */
+	if (num_entries == 0) {
+		fprintf(stderr, "[hget]  No entries in manifest %s\n", src_path);
+	}
+
+	f = fopen(HGET_CACHE, "r");
+	if (f) {
+		if (hget_parse(f, &cache, &num_cache, true) == 0) {
+			qsort(cache, num_cache, sizeof(*cache), hget_entry_cmp);
+		}
+		fclose(f);
+	}
+
+	jobs = calloc(num_entries, sizeof(*jobs));
+	if (!jobs && num_entries) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i < num_entries; i++) {
+		hget_entry_t *entry = &entries[i];
+		hget_job_t *job = &jobs[i];
+
+		if (!path_is_safe(entry->path)) {
+			fprintf(stderr, "[hget]  Skipping unsafe path %s\n", entry->path);
+			failed++;
+			continue;
+		}
+		if (hget_is_current(entry, cache, num_cache)) {
+			debug_printf("[hget]  %s is up to date\n", entry->path);
+			skipped++;
+			continue;
+		}
+
+		job->entry = entry;
+		snprintf(job->tmp_path, sizeof(job->tmp_path), "%s.hget", entry->path);
+		if (mkdir_parents(entry->path) != 0 ||
+		    (job->fd = open(job->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+			fprintf(stderr, "[hget]  Error opening file %s: %s\n", job->tmp_path, strerror(errno));
+			job->entry = NULL;
+			failed++;
+			continue;
+		}
+
+		snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, entry->path);
+		hget_pipe_fetch(src_path, job);
+	}
+	hget_pipe_drain();
+
+	for (size_t i = 0; i < num_entries; i++) {
+		struct stat st;
+
+		if (!jobs[i].entry) {
+			continue;
+		}
+		if (jobs[i].error) {
+			fprintf(stderr, "[hget]  Failed to fetch %s: %s\n", entries[i].path,
+			        strerror(-jobs[i].error));
+			failed++;
+		} else if (stat(entries[i].path, &st) == 0) {
+			entries[i].mtime = st.st_mtime;
+			fetched++;
+		}
+	}
+	hget_write_cache(entries, num_entries);
+
+	fprintf(stderr, "[hget]  Synced %s: %zu fetched, %zu up to date, %zu failed\n",
+	        src_dir, fetched, skipped, failed);
+	ret = failed ? -EIO : 0;
+
+out:
+	hget_pipe_exit();
+	for (size_t i = 0; i < num_entries; i++) {
+		free(entries[i].path);
+	}
+	for (size_t i = 0; i < num_cache; i++) {
+		free(cache[i].path);
+	}
+	free(entries);
+	free(cache);
+	free(jobs);
+	return ret;
+}
@@ -0,0 +1,642 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * hmount.c - lazy read-only sharedir mount via FUSE
+ *
+ * The directory tree and file sizes are taken from the same manifest as
+ * used by 'hget -r' (see scripts/gen_manifest.sh), so nothing but the
+ * manifest is transferred at mount time. File content is fetched from the
+ * sharedir on first read, straight into a page-granular cache that also
+ * serves all later reads.
+ *
+ * Sharedir files can only be streamed from the start, so a cache miss
+ * fetches all pages up to the requested one, plus some read-ahead. Files
+ * that are only partially read, or not at all, still save their tail.
+ * Cached data is never evicted.
+ *
+ * The FUSE protocol is spoken directly on /dev/fuse, so no libfuse or
+ * fusermount is needed in the guest. The kernel needs CONFIG_FUSE_FS.
+ *
+ * Sharedir requests are not expected to work after the snapshot, so any
+ * file used during fuzzing should be read once before that. Avoid hget of
+ * the same files while mounted, both would advance the same host stream.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/fuse.h>
+
+#include <nyx_api.h>
+#include <nyx_agent.h>
+
+#include "vmcall.h"
+
+#define FUSE_DEV "/dev/fuse"
+#define HMOUNT_BUF_SIZE (64 * 1024)
+#define HMOUNT_TIMEOUT 3600 /* attr/entry cache timeout, nothing ever changes */
+#define HMOUNT_MAX_PAGES 256 /* FUSE read size in pages, if kernel supports it */
+
+typedef struct hmount_node {
+	char *name;
+	char *path; /* sharedir path of files */
+	struct hmount_node *child;
+	struct hmount_node *next;
+	uint64_t ino;
+	mode_t mode;
+	uint64_t size;
+	uint8_t *data;   /* cache, reserved on first read */
+	uint64_t cached; /* size of the cached file prefix */
+	bool broken;
+} hmount_node_t;
+
+static struct {
+	int fd;
+	unsigned minor; /* FUSE protocol version of the kernel */
+	unsigned readahead; /* pages */
+	time_t mtime;
+	hmount_node_t **nodes; /* by inode number - 1 */
+	size_t num_nodes;
+	size_t cap_nodes;
+	uint64_t fetched;
+} hmount_fs = { .fd = -1 };
+
+static hmount_node_t *hmount_new_node(hmount_node_t *parent, const char *name, size_t len, mode_t mode)
+{
+	hmount_node_t *node;
+
+	if (hmount_fs.num_nodes == hmount_fs.cap_nodes) {
+		size_t cap = hmount_fs.cap_nodes ? 2 * hmount_fs.cap_nodes : 256;
+		hmount_node_t **tmp = realloc(hmount_fs.nodes, cap * sizeof(*tmp));
+		if (!tmp)
+			return NULL;
+		hmount_fs.nodes = tmp;
+		hmount_fs.cap_nodes = cap;
+	}
+
+	node = calloc(1, sizeof(*node));
+	if (!node || !(node->name = strndup(name, len))) {
+		free(node);
+		return NULL;
+	}
+	node->mode = mode;
+	node->ino = ++hmount_fs.num_nodes;
+	hmount_fs.nodes[node->ino - 1] = node;
+
+	if (parent) {
+		node->next = parent->child;
+		parent->child = node;
+	}
+	return node;
+}
+
+static hmount_node_t *hmount_node(uint64_t ino)
+{
+	if (ino == 0 || ino > hmount_fs.num_nodes)
+		return NULL;
+	return hmount_fs.nodes[ino - 1];
+}
+
+static hmount_node_t *hmount_child(hmount_node_t *dir, const char *name, size_t len)
+{
+	for (hmount_node_t *node = dir->child; node; node = node->next) {
+		if (strlen(node->name) == len && 0 == memcmp(node->name, name, len))
+			return node;
+	}
+	return NULL;
+}
+
+/**
+ * Add file at relative path, creating any missing parent directories
+ */
+static int hmount_add(const char *path, const char *src_path, mode_t mode, uint64_t size)
+{
+	hmount_node_t *dir = hmount_node(FUSE_ROOT_ID);
+	hmount_node_t *node;
+	const char *name = path;
+	const char *sep;
+
+	while ((sep = strchr(name, '/')) != NULL) {
+		if (sep > name) {
+			node = hmount_child(dir, name, sep - name);
+			if (!node)
+				node = hmount_new_node(dir, name, sep - name, S_IFDIR | 0555);
+			if (!node)
+				return -ENOMEM;
+			if (!S_ISDIR(node->mode))
+				return -ENOTDIR;
+			dir = node;
+		}
+		name = sep + 1;
+	}
+
+	if (!*name || hmount_child(dir, name, strlen(name)))
+		return -EEXIST;
+
+	node = hmount_new_node(dir, name, strlen(name), S_IFREG | (mode & 0555));
+	if (!node)
+		return -ENOMEM;
+	node->size = size;
+	node->path = strdup(src_path);
+	return node->path ? 0 : -ENOMEM;
+}
+
+/**
+ * Build tree from "<sha256> <size> <mode> <path>" manifest lines
+ */
+static int hmount_load(const char *src_dir, const char *manifest)
+{
+	char src_path[sizeof(((req_data_bulk_t *)0)->file_name)];
+	char line[PATH_MAX + 128];
+	char path[PATH_MAX];
+	unsigned long size;
+	unsigned mode;
+	int num = 0;
+	int ret = 0;
+	FILE *f;
+	int fd;
+
+	if (!hmount_new_node(NULL, "", 0, S_IFDIR | 0555))
+		return -ENOMEM;
+
+	snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, manifest);
+	fd = hget_memfd(src_path);
+	if (fd < 0) {
+		fprintf(stderr, "[hmount] Failed to fetch manifest %s\n", src_path);
+		return fd;
+	}
+	lseek(fd, 0, SEEK_SET);
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*64s %lu %o %4095[^\n]", &size, &mode, path) != 3) {
+			fprintf(stderr, "[hmount] Skipping malformed manifest line: %s", line);
+			continue;
+		}
+		if (snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, path) >= sizeof(src_path)) {
+			fprintf(stderr, "[hmount] Skipping %s/%s: path too long\n", src_dir, path);
+			continue;
+		}
+		ret = hmount_add(path, src_path, mode, size);
+		if (ret == -ENOMEM)
+			break;
+		if (ret != 0) {
+			fprintf(stderr, "[hmount] Skipping %s: %s\n", path, strerror(-ret));
+			ret = 0;
+			continue;
+		}
+		num++;
+	}
+	fclose(f);
+
+	fprintf(stderr, "[hmount] Loaded %d files from %s/%s\n", num, src_dir, manifest);
+	return ret;
+}
+
+/**
+ * Stream file from sharedir until at least end bytes are cached
+ *
+ * The host restarts a file stream after returning a short read, or an
+ * empty one if the file ends on a request boundary.
+ */
+static int hmount_fetch(hmount_node_t *node, uint64_t end)
+{
+	static req_data_bulk_t req __attribute__((aligned(PAGE_SIZE)));
+	static uint8_t drain[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	uint64_t want;
+	uint64_t ret;
+
+	if (end > node->size)
+		end = node->size;
+	if (end <= node->cached)
+		return 0;
+	if (node->broken)
+		return -EIO;
+
+	want = (end + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE + (uint64_t)hmount_fs.readahead * PAGE_SIZE;
+	if (want > node->size)
+		want = node->size;
+
+	if (!node->data) {
+		node->data = mmap(NULL, node->size, PROT_READ | PROT_WRITE,
+		                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (node->data == MAP_FAILED) {
+			node->data = NULL;
+			return -ENOMEM;
+		}
+	}
+	strcpy(req.file_name, node->path);
+
+	while (node->cached < want) {
+		uint8_t *dst = node->data + node->cached;
+		uint64_t pages = (want - node->cached + PAGE_SIZE - 1) / PAGE_SIZE;
+
+		if (pages > ARRAY_SIZE(req.addresses))
+			pages = ARRAY_SIZE(req.addresses);
+
+		// hypercall needs the destination pages present
+		if (mlock(dst, pages * PAGE_SIZE) != 0)
+			return -errno;
+		for (int i = 0; i < pages; i++) {
+			req.addresses[i] = (uintptr_t)dst + i * PAGE_SIZE;
+		}
+		req.num_addresses = pages;
+
+		ret = hypercall(HYPERCALL_KAFL_REQ_STREAM_DATA_BULK, (uintptr_t)&req);
+		if (ret == 0xFFFFFFFFFFFFFFFFUL)
+			goto err_broken;
+
+		node->cached += ret;
+		hmount_fs.fetched += ret;
+
+		if (ret < pages * PAGE_SIZE) {
+			if (node->cached != node->size)
+				goto err_broken;
+			break;
+		}
+		if (node->cached == node->size) {
+			req.addresses[0] = (uintptr_t)drain;
+			req.num_addresses = 1;
+			if (hypercall(HYPERCALL_KAFL_REQ_STREAM_DATA_BULK, (uintptr_t)&req) != 0)
+				goto err_broken;
+			break;
+		}
+	}
+	debug_printf("[hmount] %s: %lu / %lu bytes cached\n", node->path, node->cached, node->size);
+	return 0;
+
+err_broken:
+	hprintf("[hmount] Failed to fetch %s at offset %lu, check manifest\n", node->path, node->cached);
+	node->broken = true;
+	return -EIO;
+}
+
+static int hmount_reply(uint64_t unique, int error, const void *data, size_t len)
+{
+	struct fuse_out_header out = {
+		.len = sizeof(out) + (error ? 0 : len),
+		.error = error,
+		.unique = unique,
+	};
+	struct iovec iov[2] = {
+		{ &out, sizeof(out) },
+		{ (void *)data, len },
+	};
+
+	// ENOENT: request was interrupted meanwhile
+	if (writev(hmount_fs.fd, iov, (error || !len) ? 1 : 2) < 0 && errno != ENOENT)
+		return -errno;
+	return 0;
+}
+
+static void hmount_attr(const hmount_node_t *node, struct fuse_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = node->ino;
+	attr->size = node->size;
+	attr->blocks = (node->size + 511) / 512;
+	attr->atime = attr->mtime = attr->ctime = hmount_fs.mtime;
+	attr->mode = node->mode;
+	attr->nlink = S_ISDIR(node->mode) ? 2 : 1;
+	attr->blksize = PAGE_SIZE;
+}
+
+static int hmount_lookup(struct fuse_in_header *in, const char *name)
+{
+	hmount_node_t *dir = hmount_node(in->nodeid);
+	hmount_node_t *node;
+	struct fuse_entry_out out;
+
+	if (!dir || !S_ISDIR(dir->mode))
+		return hmount_reply(in->unique, -ENOTDIR, NULL, 0);
+
+	// nodeid 0 caches the negative lookup, e.g. for PATH searches
+	memset(&out, 0, sizeof(out));
+	node = hmount_child(dir, name, strlen(name));
+	if (node) {
+		out.nodeid = node->ino;
+		out.attr_valid = HMOUNT_TIMEOUT;
+		hmount_attr(node, &out.attr);
+	}
+	out.entry_valid = HMOUNT_TIMEOUT;
+	return hmount_reply(in->unique, 0, &out, sizeof(out));
+}
+
+static int hmount_getattr(struct fuse_in_header *in)
+{
+	hmount_node_t *node = hmount_node(in->nodeid);
+	struct fuse_attr_out out;
+
+	if (!node)
+		return hmount_reply(in->unique, -ENOENT, NULL, 0);
+
+	memset(&out, 0, sizeof(out));
+	out.attr_valid = HMOUNT_TIMEOUT;
+	hmount_attr(node, &out.attr);
+	return hmount_reply(in->unique, 0, &out, sizeof(out));
+}
+
+static int hmount_open(struct fuse_in_header *in, struct fuse_open_in *arg, bool dir)
+{
+	hmount_node_t *node = hmount_node(in->nodeid);
+	struct fuse_open_out out;
+
+	if (!node)
+		return hmount_reply(in->unique, -ENOENT, NULL, 0);
+	if (dir && !S_ISDIR(node->mode))
+		return hmount_reply(in->unique, -ENOTDIR, NULL, 0);
+	if (!dir && S_ISDIR(node->mode))
+		return hmount_reply(in->unique, -EISDIR, NULL, 0);
+	if ((arg->flags & O_ACCMODE) != O_RDONLY)
+		return hmount_reply(in->unique, -EROFS, NULL, 0);
+
+	memset(&out, 0, sizeof(out));
+	out.open_flags = FOPEN_KEEP_CACHE;
+#ifdef FOPEN_CACHE_DIR
+	if (dir && hmount_fs.minor >= 28)
+		out.open_flags |= FOPEN_CACHE_DIR;
+#endif
+	return hmount_reply(in->unique, 0, &out, sizeof(out));
+}
+
+static int hmount_read(struct fuse_in_header *in, struct fuse_read_in *arg)
+{
+	hmount_node_t *node = hmount_node(in->nodeid);
+	uint64_t len = arg->size;
+	int ret;
+
+	if (!node || !S_ISREG(node->mode))
+		return hmount_reply(in->unique, -EBADF, NULL, 0);
+
+	if (arg->offset >= node->size)
+		return hmount_reply(in->unique, 0, NULL, 0);
+	if (len > node->size - arg->offset)
+		len = node->size - arg->offset;
+
+	ret = hmount_fetch(node, arg->offset + len);
+	if (ret != 0)
+		return hmount_reply(in->unique, ret, NULL, 0);
+
+	return hmount_reply(in->unique, 0, node->data + arg->offset, len);
+}
+
+static int hmount_readdir(struct fuse_in_header *in, struct fuse_read_in *arg)
+{
+	static uint8_t buf[HMOUNT_BUF_SIZE];
+	hmount_node_t *dir = hmount_node(in->nodeid);
+	hmount_node_t *node = NULL;
+	size_t size = arg->size < sizeof(buf) ? arg->size : sizeof(buf);
+	size_t len = 0;
+
+	if (!dir || !S_ISDIR(dir->mode))
+		return hmount_reply(in->unique, -ENOTDIR, NULL, 0);
+
+	/* offsets 0 and 1 are "." and "..", children follow */
+	for (uint64_t off = 0; ; off++) {
+		struct fuse_dirent *de = (struct fuse_dirent *)(buf + len);
+		const char *name;
+		uint64_t ino;
+		mode_t mode;
+		size_t namelen;
+		size_t entlen;
+
+		if (off == 0) {
+			name = ".";
+			ino = dir->ino;
+			mode = dir->mode;
+		} else if (off == 1) {
+			name = "..";
+			ino = FUSE_ROOT_ID; /* ignored by the kernel */
+			mode = S_IFDIR;
+		} else {
+			node = node ? node->next : dir->child;
+			if (!node)
+				break;
+			name = node->name;
+			ino = node->ino;
+			mode = node->mode;
+		}
+
+		if (off < arg->offset)
+			continue;
+
+		namelen = strlen(name);
+		entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+		if (len + entlen > size)
+			break;
+
+		memset(de, 0, entlen);
+		de->ino = ino;
+		de->off = off + 1;
+		de->namelen = namelen;
+		de->type = (mode & S_IFMT) >> 12;
+		memcpy(de->name, name, namelen);
+		len += entlen;
+	}
+	return hmount_reply(in->unique, 0, buf, len);
+}
+
+static int hmount_statfs(struct fuse_in_header *in)
+{
+	struct fuse_statfs_out out;
+	uint64_t blocks = 0;
+
+	for (size_t i = 0; i < hmount_fs.num_nodes; i++) {
+		blocks += (hmount_fs.nodes[i]->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.st.blocks = blocks;
+	out.st.files = hmount_fs.num_nodes;
+	out.st.bsize = PAGE_SIZE;
+	out.st.frsize = PAGE_SIZE;
+	out.st.namelen = NAME_MAX;
+	return hmount_reply(in->unique, 0, &out, sizeof(out));
+}
+
+static int hmount_init(struct fuse_in_header *in, struct fuse_init_in *arg)
+{
+	struct fuse_init_out out;
+	size_t len = sizeof(out);
+
+	if (arg->major != FUSE_KERNEL_VERSION || arg->minor < 12) {
+		fprintf(stderr, "[hmount] Unsupported FUSE protocol %u.%u\n", arg->major, arg->minor);
+		return hmount_reply(in->unique, -EPROTO, NULL, 0);
+	}
+	hmount_fs.minor = arg->minor;
+
+	memset(&out, 0, sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = FUSE_KERNEL_MINOR_VERSION;
+	out.max_readahead = arg->max_readahead;
+	out.max_write = PAGE_SIZE;
+#ifdef FUSE_MAX_PAGES
+	if (arg->flags & FUSE_MAX_PAGES) {
+		out.flags |= FUSE_MAX_PAGES;
+		out.max_pages = HMOUNT_MAX_PAGES;
+	}
+#endif
+	if (arg->minor < 23)
+		len = FUSE_COMPAT_22_INIT_OUT_SIZE;
+	return hmount_reply(in->unique, 0, &out, len);
+}
+
+/**
+ * Serve FUSE requests until unmounted
+ */
+static int hmount_serve(void)
+{
+	static uint8_t buf[HMOUNT_BUF_SIZE];
+	struct fuse_in_header *in = (struct fuse_in_header *)buf;
+	void *arg = buf + sizeof(*in);
+	ssize_t len;
+	int ret;
+
+	while (1) {
+		len = read(hmount_fs.fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+				continue;
+			if (errno == ENODEV)
+				return 0; // unmounted
+			return -errno;
+		}
+		if (len < sizeof(*in) || in->len != len)
+			return -EPROTO;
+
+		switch (in->opcode) {
+		case FUSE_INIT:
+			ret = hmount_init(in, arg);
+			break;
+		case FUSE_LOOKUP:
+			buf[len - 1] = '\0';
+			ret = hmount_lookup(in, arg);
+			break;
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+		case FUSE_INTERRUPT:
+			ret = 0; // no reply
+			break;
+		case FUSE_GETATTR:
+			ret = hmount_getattr(in);
+			break;
+		case FUSE_OPEN:
+			ret = hmount_open(in, arg, false);
+			break;
+		case FUSE_OPENDIR:
+			ret = hmount_open(in, arg, true);
+			break;
+		case FUSE_READ:
+			ret = hmount_read(in, arg);
+			break;
+		case FUSE_READDIR:
+			ret = hmount_readdir(in, arg);
+			break;
+		case FUSE_STATFS:
+			ret = hmount_statfs(in);
+			break;
+		case FUSE_RELEASE:
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+			ret = hmount_reply(in->unique, 0, NULL, 0);
+			break;
+		case FUSE_DESTROY:
+			hmount_reply(in->unique, 0, NULL, 0);
+			return 0;
+		default:
+			ret = hmount_reply(in->unique, -ENOSYS, NULL, 0);
+			break;
+		}
+		if (ret != 0)
+			return ret;
+	}
+}
+
+/**
+ * Mount sharedir directory src_dir read-only at mnt and serve it lazily
+ *
+ * Unless foreground is set, returns as soon as the mount is up and serves
+ * requests from a background process. readahead is given in pages.
+ */
+int hmount(const char *src_dir, const char *mnt, const char *manifest, unsigned readahead, bool foreground)
+{
+	char opts[256];
+	pid_t pid;
+	int ret;
+
+	hmount_fs.readahead = readahead;
+	hmount_fs.mtime = time(NULL);
+
+	ret = hmount_load(src_dir, manifest);
+	if (ret != 0)
+		return ret;
+
+	hmount_fs.fd = open(FUSE_DEV, O_RDWR | O_CLOEXEC);
+	if (hmount_fs.fd < 0) {
+		fprintf(stderr, "[hmount] Failed to open " FUSE_DEV ": %s (need CONFIG_FUSE_FS)\n",
+		        strerror(errno));
+		return -errno;
+	}
+
+	mkdir(mnt, 0755);
+	snprintf(opts, sizeof(opts), "fd=%d,rootmode=%o,user_id=%u,group_id=%u,"
+	         "allow_other,default_permissions", hmount_fs.fd, S_IFDIR | 0555, getuid(), getgid());
+	if (mount("nyx", mnt, "fuse.hmount", MS_RDONLY | MS_NOSUID | MS_NODEV, opts) != 0) {
+		fprintf(stderr, "[hmount] Failed to mount %s: %s\n", mnt, strerror(errno));
+		close(hmount_fs.fd);
+		return -errno;
+	}
+
+	if (!foreground) {
+		pid = fork();
+		if (pid < 0) {
+			ret = -errno;
+			umount2(mnt, MNT_DETACH);
+			return ret;
+		}
+		if (pid > 0) {
+			fprintf(stderr, "[hmount] %s => %s (pid %d)\n", src_dir, mnt, pid);
+			return 0;
+		}
+		setsid();
+	}
+	// log may be a pipe that goes away before we do
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = hmount_serve();
+	if (ret != 0) {
+		hprintf("[hmount] %s: %s\n", mnt, strerror(-ret));
+	}
+	debug_printf("[hmount] %s done, %lu bytes fetched\n", mnt, hmount_fs.fetched);
+
+	if (!foreground)
+		exit(ret ? 1 : 0);
+	return ret;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * hpush_dir.c - push a directory tree to the host as a single tar stream
+ *
+ * Entries are written as POSIX ustar records straight into an hpush stream,
+ * so nothing is staged in the guest and the archive is compressed on the fly
+ * when requested. Regular files, directories and symlinks are archived;
+ * other file types and paths too long for ustar are skipped with a warning.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <nyx_api.h>
+#include <nyx_agent.h>
+
+#include "vmcall.h"
+
+#define TAR_BLOCK 512
+#define TAR_MAX_FDS 32
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} __attribute__((packed)) tar_hdr_t;
+
+_Static_assert(sizeof(tar_hdr_t) == TAR_BLOCK, "ustar header must fill one block");
+
+/* nftw() offers no context pointer */
+static hpush_stream_t *tar_stream;
+static size_t tar_skip; /* path prefix stripped from archive names */
+static unsigned tar_files;
+static unsigned tar_failed;
+static uint64_t tar_bytes;
+
+static const uint8_t tar_zero[TAR_BLOCK];
+
+/**
+ * Split path into ustar name and prefix fields, false if it does not fit
+ */
+static bool tar_set_name(tar_hdr_t *hdr, const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len <= sizeof(hdr->name)) {
+		memcpy(hdr->name, path, len);
+		return true;
+	}
+
+	for (size_t i = 0; i < len && i <= sizeof(hdr->prefix); i++) {
+		if (path[i] == '/' && len - i - 1 <= sizeof(hdr->name)) {
+			memcpy(hdr->prefix, path, i);
+			memcpy(hdr->name, path + i + 1, len - i - 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int tar_write_hdr(const char *name, const struct stat *st, char type,
+                         uint64_t size, const char *link)
+{
+	tar_hdr_t hdr;
+	unsigned sum = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (!tar_set_name(&hdr, name)) {
+		fprintf(stderr, "[hpush] Skipping %s: path too long for tar\n", name);
+		return -ENAMETOOLONG;
+	}
+	if (link) {
+		if (strlen(link) > sizeof(hdr.linkname)) {
+			fprintf(stderr, "[hpush] Skipping %s: link target too long for tar\n", name);
+			return -ENAMETOOLONG;
+		}
+		memcpy(hdr.linkname, link, strlen(link));
+	}
+
+	snprintf(hdr.mode, sizeof(hdr.mode), "%07o", st->st_mode & 07777);
+	snprintf(hdr.uid, sizeof(hdr.uid), "%07o", st->st_uid & 07777777);
+	snprintf(hdr.gid, sizeof(hdr.gid), "%07o", st->st_gid & 07777777);
+	snprintf(hdr.size, sizeof(hdr.size), "%011lo", (unsigned long)size);
+	snprintf(hdr.mtime, sizeof(hdr.mtime), "%011lo", (unsigned long)st->st_mtime);
+	hdr.typeflag = type;
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+
+	memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+	for (size_t i = 0; i < sizeof(hdr); i++) {
+		sum += ((uint8_t *)&hdr)[i];
+	}
+	snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+
+	if (hpush_write(tar_stream, &hdr, sizeof(hdr)) < 0)
+		return -errno;
+	return 0;
+}
+
+/**
+ * Write exactly size bytes of file content plus block padding
+ *
+ * Files that shrink while being archived are padded with zeros and files
+ * that grow are truncated, so the stream always matches the header.
+ * Returns an error only if the stream itself failed.
+ */
+static int tar_write_data(int fd, uint64_t size)
+{
+	static uint8_t buf[64 * 1024];
+	uint64_t left = size;
+	ssize_t len = 0;
+
+	while (left) {
+		size_t want = left < sizeof(buf) ? left : sizeof(buf);
+
+		len = read(fd, buf, want);
+		if (len <= 0)
+			break;
+		if (hpush_write(tar_stream, buf, len) < 0)
+			return -errno;
+		left -= len;
+	}
+
+	if (len < 0) {
+		fprintf(stderr, "[hpush] Read error: %s\n", strerror(errno));
+		tar_failed++;
+	}
+	while (left) {
+		size_t pad = left < sizeof(tar_zero) ? left : sizeof(tar_zero);
+		if (hpush_write(tar_stream, tar_zero, pad) < 0)
+			return -errno;
+		left -= pad;
+	}
+
+	if (size % TAR_BLOCK) {
+		if (hpush_write(tar_stream, tar_zero, TAR_BLOCK - size % TAR_BLOCK) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+static int tar_add(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	const char *name = path + tar_skip;
+	char dir_name[PATH_MAX];
+	char link[PATH_MAX];
+	ssize_t link_len;
+	int ret = 0;
+	int fd;
+
+	if (S_ISDIR(st->st_mode)) {
+		snprintf(dir_name, sizeof(dir_name), "%s/", name);
+		ret = tar_write_hdr(dir_name, st, '5', 0, NULL);
+	} else if (S_ISLNK(st->st_mode)) {
+		link_len = readlink(path, link, sizeof(link) - 1);
+		if (link_len < 0) {
+			ret = -errno;
+		} else {
+			link[link_len] = '\0';
+			ret = tar_write_hdr(name, st, '2', 0, link);
+		}
+	} else if (S_ISREG(st->st_mode)) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "[hpush] Skipping %s: %s\n", path, strerror(errno));
+			tar_failed++;
+			return 0;
+		}
+		ret = tar_write_hdr(name, st, '0', st->st_size, NULL);
+		if (ret == 0) {
+			ret = tar_write_data(fd, st->st_size);
+			tar_bytes += st->st_size;
+			tar_files++;
+		}
+		close(fd);
+	} else {
+		fprintf(stderr, "[hpush] Skipping %s: unsupported file type\n", path);
+		return 0;
+	}
+
+	if (ret != 0) {
+		tar_failed++;
+	}
+
+	// abort the walk only if the stream itself broke
+	return (ret == -EIO) ? 1 : 0;
+}
+
+/**
+ * Archive src_dir as a tar stream to host file dst_name
+ *
+ * Archive entries are named relative to the parent of src_dir, so
+ * extracting "crashes.tar" recreates "crashes/".
+ */
+int hpush_dir(const char *src_dir, const char *dst_name, int append, hpush_codec_t codec)
+{
+	char root[PATH_MAX];
+	struct stat st;
+	char *base;
+	int ret;
+
+	if (lstat(src_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "[hpush] Not a directory: %s\n", src_dir);
+		return -ENOTDIR;
+	}
+	if (snprintf(root, sizeof(root), "%s", src_dir) >= sizeof(root))
+		return -ENAMETOOLONG;
+
+	// strip trailing slashes, except for "/"
+	for (size_t len = strlen(root); len > 1 && root[len - 1] == '/'; len--) {
+		root[len - 1] = '\0';
+	}
+	base = strrchr(root, '/');
+	tar_skip = (base && base[1]) ? base - root + 1 : 0;
+
+	tar_files = 0;
+	tar_failed = 0;
+	tar_bytes = 0;
+	tar_stream = hpush_open(dst_name, append, codec, -1);
+	if (!tar_stream) {
+		fprintf(stderr, "[hpush] Failed to open stream %s: %s\n", dst_name, strerror(errno));
+		return -errno;
+	}
+
+	ret = nftw(root, tar_add, TAR_MAX_FDS, FTW_PHYS);
+	if (ret != 0) {
+		fprintf(stderr, "[hpush] Failed to archive %s: %s\n", src_dir,
+		        ret < 0 ? strerror(errno) : strerror(EIO));
+		tar_failed++;
+	}
+
+	// end of archive marker
+	hpush_write(tar_stream, tar_zero, sizeof(tar_zero));
+	hpush_write(tar_stream, tar_zero, sizeof(tar_zero));
+
+	ret = hpush_close(tar_stream);
+	tar_stream = NULL;
+
+	hprintf("[hpush] %s => %s (%u files, %lu bytes, %u failed)\n",
+	        src_dir, dst_name, tar_files, tar_bytes, tar_failed);
+	fprintf(stderr, "[hpush] %s => %s: %u files, %lu bytes, %u failed\n",
+	        src_dir, dst_name, tar_files, tar_bytes, tar_failed);
+
+	if (ret != 0)
+		return ret;
+	return tar_failed ? -EIO : 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * hrange.c - resolve PT trace ranges for hrange
+ *
+ * Ranges can be derived from a kernel module section
+ * (/sys/module/<name>/sections/), from spans of /proc/kallsyms text symbols
+ * matching a glob pattern, or from the executable PT_LOAD segments of an
+ * ELF file. Results are page-aligned and merged by closing the smallest
+ * gaps first until they fit into the available PT range slots.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+#include <nyx_api.h>
+#include <nyx_agent.h>
+
+#include "vmcall.h"
+
+#define KALLSYMS "/proc/kallsyms"
+#define PROC_MODULES "/proc/modules"
+#define SYS_MODULE "/sys/module"
+
+static int hrange_cmp(const void *a, const void *b)
+{
+	const hrange_t *ra = a;
+	const hrange_t *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Page-align ranges, merge overlaps and close the smallest gaps until at
+ * most max_slots ranges remain. Returns the new number of ranges.
+ */
+int hrange_merge(hrange_t *ranges, int num, int max_slots)
+{
+	int out = 0;
+
+	for (int i = 0; i < num; i++) {
+		ranges[i].start &= ~(uint64_t)(PAGE_SIZE - 1);
+		ranges[i].end = (ranges[i].end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+	}
+	qsort(ranges, num, sizeof(*ranges), hrange_cmp);
+
+	for (int i = 0; i < num; i++) {
+		if (out && ranges[i].start <= ranges[out - 1].end) {
+			if (ranges[i].end > ranges[out - 1].end)
+				ranges[out - 1].end = ranges[i].end;
+		} else {
+			ranges[out++] = ranges[i];
+		}
+	}
+
+	while (out > max_slots && out > 1) {
+		int best = 0;
+		for (int i = 1; i < out - 1; i++) {
+			if (ranges[i + 1].start - ranges[i].end <
+			    ranges[best + 1].start - ranges[best].end)
+				best = i;
+		}
+		ranges[best].end = ranges[best + 1].end;
+		memmove(&ranges[best + 1], &ranges[best + 2], (out - best - 2) * sizeof(*ranges));
+		out--;
+	}
+	return out;
+}
+
+static int read_hex_file(const char *path, uint64_t *val)
+{
+	FILE *f = fopen(path, "r");
+	int ret;
+
+	if (!f)
+		return -errno;
+	ret = (fscanf(f, "%lx", val) == 1) ? 0 : -EINVAL;
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Lookup module core base and size in /proc/modules
+ */
+static int module_core(const char *name, uint64_t *base, uint64_t *size)
+{
+	char line[512];
+	char mod[64];
+	FILE *f;
+	int ret = -ENOENT;
+
+	f = fopen(PROC_MODULES, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %lu %*s %*s %*s %lx", mod, size, base) == 3 &&
+		    0 == strcmp(mod, name)) {
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Resolve "name[:section]" to the address span of a loaded module section
+ *
+ * Sysfs only exposes section start addresses. The section is assumed to
+ * end at the next section start or at the end of the module core as listed
+ * in /proc/modules, whichever comes first.
+ */
+int hrange_module(const char *spec, hrange_t *range)
+{
+	char name[64];
+	char path[PATH_MAX];
+	const char *section = ".text";
+	const char *sep = strchr(spec, ':');
+	uint64_t start, end = UINT64_MAX;
+	uint64_t base, size;
+	struct dirent *de;
+	DIR *dir;
+	int ret;
+
+	if (sep) {
+		section = sep + 1;
+	}
+	snprintf(name, sizeof(name), "%.*s", sep ? (int)(sep - spec) : (int)strlen(spec), spec);
+
+	snprintf(path, sizeof(path), SYS_MODULE "/%s/sections/%s", name, section);
+	ret = read_hex_file(path, &start);
+	if (ret != 0 || start == 0) {
+		fprintf(stderr, "[hrange] Failed to resolve %s: %s\n", path,
+		        ret ? strerror(-ret) : "address hidden, need root");
+		return ret ? ret : -EPERM;
+	}
+
+	snprintf(path, sizeof(path), SYS_MODULE "/%s/sections", name);
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir)) != NULL) {
+		char sec_path[PATH_MAX + sizeof(de->d_name)];
+		uint64_t addr;
+
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+			continue;
+		snprintf(sec_path, sizeof(sec_path), "%s/%s", path, de->d_name);
+		if (read_hex_file(sec_path, &addr) == 0 && addr > start && addr < end)
+			end = addr;
+	}
+	closedir(dir);
+
+	if (module_core(name, &base, &size) == 0 && start >= base && start < base + size) {
+		if (base + size < end)
+			end = base + size;
+	}
+
+	if (end == UINT64_MAX) {
+		fprintf(stderr, "[hrange] Failed to find end of %s:%s\n", name, section);
+		return -ERANGE;
+	}
+
+	range->start = start;
+	range->end = end;
+	fprintf(stderr, "[hrange] Module %s:%s => 0x%lx-0x%lx\n", name, section, start, end);
+	return 0;
+}
+
+typedef struct {
+	uint64_t addr;
+	bool match;
+} ksym_t;
+
+static int ksym_cmp(const void *a, const void *b)
+{
+	const ksym_t *sa = a;
+	const ksym_t *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	return sb->match - sa->match; // matches first on aliases
+}
+
+/**
+ * Resolve text symbols matching a glob pattern to at most max ranges
+ *
+ * Each symbol is assumed to extend up to the next symbol in kallsyms.
+ */
+int hrange_kallsyms(const char *pattern, hrange_t *ranges, int max)
+{
+	ksym_t *syms = NULL;
+	size_t num_syms = 0;
+	size_t cap = 0;
+	char line[512];
+	bool hidden = true;
+	int num = 0;
+	FILE *f;
+
+	f = fopen(KALLSYMS, "r");
+	if (!f) {
+		fprintf(stderr, "[hrange] Failed to open " KALLSYMS ": %s\n", strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char name[256];
+		uint64_t addr;
+		char type;
+
+		if (sscanf(line, "%lx %c %255s", &addr, &type, name) != 3)
+			continue;
+		if (addr)
+			hidden = false;
+		if (num_syms == cap) {
+			ksym_t *tmp = realloc(syms, (cap = cap ? 2 * cap : 4096) * sizeof(*syms));
+			if (!tmp) {
+				free(syms);
+				fclose(f);
+				return -ENOMEM;
+			}
+			syms = tmp;
+		}
+		syms[num_syms].addr = addr;
+		syms[num_syms].match = (type == 't' || type == 'T') && !fnmatch(pattern, name, 0);
+		num_syms++;
+	}
+	fclose(f);
+
+	if (hidden) {
+		fprintf(stderr, "[hrange] " KALLSYMS " addresses hidden, check kptr_restrict\n");
+		free(syms);
+		return -EPERM;
+	}
+
+	qsort(syms, num_syms, sizeof(*syms), ksym_cmp);
+
+	/* collect spans into ranges[], merging down whenever it fills up */
+	for (size_t i = 0; i < num_syms; i++) {
+		uint64_t end = syms[i].addr + PAGE_SIZE;
+
+		if (!syms[i].match)
+			continue;
+		for (size_t j = i + 1; j < num_syms; j++) {
+			if (syms[j].addr > syms[i].addr) {
+				end = syms[j].addr;
+				break;
+			}
+		}
+		if (num && syms[i].addr <= ranges[num - 1].end) {
+			if (end > ranges[num - 1].end)
+				ranges[num - 1].end = end;
+			continue;
+		}
+		if (num == max)
+			num = hrange_merge(ranges, num, max - 1);
+		ranges[num].start = syms[i].addr;
+		ranges[num].end = end;
+		num++;
+	}
+	free(syms);
+
+	if (!num) {
+		fprintf(stderr, "[hrange] No text symbols matching '%s'\n", pattern);
+		return -ENOENT;
+	}
+
+	num = hrange_merge(ranges, num, max);
+	for (int i = 0; i < num; i++) {
+		fprintf(stderr, "[hrange] Symbols '%s' => 0x%lx-0x%lx\n",
+		        pattern, ranges[i].start, ranges[i].end);
+	}
+	return num;
+}
+
+/**
+ * Resolve "path[@base]" to the executable PT_LOAD segments of an ELF
+ *
+ * Position independent binaries (ET_DYN) need their load base, i.e. the
+ * start of their first mapping in /proc/<pid>/maps of a running instance.
+ * Other binaries are loaded at their link address, so @base is ignored and
+ * the same recipe works for both.
+ */
+int hrange_elf(const char *spec, hrange_t *ranges, int max)
+{
+	char path[PATH_MAX];
+	const char *at = strrchr(spec, '@');
+	uint64_t base = 0;
+	Elf64_Ehdr ehdr;
+	int num = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%.*s", at ? (int)(at - spec) : (int)strlen(spec), spec);
+	if (at) {
+		char *endp;
+		base = strtoull(at + 1, &endp, 0);
+		if (*endp != '\0') {
+			fprintf(stderr, "[hrange] Invalid ELF base address: %s\n", at + 1);
+			return -EINVAL;
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "[hrange] Failed to open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+		fprintf(stderr, "[hrange] Not a 64-bit ELF file: %s\n", path);
+		close(fd);
+		return -ENOEXEC;
+	}
+
+	if (ehdr.e_type == ET_DYN && !at) {
+		fprintf(stderr, "[hrange] %s is position independent, need %s@base\n", path, path);
+		close(fd);
+		return -EINVAL;
+	}
+	if (ehdr.e_type != ET_DYN && at) {
+		fprintf(stderr, "[hrange] %s is not position independent, ignoring @%s\n", path, at + 1);
+		base = 0;
+	}
+
+	for (int i = 0; i < ehdr.e_phnum; i++) {
+		Elf64_Phdr phdr;
+
+		if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			break;
+		if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X) || !phdr.p_memsz)
+			continue;
+		if (num == max)
+			num = hrange_merge(ranges, num, max - 1);
+		ranges[num].start = base + phdr.p_vaddr;
+		ranges[num].end = base + phdr.p_vaddr + phdr.p_memsz;
+		fprintf(stderr, "[hrange] ELF %s => 0x%lx-0x%lx\n", path,
+		        ranges[num].start, ranges[num].end);
+		num++;
+	}
+	close(fd);
+
+	if (!num) {
+		fprintf(stderr, "[hrange] No executable PT_LOAD segments in %s\n", path);
+		return -ENOENT;
+	}
+	return num;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * sha256.c - minimal SHA-256 (FIPS 180-4)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_ctx_t *ctx, const uint8_t *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+		              sha256_k[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->bytes = 0;
+	ctx->block_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	ctx->bytes += len;
+
+	if (ctx->block_len) {
+		size_t fill = sizeof(ctx->block) - ctx->block_len;
+		if (fill > len)
+			fill = len;
+		memcpy(ctx->block + ctx->block_len, p, fill);
+		ctx->block_len += fill;
+		p += fill;
+		len -= fill;
+		if (ctx->block_len < sizeof(ctx->block))
+			return;
+		sha256_block(ctx, ctx->block);
+		ctx->block_len = 0;
+	}
+
+	for (; len >= sizeof(ctx->block); p += sizeof(ctx->block), len -= sizeof(ctx->block)) {
+		sha256_block(ctx, p);
+	}
+
+	memcpy(ctx->block, p, len);
+	ctx->block_len = len;
+}
+
+void sha256_final(sha256_ctx_t *ctx, char hex[SHA256_HEX_SIZE])
+{
+	uint64_t bits = ctx->bytes * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t pad_len;
+
+	pad_len = (ctx->block_len < 56 ? 56 : 120) - ctx->block_len;
+	for (int i = 0; i < 8; i++) {
+		pad[pad_len + i] = bits >> (56 - 8 * i);
+	}
+	sha256_update(ctx, pad, pad_len + 8);
+
+	for (int i = 0; i < 8; i++) {
+		snprintf(hex + 8 * i, 9, "%08x", ctx->state[i]);
+	}
+}
+
+/**
+ * Hash a local file, returns 0 on success
+ */
+int sha256_file(const char *path, char hex[SHA256_HEX_SIZE])
+{
+	uint8_t buf[64 * 1024];
+	sha256_ctx_t ctx;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	sha256_init(&ctx);
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		sha256_update(&ctx, buf, len);
+	}
+	close(fd);
+	if (len < 0)
+		return -EIO;
+
+	sha256_final(&ctx, hex);
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * sha256.h - minimal SHA-256 for verifying files fetched from the sharedir
+ */
+
+#ifndef VMCALL_SHA256_H
+#define VMCALL_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t bytes;
+	uint8_t block[64];
+	size_t block_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, char hex[SHA256_HEX_SIZE]);
+int sha256_file(const char *path, char hex[SHA256_HEX_SIZE]);
+
+#endif
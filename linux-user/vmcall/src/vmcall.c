@@ -17,18 +17,21 @@
  */
 
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <ctype.h>
 
 #include <errno.h>
 #include <assert.h>
 
 #include <sys/types.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libgen.h>
 
 #include <nyx_api.h>
@@ -36,6 +39,18 @@
 #include <nyx_agent.h>
 //#include "utils.h"
 
+#include "vmcall.h"
+
+#define HEXEC_MAX_PRELOADS 16
+#define RUN_MAX_ARGS 64
+#define HCAT_KMSG_SETTLE_MS 100
+#define HCAT_KMSG_SETTLE_ROUNDS 20
+
+extern char **environ;
+
+/* commands run from a script by cmd_run() */
+static bool run_mode = false;
+
 struct cmd_table {
 	char *name;
 	int (*handler)(int, char **);
@@ -44,7 +59,7 @@ struct cmd_table {
 static void usage()
 {
 	char *msg = "\nUsage: vmcall [cmd] [args...]\n\n"
-	            "\twhere cmd := { check, hcat, hget, hpush, habort, hpanic, hrange, hlock }\n";
+	            "\twhere cmd := { check, hcat, hget, hexec, hpush, hmount, habort, hpanic, hrange, hlock, run, bench }\n";
 
 	fputs(msg, stderr);
 }
@@ -55,6 +70,55 @@ static void usage_error(const char *msg)
 	usage();
 }
 
+/**
+ * Scan kernel log and ship its tail only if an oops or panic was found.
+ *
+ * In follow mode, keep watching and ship the tail of each new report once
+ * it has settled. With report_panic, also signal the crash to the host,
+ * for kernel bugs that kill the harness instead of panicking the kernel.
+ */
+static int hcat_kmsg(bool always, bool follow, bool report_panic)
+{
+	static char crash[256];
+	size_t written = 0;
+	int ret;
+
+	ret = kmsg_open(true);
+	if (ret != 0)
+		return ret;
+
+	do {
+		ret = kmsg_poll(follow ? -1 : 0);
+		if (ret < 0) {
+			fprintf(stderr, "[hcat]  Error reading kernel log: %s\n", strerror(-ret));
+			break;
+		}
+		if (!kmsg_crash_line()) {
+			if (!follow && always)
+				written += kmsg_ship();
+			continue;
+		}
+
+		// give the rest of the report a chance to arrive
+		for (int i = 0; follow && i < HCAT_KMSG_SETTLE_ROUNDS; i++) {
+			if (kmsg_poll(HCAT_KMSG_SETTLE_MS) <= 0)
+				break;
+		}
+
+		snprintf(crash, sizeof(crash), "%s", kmsg_crash_line());
+		fprintf(stderr, "[hcat]  Kernel log reports: %s\n", crash);
+		written += kmsg_ship();
+		if (report_panic) {
+			hypercall(HYPERCALL_KAFL_PANIC_EXTENDED, (uintptr_t)crash);
+		}
+	} while (follow);
+
+	kmsg_close();
+
+	debug_printf("[hcat]  %zd bytes written.\n", written);
+	return !(written > 0);
+}
+
 /**
  * Read stdin or file argument and output to hprintf buffer.
  *
@@ -65,6 +129,44 @@ static int cmd_hcat(int argc, char **argv)
 {
 	FILE *f;
 	size_t written = 0;
+	bool kmsg = false;
+	bool always = false;
+	bool follow = false;
+	bool report_panic = false;
+	int opt;
+
+	static const struct option long_opts[] = {
+		{ "kmsg",   no_argument, NULL, 'k' },
+		{ "all",    no_argument, NULL, 'a' },
+		{ "follow", no_argument, NULL, 'f' },
+		{ "panic",  no_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "kafp", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'k':
+			kmsg = true;
+			break;
+		case 'a':
+			always = true;
+			break;
+		case 'f':
+			follow = true;
+			break;
+		case 'p':
+			report_panic = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: hcat [file..]\n"
+			                "       hcat --kmsg [-a] [-f [-p]]\n");
+			return -EINVAL;
+		}
+	}
+
+	if (kmsg) {
+		return hcat_kmsg(always, follow, report_panic);
+	}
 
 	if (!isatty(fileno(stdin))) {
 		written += hprintf_from_file(stdin);
@@ -106,23 +208,64 @@ static int cmd_hpanic(int argc, char **argv)
 	return 0;
 }
 
+/**
+ * Fetch files into memfds and join their /proc/self/fd/N paths with ':'
+ */
+static int memfd_paths(char **files, int num_files, char *paths, size_t size)
+{
+	size_t pos = 0;
+
+	paths[0] = '\0';
+	for (int i = 0; i < num_files; i++) {
+		int fd = hget_memfd(files[i]);
+		if (fd < 0) {
+			return fd;
+		}
+		pos += snprintf(paths + pos, size - pos, "%s/proc/self/fd/%d", pos ? ":" : "", fd);
+		if (pos >= size) {
+			return -E2BIG;
+		}
+	}
+	return 0;
+}
+
 static int cmd_hget(int argc, char **argv)
 {
 	int ret = 0;
 	char *dst_root = NULL;
+	char *manifest = HGET_MANIFEST;
+	bool recursive = false;
+	bool memfd = false;
 	int opt;
 	mode_t fmode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
 
-	while ((opt = getopt(argc, argv, "xo:")) != -1) {
+	static const struct option long_opts[] = {
+		{ "memfd", no_argument, NULL, 'M' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	/* stop at the first file, the --memfd command follows "--" */
+	while ((opt = getopt_long(argc, argv, "+xro:m:", long_opts, NULL)) != -1) {
 		switch (opt) {
+		case 'M':
+			memfd = true;
+			break;
 		case 'x':
 			fmode |= S_IXUSR | S_IXGRP | S_IXOTH;
 			break;
+		case 'r':
+			recursive = true;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
 		case 'o':
 			dst_root = strdup(optarg);
 			break;
 		default:
-			fprintf(stderr, "Usage: hget [-x] [-o path/to/dest/] file [file..]\n");
+			fprintf(stderr, "Usage: hget [-x] [-o path/to/dest/] file [file..]\n"
+			                "       hget -r [-m manifest] [-o path/to/dest/] dir [dir..]\n"
+			                "       hget --memfd file [file..] -- cmd [args..]\n");
 			return -EINVAL;
 		}
 	}
@@ -132,73 +275,300 @@ static int cmd_hget(int argc, char **argv)
 		return -EINVAL;
 	}
 
+	/* run cmd with $HGET_MEMFD listing the in-memory copies of files */
+	if (memfd) {
+		char paths[PAGE_SIZE];
+		int sep = optind;
+
+		while (sep < argc && strcmp(argv[sep], "--") != 0) {
+			sep++;
+		}
+		if (sep == optind || sep + 1 >= argc) {
+			fprintf(stderr, "[hget]  Usage: hget --memfd file [file..] -- cmd [args..]\n");
+			return -EINVAL;
+		}
+		if (run_mode) {
+			fprintf(stderr, "[hget]  --memfd is not supported in run scripts, it replaces vmcall\n");
+			return -ENOTSUP;
+		}
+
+		ret = memfd_paths(&argv[optind], sep - optind, paths, sizeof(paths));
+		if (ret != 0) {
+			return ret;
+		}
+		setenv("HGET_MEMFD", paths, 1);
+		execvp(argv[sep + 1], &argv[sep + 1]);
+		fprintf(stderr, "[hget]  Failed to execute %s: %s\n", argv[sep + 1], strerror(errno));
+		return -errno;
+	}
+
 	if (dst_root) {
 		ret = chdir(dst_root);
-		free(dst_root);
 		if (ret != 0) {
-			fprintf(stderr, "[hget]  Failed to access %s: %s", dst_root, strerror(errno));
-			return errno;
+			ret = -errno;
+			fprintf(stderr, "[hget]  Failed to access %s: %s\n", dst_root, strerror(-ret));
+			free(dst_root);
+			return ret;
 		}
+		free(dst_root);
 	}
 
 	for (int i = optind; i < argc && ret == 0; i++) {
-		ret = hget_file(argv[i], fmode);
+		if (recursive) {
+			ret = hget_dir(argv[i], manifest);
+		} else {
+			ret = hget_file(argv[i], fmode);
+		}
 		if (ret != 0)
 			break;
 	}
 	return ret;
 }
 
+/**
+ * Fetch executable and optional preload libraries into memory and execute
+ * it in place of vmcall, without writing to the guest filesystem
+ */
+static int cmd_hexec(int argc, char **argv)
+{
+	char *preloads[HEXEC_MAX_PRELOADS];
+	int num_preloads = 0;
+	char paths[PAGE_SIZE];
+	int opt;
+	int ret;
+	int fd;
+
+	/* stop at the executable, remaining arguments are passed on */
+	while ((opt = getopt(argc, argv, "+p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (num_preloads == ARRAY_SIZE(preloads)) {
+				fprintf(stderr, "[hexec] Too many preload libraries\n");
+				return -E2BIG;
+			}
+			preloads[num_preloads++] = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: hexec [-p preload.so].. file [args..]\n");
+			return -EINVAL;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "[hexec] Missing argument: filename\n");
+		return -EINVAL;
+	}
+
+	if (run_mode) {
+		fprintf(stderr, "[hexec] Not supported in run scripts, it replaces vmcall\n");
+		return -ENOTSUP;
+	}
+
+	if (num_preloads) {
+		char *old = getenv("LD_PRELOAD");
+		size_t len;
+
+		ret = memfd_paths(preloads, num_preloads, paths, sizeof(paths));
+		if (ret != 0) {
+			return ret;
+		}
+		len = strlen(paths);
+		if (old && *old) {
+			snprintf(paths + len, sizeof(paths) - len, ":%s", old);
+		}
+		setenv("LD_PRELOAD", paths, 1);
+	}
+
+	fd = hget_memfd(argv[optind]);
+	if (fd < 0) {
+		return fd;
+	}
+
+	/* the kernel passes scripts to their interpreter as /dev/fd/N */
+	if (access("/dev/fd", F_OK) != 0) {
+		symlink("/proc/self/fd", "/dev/fd");
+	}
+
+	fexecve(fd, &argv[optind], environ);
+	ret = -errno;
+	fprintf(stderr, "[hexec] Failed to execute %s: %s\n", argv[optind], strerror(-ret));
+	return ret;
+}
+
+/**
+ * Push a file, stdin ("-") or a directory tree as tar archive (-r) to host
+ */
 static int cmd_hpush(int argc, char **argv)
 {
 	int ret = 0;
 	bool append = 0;
+	bool recursive = false;
 	char *dst_name = NULL;
+	char *src_path;
+	hpush_codec_t codec = HPUSH_RAW;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "ao:")) != -1) {
+	while ((opt = getopt(argc, argv, "arzo:")) != -1) {
 		switch (opt) {
 		case 'a':
 			append = 1;
 			break;
+		case 'r':
+			recursive = true;
+			break;
+		case 'z':
+			codec = hpush_default_codec();
+			if (codec == HPUSH_RAW) {
+				fprintf(stderr, "[hpush] Built without WITH_ZSTD/WITH_LZ4, pushing uncompressed\n");
+			}
+			break;
 		case 'o':
 			dst_name = strdup(optarg);
 			break;
 		default:
-			fprintf(stderr, "Usage: hpush [-o dest_pattern] file\n");
+			fprintf(stderr, "Usage: hpush [-a] [-z] [-o dest_pattern] file|-\n"
+			                "       hpush -r [-a] [-z] [-o dest.tar] dir\n");
 			return -EINVAL;
 		}
 	}
 
 	if (optind + 1 != argc) {
 		fprintf(stderr, "[hpush] Need exactly one argument: file\n");
+		free(dst_name);
 		return -EINVAL;
 	}
 
-	char *src_path = argv[optind];
+	src_path = argv[optind];
+
+	if (!dst_name) {
+		char *tmp = strdup(src_path);
+		char *base = basename(tmp);
+
+		if (recursive) {
+			dst_name = malloc(strlen(base) + sizeof(".tar"));
+			if (dst_name)
+				sprintf(dst_name, "%s.tar", base);
+		} else if (0 == strcmp(src_path, "-")) {
+			dst_name = strdup("stdin");
+		} else {
+			dst_name = strdup(base);
+		}
+		free(tmp);
+		if (!dst_name)
+			return -ENOMEM;
+	}
 
-	if (dst_name) {
-		ret = hpush_file(src_path, dst_name, append);
+	if (recursive) {
+		ret = hpush_dir(src_path, dst_name, append, codec);
+	} else if (0 == strcmp(src_path, "-")) {
+		ssize_t bytes = hpush_fd(STDIN_FILENO, dst_name, append, codec);
+		if (bytes < 0) {
+			fprintf(stderr, "[hpush] Failed to push stdin: %s\n", strerror(-bytes));
+			ret = bytes;
+		} else {
+			hprintf("[hpush] <stdin> => %s (%lu bytes)\n", dst_name, bytes);
+		}
 	} else {
-		dst_name = strdup(src_path);
-		ret = hpush_file(src_path, basename(dst_name), append);
+		ret = hpush_file_codec(src_path, dst_name, append, codec);
 	}
 	free(dst_name);
 	return ret;
 }
 
+/**
+ * Mount sharedir directory, fetching files on first access, see hmount.c
+ */
+static int cmd_hmount(int argc, char **argv)
+{
+	char *manifest = HGET_MANIFEST;
+	unsigned readahead = HMOUNT_READAHEAD;
+	bool foreground = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "fm:r:")) != -1) {
+		switch (opt) {
+		case 'f':
+			foreground = true;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'r':
+			readahead = strtoul(optarg, NULL, 0) * 1024 / PAGE_SIZE;
+			break;
+		default:
+			fprintf(stderr, "Usage: hmount [-f] [-m manifest] [-r readahead_kb] dir mountpoint\n");
+			return -EINVAL;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		fprintf(stderr, "[hmount] Missing argument: dir mountpoint\n");
+		return -EINVAL;
+	}
+
+	return hmount(argv[optind], argv[optind + 1], manifest, readahead, foreground);
+}
+
+/**
+ * Submit PT ranges, given explicitly as id,start-end or resolved from
+ * kernel modules, kallsyms or ELF files into the remaining free slots
+ */
 static int cmd_hrange(int argc, char **argv)
 {
 	uint64_t range_id;
 	uint64_t range_start;
 	uint64_t range_end;
+	hrange_t spans[HRANGE_MAX_SPANS];
+	int num_spans = 0;
+	bool used[HRANGE_SLOTS] = { false };
+	int free_slots = HRANGE_SLOTS;
+	int opt;
+	int ret;
+
+	static const struct option long_opts[] = {
+		{ "module",   required_argument, NULL, 'm' },
+		{ "kallsyms", required_argument, NULL, 'k' },
+		{ "elf",      required_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "m:k:e:", long_opts, NULL)) != -1) {
+		int room = ARRAY_SIZE(spans) - num_spans;
+
+		/* keep room for at least two spans in each resolver */
+		if (room < 2) {
+			num_spans = hrange_merge(spans, num_spans, ARRAY_SIZE(spans) / 2);
+			room = ARRAY_SIZE(spans) - num_spans;
+		}
+
+		switch (opt) {
+		case 'm':
+			ret = hrange_module(optarg, &spans[num_spans]);
+			ret = ret ? ret : 1;
+			break;
+		case 'k':
+			ret = hrange_kallsyms(optarg, &spans[num_spans], room);
+			break;
+		case 'e':
+			ret = hrange_elf(optarg, &spans[num_spans], room);
+			break;
+		default:
+			fprintf(stderr, "Usage: hrange [--module name[:section]] [--kallsyms glob] "
+			                "[--elf path[@base]] [id,start-end..]\n");
+			return -EINVAL;
+		}
+		if (ret < 0)
+			return ret;
+		num_spans += ret;
+	}
 
 	for (int i = optind; i < argc; i++) {
 		if (3 != sscanf(argv[i], "%lu,%lx-%lx", &range_id, &range_start, &range_end)) {
-			fprintf(stderr, "Usage: hrange id,start-end [id,start-end...]");
+			fprintf(stderr, "Usage: hrange id,start-end [id,start-end...]\n");
 			return -EINVAL;
 		}
-		if (range_id > 3) {
+		if (range_id >= HRANGE_SLOTS) {
 			fprintf(stderr, "[hrange] Error: Range id must be in [0-3].\n");
 			return -EINVAL;
 		}
@@ -222,6 +592,27 @@ static int cmd_hrange(int argc, char **argv)
 		fprintf(stderr, "[hrange] Submit range %lu: 0x%08lx-0x%08lx\n",
 		        range_id, range_start, range_end);
 		hrange_submit(range_id, range_start, range_end);
+		if (!used[range_id]) {
+			used[range_id] = true;
+			free_slots--;
+		}
+	}
+
+	if (!num_spans)
+		return 0;
+
+	if (!free_slots) {
+		fprintf(stderr, "[hrange] Error: No free range slot for resolved ranges.\n");
+		return -ENOSPC;
+	}
+
+	num_spans = hrange_merge(spans, num_spans, free_slots);
+	for (int i = 0, id = 0; i < num_spans; i++, id++) {
+		while (used[id])
+			id++;
+		fprintf(stderr, "[hrange] Submit range %d: 0x%08lx-0x%08lx\n",
+		        id, spans[i].start, spans[i].end);
+		hrange_submit(id, spans[i].start, spans[i].end);
 	}
 	return 0;
 }
@@ -267,6 +658,8 @@ static int cmd_hlock()
  * Call subcommand based on argv[0]
  */
 static int cmd_vmcall(int argc, char **argv);
+static int cmd_run(int argc, char **argv);
+static int cmd_bench(int argc, char **argv);
 static int cmd_dispatch(int argc, char **argv)
 {
 	const static struct cmd_table cmd_list[] = {
@@ -274,11 +667,15 @@ static int cmd_dispatch(int argc, char **argv)
 		{ "hcat",   cmd_hcat   },
 		{ "habort", cmd_habort },
 		{ "hget",   cmd_hget   },
+		{ "hexec",  cmd_hexec  },
 		{ "hpush",  cmd_hpush  },
+		{ "hmount", cmd_hmount },
 		{ "hpanic", cmd_hpanic },
 		{ "hrange", cmd_hrange },
 		{ "hlock",  cmd_hlock  },
 		{ "check",  cmd_check  },
+		{ "run",    cmd_run    },
+		{ "bench",  cmd_bench  },
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(cmd_list); i++) {
@@ -304,6 +701,257 @@ static int cmd_vmcall(int argc, char **argv)
 	return ret;
 }
 
+/**
+ * Return the first '|' outside of quotes, if any
+ */
+static char *run_find_pipe(char *line)
+{
+	char quote = 0;
+
+	for (char *p = line; *p; p++) {
+		if (quote) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+		} else if (*p == '|') {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Split line in place into a NULL-terminated argv[]
+ *
+ * Arguments are separated by whitespace and may be grouped with '' or "".
+ * A '#' at the start of an argument comments out the rest of the line.
+ */
+static int run_split(char *line, char **argv, int max_args)
+{
+	char *src = line;
+	char *dst = line;
+	int argc = 0;
+
+	while (*src) {
+		char quote = 0;
+
+		while (isspace(*src))
+			src++;
+		if (*src == '\0' || *src == '#')
+			break;
+		if (argc == max_args - 1)
+			return -E2BIG;
+
+		argv[argc++] = dst;
+		for (; *src && (quote || !isspace(*src)); src++) {
+			if (quote && *src == quote) {
+				quote = 0;
+			} else if (!quote && (*src == '\'' || *src == '"')) {
+				quote = *src;
+			} else {
+				*dst++ = *src;
+			}
+		}
+		if (quote)
+			return -EINVAL;
+		if (*src)
+			src++;
+		*dst++ = '\0';
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+/**
+ * Execute one script line, feeding stdin from the shell pipeline before '|'
+ */
+static int run_line(char *line, int null_fd)
+{
+	char *argv[RUN_MAX_ARGS];
+	char *cmd = line;
+	char *bar = NULL;
+	FILE *pipe_in = NULL;
+	int argc;
+	int ret;
+
+	while (isspace(*line))
+		line++;
+	if (*line == '\0' || *line == '#')
+		return 0;
+
+	bar = run_find_pipe(line);
+	if (bar) {
+		*bar = '\0';
+		cmd = bar + 1;
+	}
+
+	argc = run_split(cmd, argv, ARRAY_SIZE(argv));
+	if (argc <= 0) {
+		fprintf(stderr, "[run]   Invalid command line\n");
+		return argc ? argc : -EINVAL;
+	}
+
+	if (bar) {
+		fflush(NULL);
+		pipe_in = popen(line, "r");
+		if (!pipe_in) {
+			fprintf(stderr, "[run]   Failed to run %s: %s\n", line, strerror(errno));
+			return -errno;
+		}
+		dup2(fileno(pipe_in), STDIN_FILENO);
+	}
+	/* drop data buffered from the stdin of the previous line */
+	__fpurge(stdin);
+	clearerr(stdin);
+
+	optind = 0; // start parsing at argv[0]
+	ret = cmd_dispatch(argc, argv);
+	fflush(NULL);
+
+	if (pipe_in) {
+		// drop our read end first so the writer cannot block on a full pipe
+		dup2(null_fd, STDIN_FILENO);
+		pclose(pipe_in);
+	}
+	return ret;
+}
+
+/**
+ * Execute vmcall commands from a script or stdin, one per line
+ *
+ * All commands run in this one process, so CPU type detection and the
+ * hget/hpush scratch buffers are shared. Each command starts in the initial
+ * working directory and reads stdin from /dev/null, or from the output of
+ * a shell pipeline such as "dmesg | hcat".
+ *
+ * hexec and hget --memfd replace the calling process, so they are rejected
+ * here rather than silently dropping the rest of the script.
+ */
+static int cmd_run(int argc, char **argv)
+{
+	bool errexit = false;
+	char *script_name;
+	FILE *script;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned lineno = 0;
+	int cwd_fd = -1;
+	int null_fd = -1;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "+e")) != -1) {
+		switch (opt) {
+		case 'e':
+			errexit = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: run [-e] script|-\n");
+			return -EINVAL;
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "[run]   Need exactly one argument: script\n");
+		return -EINVAL;
+	}
+
+	script_name = argv[optind];
+	if (0 == strcmp(script_name, "-")) {
+		script = fdopen(fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0), "r");
+	} else {
+		script = fopen(script_name, "re");
+	}
+	if (!script) {
+		fprintf(stderr, "[run]   Failed to open %s: %s\n", script_name, strerror(errno));
+		return -errno;
+	}
+
+	cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (cwd_fd < 0 || null_fd < 0) {
+		fprintf(stderr, "[run]   Failed to setup: %s\n", strerror(errno));
+		ret = -errno;
+		goto err_out;
+	}
+	dup2(null_fd, STDIN_FILENO);
+	run_mode = true;
+
+	while (getline(&line, &line_size, script) > 0) {
+		int cmd_ret;
+
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+
+		cmd_ret = run_line(line, null_fd);
+		if (fchdir(cwd_fd) != 0) {
+			fprintf(stderr, "[run]   Failed to restore cwd: %s\n", strerror(errno));
+			ret = -errno;
+			break;
+		}
+		if (cmd_ret != 0) {
+			fprintf(stderr, "[run]   %s:%u: command failed (%d)\n", script_name, lineno, cmd_ret);
+			ret = cmd_ret;
+			if (errexit)
+				break;
+		}
+	}
+
+err_out:
+	free(line);
+	fclose(script);
+	if (cwd_fd >= 0)
+		close(cwd_fd);
+	if (null_fd >= 0)
+		close(null_fd);
+	return ret;
+}
+
+/**
+ * Measure hypercall transport bandwidth and latency, see bench.c
+ */
+static int cmd_bench(int argc, char **argv)
+{
+	char *src_file = BENCH_SRC_FILE;
+	char *dst_name = BENCH_DST_FILE;
+	bool acquire_release = false;
+	unsigned iters = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "af:n:o:")) != -1) {
+		switch (opt) {
+		case 'a':
+			acquire_release = true;
+			break;
+		case 'f':
+			src_file = optarg;
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			dst_name = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: bench [-a] [-n iterations] [-f sharedir_file] [-o dest.json]\n");
+			return -EINVAL;
+		}
+	}
+
+	if (!iters) {
+		fprintf(stderr, "[bench] Need at least one iteration\n");
+		return -EINVAL;
+	}
+
+	if (nyx_cpu_type != nyx_cpu_v1 && nyx_cpu_type != nyx_cpu_v2) {
+		fprintf(stderr, "[bench] No Nyx CPU detected, nothing to measure\n");
+		return -ENODEV;
+	}
+
+	return bench_run(src_file, dst_name, iters, acquire_release);
+}
+
 int main(int argc, char **argv)
 {
 	int ret = 0;
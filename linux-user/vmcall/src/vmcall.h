@@ -0,0 +1,44 @@
+/*
+ * Copyright (C)  2022  Intel Corporation.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * vmcall.h - subcommand helpers of vmcall
+ */
+
+#ifndef VMCALL_H
+#define VMCALL_H
+
+#define HGET_MANIFEST "manifest.sha256"
+
+int hget_dir(const char *src_dir, const char *manifest);
+int hpush_dir(const char *src_dir, const char *dst_name, int append, hpush_codec_t codec);
+
+/* lazy sharedir mount, see hmount.c */
+#define HMOUNT_READAHEAD 128 /* pages */
+
+int hmount(const char *src_dir, const char *mnt, const char *manifest, unsigned readahead, bool foreground);
+
+/* transport microbenchmark, see bench.c */
+#define BENCH_SRC_FILE "bench.bin"
+#define BENCH_DST_FILE "vmcall_bench.json"
+
+int bench_run(const char *src_file, const char *dst_name, unsigned iters, bool acquire_release);
+
+/* PT range resolution, see hrange.c */
+#define HRANGE_SLOTS 4
+#define HRANGE_MAX_SPANS 64 /* scratch ranges before merging into slots */
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} hrange_t;
+
+int hrange_merge(hrange_t *ranges, int num, int max_slots);
+int hrange_module(const char *spec, hrange_t *range);
+int hrange_kallsyms(const char *pattern, hrange_t *ranges, int max);
+int hrange_elf(const char *spec, hrange_t *ranges, int max);
+
+#endif
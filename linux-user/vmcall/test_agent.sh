@@ -14,10 +14,30 @@ vmcall hget -x -o /test enoexist # fail
 
 vmcall hcat /test/foo
 
+mkdir /test/tree
+vmcall hget -r -o /test/tree tree
+vmcall hget -r -o /test/tree tree # all up to date
+vmcall hget -r -o /test/tree enoexist # fail
+mkdir /test/multi
+vmcall hget -r -o /test/multi tree tree2 # two dirs in one run
+vmcall hpush -o multi_bar /test/multi/bar
+
+vmcall hexec hello.sh from hexec | vmcall hcat
+vmcall hget --memfd foo -- sh -c 'cat $HGET_MEMFD' | vmcall hcat
+vmcall hexec enoexist # fail
+
+vmcall run -e - <<EOF
+check
+hget -o /test foo
+cat /test/foo | hcat
+hpush -o run_foo /test/foo
+EOF
+
 vmcall hpush /test/foo
 vmcall hpush -a /test/foo
 vmcall hpush -a /test/foo
 vmcall hpush -o "test_XXXXXX" /test/foo
+vmcall hpush -z -o z_foo /test/foo # z_foo.zst/.lz4 with WITH_ZSTD/WITH_LZ4
 
 vmcall hpush /test/test_2K.bin
 vmcall hpush /test/test_4K.bin
@@ -28,11 +48,34 @@ vmcall hpush /test/test_2M.bin
 
 vmcall hpush /test/enoexit # fail
 
+vmcall hpush -r /test/tree
+
+vmcall hmount tree /test/lazy
+ls -lR /test/lazy | vmcall hcat
+vmcall hpush -o hmount_foo /test/lazy/sub/foo
+umount /test/lazy
+dmesg | vmcall hpush -o dmesg.txt -
+
 vmcall hpush /proc/cpuinfo
 vmcall hpush -o "vmcall.map" /proc/self/maps
 
 vmcall hrange 0,1100-1500
 vmcall hrange 0,101100-202500 1,200000-23423432
+vmcall hrange --kallsyms "ext4_*"
+
+# ELF ranges of a running binary, base is its first mapping (ignored unless PIE)
+sleep 10 & pid=$!
+exe=$(readlink /proc/$pid/exe)
+base=0x$(grep -m1 " $exe\$" /proc/$pid/maps | cut -d- -f1)
+vmcall hrange --elf /proc/$pid/exe@$base 2>&1 | vmcall hpush -o hrange_elf.txt -
+grep " r-xp .* $exe\$" /proc/$pid/maps | vmcall hpush -o hrange_maps.txt -
+kill $pid
+vmcall hrange 0,1000-2000 --module nosuchmod # fail
+
+vmcall bench -n 10
+
+vmcall hcat --kmsg -a
+vmcall hcat --kmsg # fail, unless kernel reported an oops
 
 vmcall hlock
 
@@ -0,0 +1,124 @@
+/*
+ * kAFl/Nyx batched payload format
+ *
+ * Packs several inputs into one kAFL_payload, so that crash-only fuzzing and
+ * corpus replay run many inputs per snapshot cycle:
+ *
+ *   uint32_t magic;              NYX_BATCH_MAGIC ("NYXB")
+ *   uint32_t count;
+ *   struct {
+ *       uint32_t len;
+ *       uint8_t data[len];
+ *   } records[count];
+ *
+ * Fields are little-endian and unaligned. Agents run the records back-to-back
+ * and report the index of the first failing record with nyx_batch_panic().
+ * Header-only implementation usable from Linux userspace, Zephyr and other
+ * bare-metal agents. Depends only on nyx_api.h for integer types and the
+ * hypercall interface.
+ *
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef NYX_BATCH_H
+#define NYX_BATCH_H
+
+#include "nyx_api.h"
+
+#define NYX_BATCH_MAGIC 0x4258594e
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t index; /* index of the record returned last */
+} nyx_batch_t;
+
+static inline uint32_t nyx_batch_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Check if data holds a batch and prepare iteration. Returns the number of
+ * records, or 0 if data is not a well-formed batch.
+ */
+static inline uint32_t nyx_batch_open(nyx_batch_t *batch, const uint8_t *data, uint32_t size)
+{
+	uint32_t offset = 8;
+	uint32_t count, i;
+
+	if (size < 8 || nyx_batch_u32(data) != NYX_BATCH_MAGIC)
+		return 0;
+
+	/* records must fill the payload exactly */
+	count = nyx_batch_u32(data + 4);
+	for (i = 0; i < count; i++) {
+		uint32_t len;
+
+		if (size - offset < 4)
+			return 0;
+		len = nyx_batch_u32(data + offset);
+		offset += 4;
+		if (size - offset < len)
+			return 0;
+		offset += len;
+	}
+	if (offset != size)
+		return 0;
+
+	batch->data = data;
+	batch->size = size;
+	batch->offset = 8;
+	batch->count = count;
+	batch->index = (uint32_t)-1;
+	return count;
+}
+
+/*
+ * Return the next record in data and len, or 0 after the last one
+ */
+static inline int nyx_batch_next(nyx_batch_t *batch, const uint8_t **data, uint32_t *len)
+{
+	if (batch->index + 1 >= batch->count)
+		return 0;
+
+	batch->index++;
+	*len = nyx_batch_u32(batch->data + batch->offset);
+	*data = batch->data + batch->offset + 4;
+	batch->offset += 4 + *len;
+	return 1;
+}
+
+/*
+ * Report record index as cause of a crash or timeout, e.g.
+ * "batch record 12: timeout"
+ */
+static inline void nyx_batch_panic(uint32_t index, const char *reason)
+{
+	static char msg[64];
+	char digits[10];
+	unsigned pos = 0, num = 0;
+	const char *prefix = "batch record ";
+
+	while (*prefix)
+		msg[pos++] = *prefix++;
+	do {
+		digits[num++] = '0' + index % 10;
+		index /= 10;
+	} while (index);
+	while (num)
+		msg[pos++] = digits[--num];
+	msg[pos++] = ':';
+	msg[pos++] = ' ';
+	while (*reason && pos < sizeof(msg) - 1)
+		msg[pos++] = *reason++;
+	msg[pos] = '\0';
+
+	kAFL_hypercall(HYPERCALL_KAFL_PANIC_EXTENDED, (uintptr_t)msg);
+}
+
+#endif /* NYX_BATCH_H */
@@ -0,0 +1,93 @@
+/*
+ * kAFl/Nyx IJON state annotation API
+ *
+ * Freestanding, header-only implementation usable from Linux userspace,
+ * Zephyr and other bare-metal agents. The agent must define ijon_buffer and
+ * ijon_buffer_size and register the buffer with the host through
+ * agent_config.ijon_trace_buffer_vaddr (see libnyx_agent ijon_setup()),
+ * leaving ijon_buffer NULL if the host buffer is below IJON_MIN_SIZE.
+ *
+ * Copyright 2022 Intel Corporation
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef NYX_IJON_H
+#define NYX_IJON_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the IJON buffer (host_config.ijon_bitmap_size bytes):
+ *
+ *   [0, size/2)    - 8-bit counters, written by ijon_set() and ijon_inc()
+ *   [size/2, size) - 64-bit slots, written by ijon_max() and ijon_min()
+ */
+extern uint8_t *ijon_buffer;
+extern uint32_t ijon_buffer_size;
+
+/* smallest buffer with room for one counter and one 64-bit slot */
+#define IJON_MIN_SIZE (2 * sizeof(uint64_t))
+
+static inline uint32_t ijon_hashint(uint32_t loc, uint64_t val)
+{
+	uint64_t hash = (loc ^ val) * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t)(hash >> 32);
+}
+
+static inline void ijon_map_set(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		ijon_buffer[ijon_hashint(loc, val) % (ijon_buffer_size / 2)] |= 1;
+	}
+}
+
+static inline void ijon_map_inc(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		ijon_buffer[ijon_hashint(loc, val) % (ijon_buffer_size / 2)]++;
+	}
+}
+
+static inline void ijon_max_slot(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		uint64_t *slots = (uint64_t *)(ijon_buffer + ijon_buffer_size / 2);
+		uint32_t idx = loc % (ijon_buffer_size / 2 / sizeof(uint64_t));
+
+		if (slots[idx] < val) {
+			slots[idx] = val;
+		}
+	}
+}
+
+/*
+ * Annotation sites are identified at compile time: the last characters of
+ * __FILE__ are hashed by constant-folded macros, then mixed with __LINE__
+ * and __COUNTER__ so several annotations on one line stay distinct.
+ */
+#define IJON_FC(i) \
+	(sizeof(__FILE__) > (i) + 1 ? (uint32_t)(uint8_t)__FILE__[sizeof(__FILE__) - 2 - (i)] : 0u)
+#define IJON_FNV(h, i) ((((uint32_t)(h)) ^ IJON_FC(i)) * 0x01000193u)
+#define IJON_FILE_HASH                                                                        \
+	IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(                  \
+	IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(0x811c9dc5u,      \
+	0), 1), 2), 3), 4), 5), 6), 7), 8), 9), 10), 11), 12), 13), 14), 15)
+
+#ifdef __COUNTER__
+#define IJON_LOC() ((IJON_FILE_HASH ^ (uint32_t)__LINE__) * 0x9e3779b1u + (uint32_t)__COUNTER__)
+#else
+#define IJON_LOC() ((IJON_FILE_HASH ^ (uint32_t)__LINE__) * 0x9e3779b1u)
+#endif
+
+/* reward each new distinct value of x */
+#define ijon_set(x) ijon_map_set(IJON_LOC(), (uint64_t)(x))
+
+/* reward repeated hits of value x (bucketed counters) */
+#define ijon_inc(x) ijon_map_inc(IJON_LOC(), (uint64_t)(x))
+
+/* reward maximizing / minimizing x */
+#define ijon_max(x) ijon_max_slot(IJON_LOC(), (uint64_t)(x))
+#define ijon_min(x) ijon_max_slot(IJON_LOC(), ~(uint64_t)(x))
+
+#endif /* NYX_IJON_H */
@@ -214,4 +214,173 @@ typedef struct {
 	uint64_t addresses[479];
 } req_data_bulk_t;
 
+/******************************************************************************
+ * IJON state annotations (see nyx_ijon.h)
+ *
+ * Buffer layout (host_config.ijon_bitmap_size bytes):
+ *   [0, size/2)    - 8-bit counters, written by ijon_set() and ijon_inc()
+ *   [size/2, size) - 64-bit slots, written by ijon_max() and ijon_min()
+ *****************************************************************************/
+extern uint8_t *ijon_buffer;
+extern uint32_t ijon_buffer_size;
+
+/* smallest buffer with room for one counter and one 64-bit slot */
+#define IJON_MIN_SIZE (2 * sizeof(uint64_t))
+
+static inline uint32_t ijon_hashint(uint32_t loc, uint64_t val)
+{
+	uint64_t hash = (loc ^ val) * 0x9e3779b97f4a7c15ULL;
+	return (uint32_t)(hash >> 32);
+}
+
+static inline void ijon_map_set(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		ijon_buffer[ijon_hashint(loc, val) % (ijon_buffer_size / 2)] |= 1;
+	}
+}
+
+static inline void ijon_map_inc(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		ijon_buffer[ijon_hashint(loc, val) % (ijon_buffer_size / 2)]++;
+	}
+}
+
+static inline void ijon_max_slot(uint32_t loc, uint64_t val)
+{
+	if (ijon_buffer) {
+		uint64_t *slots = (uint64_t *)(ijon_buffer + ijon_buffer_size / 2);
+		uint32_t idx = loc % (ijon_buffer_size / 2 / sizeof(uint64_t));
+
+		if (slots[idx] < val) {
+			slots[idx] = val;
+		}
+	}
+}
+
+/*
+ * Annotation sites are identified at compile time: the last characters of
+ * __FILE__ are hashed by constant-folded macros, then mixed with __LINE__
+ * and __COUNTER__ so several annotations on one line stay distinct.
+ */
+#define IJON_FC(i) \
+	(sizeof(__FILE__) > (i) + 1 ? (uint32_t)(uint8_t)__FILE__[sizeof(__FILE__) - 2 - (i)] : 0u)
+#define IJON_FNV(h, i) ((((uint32_t)(h)) ^ IJON_FC(i)) * 0x01000193u)
+#define IJON_FILE_HASH                                                                        \
+	IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(                  \
+	IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(IJON_FNV(0x811c9dc5u,      \
+	0), 1), 2), 3), 4), 5), 6), 7), 8), 9), 10), 11), 12), 13), 14), 15)
+
+#ifdef __COUNTER__
+#define IJON_LOC() ((IJON_FILE_HASH ^ (uint32_t)__LINE__) * 0x9e3779b1u + (uint32_t)__COUNTER__)
+#else
+#define IJON_LOC() ((IJON_FILE_HASH ^ (uint32_t)__LINE__) * 0x9e3779b1u)
+#endif
+
+#define ijon_set(x) ijon_map_set(IJON_LOC(), (uint64_t)(x))
+#define ijon_inc(x) ijon_map_inc(IJON_LOC(), (uint64_t)(x))
+#define ijon_max(x) ijon_max_slot(IJON_LOC(), (uint64_t)(x))
+#define ijon_min(x) ijon_max_slot(IJON_LOC(), ~(uint64_t)(x))
+
+/******************************************************************************
+ * Batched payloads (see nyx_batch.h)
+ *
+ * Payload layout: uint32_t magic, uint32_t count, then count records of
+ * uint32_t len followed by len bytes of data, all little-endian.
+ *****************************************************************************/
+#define NYX_BATCH_MAGIC 0x4258594e
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t index; /* index of the record returned last */
+} nyx_batch_t;
+
+static inline uint32_t nyx_batch_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Check if data holds a batch and prepare iteration. Returns the number of
+ * records, or 0 if data is not a well-formed batch.
+ */
+static inline uint32_t nyx_batch_open(nyx_batch_t *batch, const uint8_t *data, uint32_t size)
+{
+	uint32_t offset = 8;
+	uint32_t count, i;
+
+	if (size < 8 || nyx_batch_u32(data) != NYX_BATCH_MAGIC)
+		return 0;
+
+	/* records must fill the payload exactly */
+	count = nyx_batch_u32(data + 4);
+	for (i = 0; i < count; i++) {
+		uint32_t len;
+
+		if (size - offset < 4)
+			return 0;
+		len = nyx_batch_u32(data + offset);
+		offset += 4;
+		if (size - offset < len)
+			return 0;
+		offset += len;
+	}
+	if (offset != size)
+		return 0;
+
+	batch->data = data;
+	batch->size = size;
+	batch->offset = 8;
+	batch->count = count;
+	batch->index = (uint32_t)-1;
+	return count;
+}
+
+/*
+ * Return the next record in data and len, or 0 after the last one
+ */
+static inline int nyx_batch_next(nyx_batch_t *batch, const uint8_t **data, uint32_t *len)
+{
+	if (batch->index + 1 >= batch->count)
+		return 0;
+
+	batch->index++;
+	*len = nyx_batch_u32(batch->data + batch->offset);
+	*data = batch->data + batch->offset + 4;
+	batch->offset += 4 + *len;
+	return 1;
+}
+
+/*
+ * Report record index as cause of a crash or timeout, e.g.
+ * "batch record 12: timeout"
+ */
+static inline void nyx_batch_panic(uint32_t index, const char *reason)
+{
+	static char msg[64];
+	char digits[10];
+	unsigned pos = 0, num = 0;
+	const char *prefix = "batch record ";
+
+	while (*prefix)
+		msg[pos++] = *prefix++;
+	do {
+		digits[num++] = '0' + index % 10;
+		index /= 10;
+	} while (index);
+	while (num)
+		msg[pos++] = digits[--num];
+	msg[pos++] = ':';
+	msg[pos++] = ' ';
+	while (*reason && pos < sizeof(msg) - 1)
+		msg[pos++] = *reason++;
+	msg[pos] = '\0';
+
+	kAFL_hypercall(HYPERCALL_KAFL_PANIC_EXTENDED, (uintptr_t)msg);
+}
+
 #endif /* _KAFL_AGENT_LIB_H_ */
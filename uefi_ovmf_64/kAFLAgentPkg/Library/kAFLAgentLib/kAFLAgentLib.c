@@ -17,6 +17,12 @@
 #include <Library/kAFLAgentLib.h>
 
 #define PAYLOAD_MAX_SIZE (128*1024)
+#define IJON_MAX_SIZE (64*1024)
+
+static uint8_t ijon_bss_buffer[IJON_MAX_SIZE] __attribute__((aligned(4096)));
+
+uint8_t *ijon_buffer = NULL;
+uint32_t ijon_buffer_size = 0;
 
 #ifndef KAFL_AGENT_EXTERNAL_AGENT_INIT
 void agent_init(void *panic_handler, void *kasan_handler)
@@ -77,6 +83,16 @@ void agent_init(void *panic_handler, void *kasan_handler)
   agent_config.agent_non_reload_mode = 1; // allow persistent
   agent_config.coverage_bitmap_size = host_config.bitmap_size;
 
+  /* IJON annotations, if supported by host */
+  if (host_config.ijon_bitmap_size >= IJON_MIN_SIZE &&
+      host_config.ijon_bitmap_size <= IJON_MAX_SIZE) {
+    SetMem (ijon_bss_buffer, IJON_MAX_SIZE, 0);
+    ijon_buffer = ijon_bss_buffer;
+    ijon_buffer_size = host_config.ijon_bitmap_size;
+    agent_config.agent_ijon_tracing = 1;
+    agent_config.ijon_trace_buffer_vaddr = (uintptr_t)ijon_buffer;
+  }
+
   hprintf("Sending agent configuration\n");
   kAFL_hypercall(HYPERCALL_KAFL_SET_AGENT_CONFIG, (uintptr_t)&agent_config);
   hprintf("End send agent configuration\n");
@@ -98,6 +114,9 @@ void agent_run()
   b = (void *)(long int *)a;
   DebugPrint (DEBUG_INFO, "after alignement %p\n", b);
   kAFL_payload* payload_buffer = (kAFL_payload*)b;
+#ifdef NYX_BATCH
+  nyx_batch_t batch;
+#endif
 
   kAFL_hypercall(HYPERCALL_KAFL_GET_PAYLOAD, (uint_ptr)payload_buffer);
   kAFL_hypercall(HYPERCALL_KAFL_SUBMIT_CR3, 0);
@@ -106,6 +125,18 @@ void agent_run()
     kAFL_hypercall(HYPERCALL_KAFL_NEXT_PAYLOAD, 0);
     kAFL_hypercall(HYPERCALL_KAFL_ACQUIRE, 0);
 
+#ifdef NYX_BATCH
+    if (nyx_batch_open(&batch, payload_buffer->data, payload_buffer->size)) {
+      const uint8_t *data;
+      uint32_t len;
+
+      while (nyx_batch_next(&batch, &data, &len)) {
+        RunTestHarness((VOID *)data, len);
+      }
+      kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
+      continue;
+    }
+#endif
     RunTestHarness(payload_buffer->data, payload_buffer->size);
 
     kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
@@ -90,6 +90,10 @@ void HarnessInit(void *panic_handler, void *kasan_handler)
 }
 
 void HarnessRun(void) {
+#ifdef NYX_BATCH
+  nyx_batch_t batch;
+#endif
+
   DebugPrint (DEBUG_INFO, "Mapping info: kAFL buffer in heap 0x%016lx\n",
       (void*)payload_buffer);
 
@@ -115,6 +119,18 @@ void HarnessRun(void) {
   while (1) {
     kAFL_hypercall(HYPERCALL_KAFL_NEXT_PAYLOAD, 0);
     kAFL_hypercall(HYPERCALL_KAFL_ACQUIRE, 0);
+#ifdef NYX_BATCH
+    if (nyx_batch_open(&batch, payload_buffer->data, payload_buffer->size)) {
+      const uint8_t *data;
+      uint32_t len;
+
+      while (nyx_batch_next(&batch, &data, &len)) {
+        RunkAFLTarget((uint8_t *)data, len);
+      }
+      kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
+      continue;
+    }
+#endif
     RunkAFLTarget(payload_buffer->data, payload_buffer->size);
     kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
   }
@@ -18,6 +18,7 @@ Build and fuzz the UEFI OVMF sample.
 
 This script assumes KAFL at $KAFL_ROOT and EDK2 cloned to $EDK2_ROOT.
 Build settings in Conf/target.txt will be overridden with '$BUILD_OPTS'.
+Set KAFL_BATCH=1 to build agents that also accept batched payloads.
 
 Usage: $0 <target>
 
@@ -249,6 +250,12 @@ BUILD_OPTS="${BUILD_OPTS} \
     -b ${BUILD} \
     -n $(nproc)"
 
+# optionally accept batched payloads (see nyx_batch.h)
+if test -n "$KAFL_BATCH"
+then
+  BUILD_OPTS="${BUILD_OPTS} -D NYX_BATCH=TRUE"
+fi
+
 
 CMD=$1; shift || usage
 
@@ -105,7 +105,7 @@ function build_app() {
    	mkdir build || fail "Could not create build/ directory. Exit."
 	cd build
 	#cmake -GNinja -DBOARD=qemu_x86_64 -DKAFL_${APP}=y ..
-	cmake -GNinja -DBOARD=qemu_x86 -DKAFL_${APP}=y ..
+	cmake -GNinja -DBOARD=qemu_x86 -DKAFL_${APP}=y ${KAFL_BATCH:+-DKAFL_BATCH=y} ..
 	ninja
 	popd
 }
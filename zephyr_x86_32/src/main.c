@@ -16,14 +16,30 @@
 
 #define _GNU_SOURCE
 #include "../../nyx_api.h"
+#include "../../nyx_ijon.h"
+#ifdef NYX_BATCH
+#include "../../nyx_batch.h"
+#endif
 #include "target.h"
 
 #define PAYLOAD_MAX_SIZE (128*1024)
+#define IJON_MAX_SIZE (64*1024)
 
 #ifndef PAYLOAD_ON_HEAP
 static uint8_t bss_buffer[PAYLOAD_MAX_SIZE] __attribute__((aligned(4096)));
 #endif
 
+static uint8_t ijon_bss_buffer[IJON_MAX_SIZE] __attribute__((aligned(4096)));
+
+uint8_t *ijon_buffer = NULL;
+uint32_t ijon_buffer_size = 0;
+
+#ifdef NYX_BATCH
+/* batched payload currently executing, see nyx_batch.h */
+static nyx_batch_t batch;
+static bool batch_active = false;
+#endif
+
 static void agent_init(void *panic_handler, void *kasan_handler)
 {
 	hprintf("Initiate fuzzer handshake...\n");
@@ -73,6 +89,16 @@ static void agent_init(void *panic_handler, void *kasan_handler)
 	agent_config.agent_non_reload_mode = 1; // allow persistent
 	agent_config.coverage_bitmap_size = host_config.bitmap_size;
 
+	/* IJON annotations, if supported by host (see nyx_ijon.h) */
+	if (host_config.ijon_bitmap_size >= IJON_MIN_SIZE &&
+	    host_config.ijon_bitmap_size <= IJON_MAX_SIZE) {
+		memset(ijon_bss_buffer, 0, IJON_MAX_SIZE);
+		ijon_buffer = ijon_bss_buffer;
+		ijon_buffer_size = host_config.ijon_bitmap_size;
+		agent_config.agent_ijon_tracing = 1;
+		agent_config.ijon_trace_buffer_vaddr = (uintptr_t)ijon_buffer;
+	}
+
 	kAFL_hypercall(HYPERCALL_KAFL_SET_AGENT_CONFIG, (uintptr_t)&agent_config);
 }
 
@@ -104,6 +130,20 @@ static void agent_run(void)
 		kAFL_hypercall(HYPERCALL_KAFL_NEXT_PAYLOAD, 0);
 		kAFL_hypercall(HYPERCALL_KAFL_ACQUIRE, 0);
 		//hprintf("target_entry()...\n");
+#ifdef NYX_BATCH
+		if (nyx_batch_open(&batch, payload_buffer->data, payload_buffer->size)) {
+			const uint8_t *data;
+			uint32_t len;
+
+			batch_active = true;
+			while (nyx_batch_next(&batch, &data, &len)) {
+				target_entry((const char *)data, len);
+			}
+			batch_active = false;
+			kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
+			continue;
+		}
+#endif
 		target_entry(payload_buffer->data, payload_buffer->size);
 
 		kAFL_hypercall(HYPERCALL_KAFL_RELEASE, 0);
@@ -116,6 +156,14 @@ static void agent_run(void)
  */
 void k_sys_fatal_error_handler(unsigned int reason, const z_arch_esf_t *esf)
 {
+#ifdef NYX_BATCH
+	/* attribute the crash to the record of a batched payload */
+	if (batch_active) {
+		nyx_batch_panic(batch.index, reason == K_ERR_KERNEL_OOPS ? "oops" : "crash");
+		k_fatal_halt(reason);
+	}
+#endif
+
 	switch (reason) {
 		case K_ERR_KERNEL_OOPS:
 			kAFL_hypercall(HYPERCALL_KAFL_KASAN, 0);